@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Config analyzer
+// --------------------------------------
+//
+// `keyboard_remapper --check [config.txt]` parses the config with the
+// regular parser and reports what would silently not work at runtime:
+// remaps shadowed by an earlier entry of the dispatch order, layers that
+// nothing can activate, cycles between master and slave layers and
+// with_other values discarded by register_remap. The per-key decision
+// table is printed in the order handle_input walks it.
+
+// Dispatch lists, by scan code then by virtual code. handle_input takes a remap
+// of an active layer from either before a base layer one, see find_key_remap.
+#define DISPATCH_LIST_COUNT (512 + 256)
+
+static struct RemapNode * dispatch_list(struct Config * config, int index) {
+    return index < 512 ? config->remap_by_scan[index] : config->remap_array[index - 512];
+}
+
+static const char * analyze_layer_name(struct Config * config, int id) {
+    return id ? config->layers[id].name : "-";
+}
+
+static void print_key_nodes(const char * label, struct KeyDefNode * head) {
+    if (!head) return;
+    printf("  %s=", label);
+    struct KeyDefNode * cur = head;
+    do {
+        printf("%s%s", cur->key_def->name, cur->next != head ? "," : "");
+        cur = cur->next;
+    } while (cur != head);
+}
+
+static void print_layer_confs(struct Config * config, const char * label, struct LayerConf * head) {
+    for (struct LayerConf * cur = head; cur; cur = cur->next) {
+        printf("  %s=%s_%s", label,
+               cur->conf == toggle_layer_lock ? "toggle" : cur->conf == set_layer_lock ? "set" : "reset",
+               analyze_layer_name(config, cur->layer));
+    }
+}
+
+static int any_layer_node(struct LayerNode * head, const char * reachable) {
+    for (struct LayerNode * cur = head; cur; cur = cur->next) {
+        if (reachable[cur->layer]) return 1;
+    }
+    return 0;
+}
+
+static int all_layer_nodes(struct LayerNode * head, const char * reachable) {
+    for (struct LayerNode * cur = head; cur; cur = cur->next) {
+        if (!reachable[cur->layer]) return 0;
+    }
+    return head != NULL;
+}
+
+/*
+ * Marks the layers that can become active: switched on by a reachable remap
+ * (when_press, when_doublepress, toggle or set lock), or through their
+ * or_layer / and_layer masters. and_not_layer is assumed to be satisfiable.
+ */
+static void find_reachable_layers(struct Config * config, char * reachable) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int id = 1; id < 256 && config->remap_by_id[id]; id++) {
+            struct Remap * remap = config->remap_by_id[id];
+            if (remap->layer && !reachable[remap->layer]) continue;
+            int targets[2] = {remap->to_when_press_layer, remap->to_when_doublepress_layer};
+            for (int i = 0; i < 2; i++) {
+                if (targets[i] && !reachable[targets[i]]) {
+                    reachable[targets[i]] = changed = 1;
+                }
+            }
+            struct LayerConf * confs[2] = {remap->to_when_tap_lock_layer, remap->to_when_double_tap_lock_layer};
+            for (int i = 0; i < 2; i++) {
+                for (struct LayerConf * cur = confs[i]; cur; cur = cur->next) {
+                    if (cur->conf != reset_layer_lock && !reachable[cur->layer]) {
+                        reachable[cur->layer] = changed = 1;
+                    }
+                }
+            }
+        }
+        for (int id = 1; id < config->layer_count; id++) {
+            struct Layer * layer = &config->layers[id];
+            if (!reachable[id] &&
+                (any_layer_node(layer->or_master_layers, reachable) ||
+                 all_layer_nodes(layer->and_master_layers, reachable))) {
+                reachable[id] = changed = 1;
+            }
+        }
+    }
+}
+
+/* @return 1 if a cycle goes through id, its path is printed */
+static int find_layer_cycle(struct Config * config, int id, char * visit, int * path, int depth) {
+    if (visit[id] == 2) return 0;
+    if (visit[id] == 1) {
+        int start = 0;
+        while (path[start] != id) start++;
+        printf("Config error: Layer cycle ");
+        for (int i = start; i < depth; i++) {
+            printf("%s -> ", analyze_layer_name(config, path[i]));
+        }
+        printf("%s, the layer state can't be resolved.\n", analyze_layer_name(config, id));
+        return 1;
+    }
+    visit[id] = 1;
+    path[depth] = id;
+    struct LayerNode * lists[3] = {
+        config->layers[id].or_master_layers,
+        config->layers[id].and_master_layers,
+        config->layers[id].and_not_master_layers,
+    };
+    for (int i = 0; i < 3; i++) {
+        for (struct LayerNode * cur = lists[i]; cur; cur = cur->next) {
+            if (find_layer_cycle(config, cur->layer, visit, path, depth + 1)) {
+                return 1;
+            }
+        }
+    }
+    visit[id] = 2;
+    return 0;
+}
+
+/* @return number of problems found */
+int analyze_config(struct Config * config) {
+    int problems = 0;
+
+    char * visit = calloc(config->layer_count, 1);
+    int * path = calloc(config->layer_count, sizeof(int));
+    for (int id = 1; id < config->layer_count; id++) {
+        if (find_layer_cycle(config, id, visit, path, 0)) {
+            // Only the first cycle is reported, the rest of the graph is unreliable.
+            problems++;
+            break;
+        }
+    }
+    free(visit);
+    free(path);
+
+    char * reachable = calloc(config->layer_count, 1);
+    find_reachable_layers(config, reachable);
+    for (int id = 1; id < config->layer_count; id++) {
+        if (!reachable[id]) {
+            printf("Config warning: Layer '%s' can never be activated.\n", analyze_layer_name(config, id));
+            problems++;
+        }
+    }
+
+    for (int index = 0; index < DISPATCH_LIST_COUNT; index++) {
+        for (struct RemapNode * node = dispatch_list(config, index); node; node = node->next) {
+            struct Remap * remap = node->remap;
+            if (remap->to_with_other_discarded) {
+                printf("Config warning (line %d): with_other of '%s' is ignored, only modifiers are allowed.\n",
+                       remap->line, remap->from->name);
+                problems++;
+            }
+            if (remap->layer && !reachable[remap->layer]) {
+                printf("Config warning (line %d): Remapping of '%s' is unreachable, layer '%s' can never be activated.\n",
+                       remap->line, remap->from->name, analyze_layer_name(config, remap->layer));
+                problems++;
+            }
+            // handle_input takes the first remap whose layer is active.
+            for (struct RemapNode * prev = dispatch_list(config, index); prev != node; prev = prev->next) {
+                if (prev->remap->from->virt_code == remap->from->virt_code &&
+                    (prev->remap->layer == 0 || prev->remap->layer == remap->layer)) {
+                    printf("Config warning (line %d): Remapping of '%s' is shadowed by line %d.\n",
+                           remap->line, remap->from->name, prev->remap->line);
+                    problems++;
+                    break;
+                }
+            }
+        }
+    }
+    free(reachable);
+    return problems;
+}
+
+void dump_decision_table(struct Config * config) {
+    printf("\nDecision table (first match of an active layer wins, then of the base layer):\n");
+    for (int index = 0; index < DISPATCH_LIST_COUNT; index++) {
+        for (struct RemapNode * node = dispatch_list(config, index); node; node = node->next) {
+            struct Remap * remap = node->remap;
+            printf("%-16s layer=%-16s line=%-4d", remap->from->name, analyze_layer_name(config, remap->layer), remap->line);
+            print_key_nodes("when_alone", remap->to_when_alone);
+            print_key_nodes("with_other", remap->to_with_other);
+            if (remap->to_with_other_dummy) printf("  with_other=");
+            print_key_nodes("when_doublepress", remap->to_when_doublepress);
+            print_key_nodes("when_tap_lock", remap->to_when_tap_lock);
+            print_key_nodes("when_double_tap_lock", remap->to_when_double_tap_lock);
+            if (remap->to_when_press_layer) {
+                printf("  when_press=%s", analyze_layer_name(config, remap->to_when_press_layer));
+            }
+            if (remap->to_when_doublepress_layer) {
+                printf("  when_doublepress=%s", analyze_layer_name(config, remap->to_when_doublepress_layer));
+            }
+            print_layer_confs(config, "when_tap_lock", remap->to_when_tap_lock_layer);
+            print_layer_confs(config, "when_double_tap_lock", remap->to_when_double_tap_lock_layer);
+            printf("\n");
+        }
+    }
+}
@@ -0,0 +1,465 @@
+#define VERSION "1.1.2"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform_posix.c"
+#include "engine.c"
+#include "replay.c"
+
+// Benchmarks
+// --------------------------------------
+//
+// Builds the engine like the headless backend, see `make bench`. The key
+// lookups of keys.c are timed first: each key of key_table looked up by
+// name, virtual code, scan code and friendly name, in ns per lookup. Then
+// load_config_file of a config of BENCH_CONFIG_LINES remap lines in
+// application profiles, and read_config of the configs of depth
+// BENCH_MAX_DEPTH, without and with the cache of cache.c. The configs are
+// generated in a temporary directory for each size of bench_remaps and
+// define_layer nesting depth of bench_depths:
+// - F1 to F<n> hold layer_h1 to layer_h<n>, n is the depth or 1,
+// - define_layer nests layer_n<k> as layer_h<k> and layer_n<k-1>,
+// - remaps go to the base layer first, one per key of key_table, then to
+//   the innermost layer. Every tenth one is a dual key.
+// A generated typing trace (rolling key presses, dual key chords and words
+// typed with the layer keys held) is then replayed like `--replay` times
+// it: ns per event and, where perf counters are available, cache and branch
+// misses per event, on stderr, as JSON lines with --json.
+//
+// --residency-trace only prints a trace for the Linux backend, see
+// print_residency_trace.
+
+#define BENCH_MAX_DEPTH 8
+#define BENCH_WORDS 200
+#define BENCH_CONFIG_LINES 10000 // of the long config
+
+enum BenchLookup {
+    LOOKUP_BY_NAME,
+    LOOKUP_BY_VIRT_CODE,
+    LOOKUP_BY_SCAN_CODE,
+    LOOKUP_FRIENDLY_NAME,
+    LOOKUP_COUNT,
+};
+
+static const char * bench_lookup_names[] = {
+    "find_key_def_by_name",
+    "find_key_def_by_virt_code",
+    "find_key_def_by_scan_code",
+    "friendly_virt_code_name",
+};
+
+static const int bench_remaps[] = {10, 100, 255};
+static const int bench_depths[] = {0, 2, 4, BENCH_MAX_DEPTH};
+
+static char g_bench_dir[] = "/tmp/keyboard_remapper_bench.XXXXXX";
+static uint32_t g_bench_random = 1;
+
+// Stands in for SendInput, the queued inputs are dropped.
+void wake_output() {
+    record_inputs(NULL, &g_input_buffer);
+}
+
+// There are no hooks to renew.
+void rehook() {
+}
+
+// Nor requests to serve.
+void wake_engine() {
+}
+
+// Nor an engine thread, see capture.c.
+void capture_send(struct CapturedInput * input, int block_input) {
+}
+
+// The same sequence on every run.
+static uint32_t bench_random() {
+    g_bench_random = g_bench_random * 1103515245 + 12345;
+    return (g_bench_random >> 16) & 0x7FFF;
+}
+
+static int layer_keys(int depth) {
+    return depth ? depth : 1;
+}
+
+/* Keys that may be remapped: the first name of each virtual code, no
+ * modifiers, no mouse keys, no layer keys (F1 to F8).
+ * @return number of keys */
+static int bench_keys(KEY_DEF ** keys) {
+    int count = 0;
+    for (int i = 0; i < KEY_TABLE_LEN; i++) {
+        KEY_DEF * key = &key_table[i];
+        if (key->virt_code <= 0 || key->modifier) continue;
+        if (key->virt_code >= 0x70 && key->virt_code < 0x70 + BENCH_MAX_DEPTH) continue;
+        if (find_key_def_by_virt_code(key->virt_code) != key) continue;
+        keys[count++] = key;
+    }
+    return count;
+}
+
+// Looks every key up again and again for REPLAY_TIMING_MS.
+static void bench_lookup(enum BenchLookup lookup) {
+    struct timespec start, now;
+    double seconds;
+    long lookups = 0;
+    uintptr_t sink = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        for (int i = 0; i < KEY_TABLE_LEN; i++) {
+            KEY_DEF * key = &key_table[i];
+            switch (lookup) {
+            case LOOKUP_BY_NAME: sink += (uintptr_t)find_key_def_by_name(key->name); break;
+            case LOOKUP_BY_VIRT_CODE: sink += (uintptr_t)find_key_def_by_virt_code(key->virt_code); break;
+            case LOOKUP_BY_SCAN_CODE: sink += (uintptr_t)find_key_def_by_scan_code(key->scan_code); break;
+            default: sink += (uintptr_t)friendly_virt_code_name(key->virt_code); break;
+            }
+        }
+        lookups += KEY_TABLE_LEN;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    } while (seconds * 1000 < REPLAY_TIMING_MS);
+    // The sink keeps the lookups from being optimized away.
+    if (sink == 0) fprintf(stderr, "No key found.\n");
+    double ns_per_lookup = seconds * 1e9 / lookups;
+    if (g_replay_json) {
+        fprintf(stderr, "{\"lookup\": \"%s\", \"keys\": %d, \"lookups\": %ld, \"ns_per_lookup\": %.2f}\n",
+                bench_lookup_names[lookup], (int)KEY_TABLE_LEN, lookups, ns_per_lookup);
+    } else {
+        fprintf(stderr, "%s: %d keys, %.1f ns/lookup\n", bench_lookup_names[lookup], (int)KEY_TABLE_LEN,
+                ns_per_lookup);
+    }
+}
+
+static void write_bench_remaps(FILE * out, int remaps, int depth) {
+    KEY_DEF * keys[KEY_TABLE_LEN];
+    int key_count = bench_keys(keys);
+    for (int k = 1; k <= layer_keys(depth); k++) {
+        fprintf(out, "remap_key=F%d\nwhen_press=layer_h%d\n\n", k, k);
+    }
+    for (int k = 1; k <= depth; k++) {
+        fprintf(out, "define_layer=layer_n%d\nand_layer=layer_h%d\n", k, k);
+        if (k > 1) fprintf(out, "and_layer=layer_n%d\n", k - 1);
+        fprintf(out, "\n");
+    }
+    for (int i = 0; i < remaps - layer_keys(depth); i++) {
+        fprintf(out, "remap_key=%s\n", keys[i % key_count]->name);
+        if (i >= key_count && depth) fprintf(out, "layer=layer_n%d\n", depth);
+        if (i >= key_count && !depth) fprintf(out, "layer=layer_h1\n");
+        fprintf(out, "when_alone=%s\n", keys[(i + 1) % key_count]->name);
+        if (i % 10 == 0) fprintf(out, "with_other=LEFT_CTRL\n");
+        fprintf(out, "\n");
+    }
+}
+
+static void write_bench_config(FILE * out, int remaps, int depth) {
+    write_bench_remaps(out, remaps, depth);
+    fprintf(out, "hold_delay=60\ntap_timeout=500\ndoublepress_timeout=200\n");
+}
+
+static void add_event(struct TraceEvent * events, int * count, uint64_t time, KEY_DEF * key, enum Direction direction) {
+    struct TraceEvent * event = &events[(*count)++];
+    event->time = time;
+    event->scan_code = key->scan_code;
+    event->virt_code = key->virt_code;
+    event->direction = direction;
+    event->is_injected = 0;
+    event->extra = 0;
+    event->window = 0;
+    event->reload = 0;
+}
+
+// Types a word of 2 to 8 letters, each key pressed before the previous one is released.
+static uint64_t type_word(struct TraceEvent * events, int * count, uint64_t time) {
+    int length = 2 + bench_random() % 7;
+    KEY_DEF * previous = NULL;
+    for (int i = 0; i < length; i++) {
+        KEY_DEF * key = find_key_def_by_virt_code('A' + bench_random() % 26);
+        add_event(events, count, time, key, DOWN);
+        if (previous) add_event(events, count, time + 30000, previous, UP);
+        previous = key;
+        time += 60000 + bench_random() % 60000;
+    }
+    add_event(events, count, time, previous, UP);
+    return time + 30000;
+}
+
+/* Words separated by SPACE, every 10th one typed with the first dual key
+ * held, every 25th one with the layer keys held.
+ * @return number of events */
+static int bench_trace(struct TraceEvent ** events, int depth) {
+    KEY_DEF * keys[KEY_TABLE_LEN];
+    bench_keys(keys);
+    KEY_DEF * space = find_key_def_by_name("SPACE");
+    *events = malloc(BENCH_WORDS * (2 * 8 + 2 + 2 * BENCH_MAX_DEPTH) * sizeof(struct TraceEvent));
+    int count = 0;
+    uint64_t time = 1000000;
+    g_bench_random = 1;
+    for (int word = 1; word <= BENCH_WORDS; word++) {
+        KEY_DEF * holders[BENCH_MAX_DEPTH];
+        int holder_count = 0;
+        if (word % 25 == 0) {
+            for (int k = 1; k <= layer_keys(depth); k++) {
+                char name[4];
+                snprintf(name, sizeof(name), "F%d", k);
+                holders[holder_count++] = find_key_def_by_name(name);
+            }
+        } else if (word % 10 == 0) {
+            holders[holder_count++] = keys[0];
+        }
+        for (int k = 0; k < holder_count; k++) {
+            add_event(*events, &count, time, holders[k], DOWN);
+            time += 20000;
+        }
+        time = type_word(*events, &count, time + 100000);
+        for (int k = holder_count - 1; k >= 0; k--) {
+            add_event(*events, &count, time, holders[k], UP);
+            time += 20000;
+        }
+        add_event(*events, &count, time, space, DOWN);
+        add_event(*events, &count, time + 70000, space, UP);
+        time += 150000;
+    }
+    return count;
+}
+
+/* Writes a generated config in g_bench_dir.
+ * @return error */
+static int write_bench_file(char * path, wchar_t * config_path, int remaps, int depth) {
+    snprintf(path, MAX_PATH, "%s/config_%d_%d.txt", g_bench_dir, remaps, depth);
+    mbstowcs(config_path, path, MAX_PATH);
+    FILE * file = fopen(path, "w");
+    if (file == NULL) return 1;
+    write_bench_config(file, remaps, depth);
+    fclose(file);
+    return 0;
+}
+
+/* Times read_config of a generated config: cold, the cache removed before
+ * each load, so the config is parsed and save_config_cache writes it, then
+ * cached, loaded by load_config_cache.
+ * @return error */
+static int bench_startup(int remaps, int depth) {
+    char path[MAX_PATH], cache_file[MAX_PATH];
+    wchar_t config_path[MAX_PATH], cache_path[MAX_PATH];
+    if (write_bench_file(path, config_path, remaps, depth)) return 1;
+    put_config_cache_path(cache_path, config_path);
+    wcstombs(cache_file, cache_path, MAX_PATH);
+    double us_per_load[2];
+    int err = 0;
+    for (int cached = 0; cached < 2 && !err; cached++) {
+        struct timespec start, now;
+        double seconds;
+        long loads = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            if (!cached) remove(cache_file);
+            struct Config * config = read_config(config_path);
+            if (config == NULL) {
+                err = 1;
+                break;
+            }
+            free_config(config);
+            loads++;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+        } while (seconds * 1000 < REPLAY_TIMING_MS);
+        if (loads) us_per_load[cached] = seconds * 1e6 / loads;
+    }
+    remove(cache_file);
+    remove(path);
+    if (err) return 1;
+    if (g_replay_json) {
+        fprintf(stderr, "{\"startup\": \"remaps=%d depth=%d\", \"cold_us\": %.1f, \"cached_us\": %.1f}\n",
+                remaps, depth, us_per_load[0], us_per_load[1]);
+    } else {
+        fprintf(stderr, "read_config remaps=%d depth=%d: %.1f us cold, %.1f us cached\n", remaps, depth,
+                us_per_load[0], us_per_load[1]);
+    }
+    return 0;
+}
+
+/* Writes a config of BENCH_CONFIG_LINES remap_key, when_*, layer and
+ * define_layer lines, a few more to end on a whole remap, without comments
+ * nor blank lines: the remaps of the config of 255 remaps and depth
+ * BENCH_MAX_DEPTH, then application profiles of the same remaps, as a
+ * config outgrowing 255 remaps would.
+ * @return number of lines, 0 on error */
+static int write_long_config(const char * path) {
+    char * text;
+    size_t size;
+    FILE * buffer = open_memstream(&text, &size);
+    if (buffer == NULL) return 0;
+    write_bench_remaps(buffer, 255, BENCH_MAX_DEPTH);
+    fclose(buffer);
+    FILE * out = fopen(path, "w");
+    if (out == NULL) {
+        free(text);
+        return 0;
+    }
+    int lines = 0;
+    for (int profile = 0; lines < BENCH_CONFIG_LINES; profile++) {
+        if (profile) {
+            fprintf(out, "profile=app%d\nmatch=app%d.exe\n", profile, profile);
+            lines += 2;
+        }
+        for (char * line = text, * end; *line; line = end + 1) {
+            end = strchr(line, '\n');
+            if (end == line) continue;
+            if (lines >= BENCH_CONFIG_LINES && strncmp(line, "remap_key=", 10) == 0) break;
+            fprintf(out, "%.*s\n", (int)(end - line), line);
+            lines++;
+        }
+    }
+    fclose(out);
+    free(text);
+    return lines;
+}
+
+/* Times load_config_file of the long config.
+ * @return error */
+static int bench_long_config() {
+    char path[MAX_PATH];
+    wchar_t config_path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/config_long.txt", g_bench_dir);
+    mbstowcs(config_path, path, MAX_PATH);
+    int lines = write_long_config(path);
+    if (lines == 0) return 1;
+    struct timespec start, now;
+    double seconds;
+    long loads = 0;
+    int err = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        struct Config * config = new_config();
+        err = load_config_file(config, config_path);
+        free_config(config);
+        if (err) break;
+        loads++;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    } while (seconds * 1000 < REPLAY_TIMING_MS);
+    remove(path);
+    if (err) return 1;
+    double ms_per_load = seconds * 1e3 / loads;
+    if (g_replay_json) {
+        fprintf(stderr, "{\"load\": \"config_long.txt\", \"lines\": %d, \"ms\": %.3f, \"ns_per_line\": %.1f}\n",
+                lines, ms_per_load, ms_per_load * 1e6 / lines);
+    } else {
+        fprintf(stderr, "load_config_file of %d lines: %.3f ms, %.1f ns/line\n", lines, ms_per_load,
+                ms_per_load * 1e6 / lines);
+    }
+    return 0;
+}
+
+/* Times the typing trace with a generated config.
+ * @return error */
+static int bench_config(int remaps, int depth) {
+    char path[MAX_PATH];
+    wchar_t config_path[MAX_PATH];
+    if (write_bench_file(path, config_path, remaps, depth)) return 1;
+    struct Config * config = new_config();
+    int err = load_config_file(config, config_path);
+    remove(path);
+    if (err) {
+        free_config(config);
+        return 1;
+    }
+    activate_config(config);
+    input_buffer_init(&g_input_buffer);
+    set_clock_source(&replay_clock_source);
+    g_last_input = 0;
+    g_recorder_auto_dump = 0;
+    reset_invariants();
+
+    struct TraceEvent * events;
+    int count = bench_trace(&events, depth);
+    struct ReplayTiming timing;
+    time_trace(events, count, &timing);
+    char name[64];
+    snprintf(name, sizeof(name), "remaps=%d depth=%d", remaps, depth);
+    print_timing(name, count, &timing);
+
+    unlock_all(&g_input_buffer);
+    record_inputs(NULL, &g_input_buffer);
+    free_config(g_config);
+    g_config = NULL;
+    set_clock_source(NULL);
+    free(events);
+    return 0;
+}
+
+/* Prints a trace of count key events at rate events per second, plain typing
+ * and every 4th word typed with LEFT_CTRL held, for `make bench-residency`.
+ * @return exit code */
+static int print_residency_trace(int count, int rate) {
+    if (count <= 0 || rate <= 0) return 2;
+    KEY_DEF * ctrl = find_key_def_by_name("LEFT_CTRL");
+    double step_ms = 1000.0 / rate;
+    double time = 0;
+    int events = 0;
+    for (int word = 1; events < count; word++) {
+        int chord = word % 4 == 0;
+        if (chord) {
+            printf("%.3f 0x%02X 0x%02X DOWN\n", time, ctrl->scan_code, ctrl->virt_code);
+            time += step_ms;
+            events++;
+        }
+        for (int length = 2 + bench_random() % 5; length > 0 && events < count; length--) {
+            KEY_DEF * key = find_key_def_by_virt_code('A' + bench_random() % 26);
+            printf("%.3f 0x%02X 0x%02X DOWN\n", time, key->scan_code, key->virt_code);
+            printf("%.3f 0x%02X 0x%02X UP\n", time + step_ms, key->scan_code, key->virt_code);
+            time += 2 * step_ms;
+            events += 2;
+        }
+        if (chord) {
+            printf("%.3f 0x%02X 0x%02X UP\n", time, ctrl->scan_code, ctrl->virt_code);
+            time += step_ms;
+            events++;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    build_key_index();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            g_replay_json = 1;
+        } else if (strcmp(argv[i], "--residency-trace") == 0 && i + 2 < argc) {
+            return print_residency_trace(atoi(argv[i + 1]), atoi(argv[i + 2]));
+        } else {
+            printf("keyboard_remapper %s (bench)\n\n", VERSION);
+            printf("Usage: %s [--json]\n", argv[0]);
+            printf("       %s --residency-trace count events_per_s\n", argv[0]);
+            return 2;
+        }
+    }
+    if (mkdtemp(g_bench_dir) == NULL) {
+        printf("Cannot create a temporary directory.\n");
+        return 1;
+    }
+    for (int lookup = 0; lookup < LOOKUP_COUNT; lookup++) {
+        bench_lookup(lookup);
+    }
+    int exit_code = 0;
+    if (bench_long_config()) {
+        printf("Cannot load the config of %d lines.\n", BENCH_CONFIG_LINES);
+        exit_code = 1;
+    }
+    for (int r = 0; r < sizeof(bench_remaps) / sizeof(bench_remaps[0]); r++) {
+        if (bench_startup(bench_remaps[r], BENCH_MAX_DEPTH)) {
+            printf("Cannot load the config of %d remaps and depth %d.\n", bench_remaps[r], BENCH_MAX_DEPTH);
+            exit_code = 1;
+        }
+    }
+    for (int r = 0; r < sizeof(bench_remaps) / sizeof(bench_remaps[0]); r++) {
+        for (int d = 0; d < sizeof(bench_depths) / sizeof(bench_depths[0]); d++) {
+            if (bench_config(bench_remaps[r], bench_depths[d])) {
+                printf("Cannot load the config of %d remaps and depth %d.\n", bench_remaps[r], bench_depths[d]);
+                exit_code = 1;
+            }
+        }
+    }
+    rmdir(g_bench_dir);
+    return exit_code;
+}
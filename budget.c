@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "platform.h"
+#include "input.h"
+
+// Hook time budget
+// --------------------------------------
+//
+// Windows passes an input on by itself when a hook takes longer than
+// LowLevelHooksTimeout, and after a few of them removes the hook without a
+// word. The backends time every input callback with budget_start and
+// budget_end, on the real clock: the engine clock is virtual in the replays.
+// A rolling average of the callback times is kept.
+//
+// When an input takes half of HOOK_TIMEOUT_US, or the average a tenth of it,
+// the engine goes degraded: handle_input still resolves the remaps, else
+// keys would be left down, but skips the work that is not needed for that,
+// the debug log to start with. It leaves once the average is back under a
+// fortieth of it. Both changes are written to debug.log with the counters.
+//
+// g_slow_path_us adds a busy wait to the work skipped when degraded, to try
+// it out, see --slow-path of the Linux backend.
+
+#ifndef HOOK_TIMEOUT_US
+#define HOOK_TIMEOUT_US 200000 // below the LowLevelHooksTimeout seen in practice
+#endif
+#define HOOK_AVERAGE_SHIFT 3 // the last input weighs 1/8
+
+struct HookBudget {
+    uint64_t inputs;
+    uint64_t slow_inputs;     // over half of HOOK_TIMEOUT_US
+    uint64_t degraded_inputs; // handled while degraded
+    uint64_t degraded_count;  // times the engine went degraded
+    uint64_t max_us;
+    uint64_t average_us;
+    uint64_t total_us;
+};
+
+struct HookBudget g_hook_budget;
+volatile int g_hook_degraded = 0;
+uint64_t g_slow_path_us = 0;
+
+uint64_t budget_start() {
+    return platform_time_us();
+}
+
+void budget_end(uint64_t start) {
+    struct HookBudget * budget = &g_hook_budget;
+    uint64_t end = platform_time_us();
+    uint64_t us = end - start;
+    trace_hook(start, end);
+    budget->inputs++;
+    budget->total_us += us;
+    if (us > budget->max_us) budget->max_us = us;
+    if (us > HOOK_TIMEOUT_US / 2) budget->slow_inputs++;
+    // Unsigned both ways, no negative difference.
+    budget->average_us = budget->average_us - (budget->average_us >> HOOK_AVERAGE_SHIFT) + (us >> HOOK_AVERAGE_SHIFT);
+    if (g_hook_degraded) {
+        budget->degraded_inputs++;
+        if (budget->average_us < HOOK_TIMEOUT_US / 40) {
+            g_hook_degraded = 0;
+            char message[128];
+            snprintf(message, sizeof(message), "Hook time back in budget, %llu inputs degraded in all",
+                     (unsigned long long)budget->degraded_inputs);
+            debug_file(message);
+        }
+    } else if (us > HOOK_TIMEOUT_US / 2 || budget->average_us > HOOK_TIMEOUT_US / 10) {
+        g_hook_degraded = 1;
+        budget->degraded_count++;
+        char message[128];
+        snprintf(message, sizeof(message), "Hook time over budget (last %.1f ms, average %.1f ms), degraded #%llu",
+                 us / 1000.0, budget->average_us / 1000.0, (unsigned long long)budget->degraded_count);
+        debug_file(message);
+    }
+    ipc_publish_budget();
+}
+
+// The synthetic slow path, busy like a slow hook.
+void slow_path() {
+    if (!g_slow_path_us) return;
+    uint64_t start = platform_time_us();
+    while (platform_time_us() - start < g_slow_path_us);
+}
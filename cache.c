@@ -0,0 +1,410 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "input.h"
+
+// Binary config cache
+// --------------------------------------
+//
+// The parsed config (settings, profiles, layers and remaps with their key
+// lists) is saved next to config.txt as config.bin. At startup the cache is used
+// instead of config.txt when it matches the size and modification time of
+// config.txt, its checksum is valid and it was written against the same
+// key_table. Remaps are registered back in id order and the dispatch tables
+// are built by the same code path as the text parser.
+
+#define CONFIG_CACHE_MAGIC 0x4343524B // "KRCC"
+#define CONFIG_CACHE_VERSION 4
+
+struct ConfigCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t key_table_hash;
+    uint32_t checksum;
+    uint32_t size; // of the payload following the header
+    uint32_t source_size;
+    uint64_t source_time;
+};
+
+struct CacheWriter {
+    uint8_t * data;
+    uint32_t size;
+    uint32_t capacity;
+};
+
+struct CacheReader {
+    const uint8_t * data;
+    uint32_t size;
+    uint32_t pos;
+    int error;
+};
+
+enum LayerConfKind {
+    LAYER_CONF_TOGGLE,
+    LAYER_CONF_SET,
+    LAYER_CONF_RESET,
+};
+
+static uint32_t cache_checksum(const uint8_t * data, uint32_t size) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t key_table_hash() {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < KEY_TABLE_LEN; i++) {
+        hash ^= cache_checksum((const uint8_t *)key_table[i].name, strlen(key_table[i].name));
+        hash ^= key_table[i].scan_code ^ (key_table[i].virt_code << 16);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void cache_write(struct CacheWriter * writer, const void * data, uint32_t size) {
+    if (writer->size + size > writer->capacity) {
+        while (writer->size + size > writer->capacity) {
+            writer->capacity = writer->capacity ? writer->capacity * 2 : 4096;
+        }
+        writer->data = realloc(writer->data, writer->capacity);
+    }
+    memcpy(writer->data + writer->size, data, size);
+    writer->size += size;
+}
+
+static void cache_write_int(struct CacheWriter * writer, int32_t value) {
+    cache_write(writer, &value, sizeof(value));
+}
+
+static void cache_read(struct CacheReader * reader, void * data, uint32_t size) {
+    if (reader->error || reader->pos + size > reader->size) {
+        reader->error = 1;
+        memset(data, 0, size);
+        return;
+    }
+    memcpy(data, reader->data + reader->pos, size);
+    reader->pos += size;
+}
+
+static int32_t cache_read_int(struct CacheReader * reader) {
+    int32_t value;
+    cache_read(reader, &value, sizeof(value));
+    return value;
+}
+
+static int32_t cache_read_index(struct CacheReader * reader, int32_t limit) {
+    int32_t value = cache_read_int(reader);
+    if (value < 0 || value >= limit) {
+        reader->error = 1;
+        return 0;
+    }
+    return value;
+}
+
+static void write_key_nodes(struct CacheWriter * writer, struct KeyDefNode * head) {
+    int count = 0;
+    struct KeyDefNode * cur = head;
+    if (cur) {
+        do {
+            count++;
+            cur = cur->next;
+        } while (cur != head);
+    }
+    cache_write_int(writer, count);
+    while (count--) {
+        cache_write_int(writer, (int32_t)(cur->key_def - key_table));
+        cur = cur->next;
+    }
+}
+
+static struct KeyDefNode * read_key_nodes(struct CacheReader * reader) {
+    struct KeyDefNode * head = NULL;
+    int count = cache_read_index(reader, 256);
+    while (count-- && !reader->error) {
+        KEY_DEF * key_def = key_table + cache_read_index(reader, KEY_TABLE_LEN);
+        if (head == NULL) {
+            head = new_key_node(key_def);
+        } else {
+            append_key_node(head, key_def);
+        }
+    }
+    return head;
+}
+
+static void write_layer_nodes(struct CacheWriter * writer, struct LayerNode * head) {
+    int count = 0;
+    for (struct LayerNode * cur = head; cur; cur = cur->next) count++;
+    cache_write_int(writer, count);
+    for (struct LayerNode * cur = head; cur; cur = cur->next) {
+        cache_write_int(writer, cur->layer);
+    }
+}
+
+static struct LayerNode * read_layer_nodes(struct CacheReader * reader, int layer_count) {
+    struct LayerNode * head = NULL;
+    int count = cache_read_index(reader, layer_count);
+    while (count-- && !reader->error) {
+        append_layer_node(&head, new_layer_node(cache_read_index(reader, layer_count)));
+    }
+    return head;
+}
+
+static void write_layer_confs(struct CacheWriter * writer, struct LayerConf * head) {
+    int count = 0;
+    for (struct LayerConf * cur = head; cur; cur = cur->next) count++;
+    cache_write_int(writer, count);
+    for (struct LayerConf * cur = head; cur; cur = cur->next) {
+        cache_write_int(writer, cur->layer);
+        cache_write_int(writer, cur->conf == toggle_layer_lock ? LAYER_CONF_TOGGLE :
+                                cur->conf == set_layer_lock ? LAYER_CONF_SET : LAYER_CONF_RESET);
+    }
+}
+
+static struct LayerConf * read_layer_confs(struct CacheReader * reader, int layer_count) {
+    static void (* const confs[])(struct Layer * layer) = {
+        [LAYER_CONF_TOGGLE] = toggle_layer_lock,
+        [LAYER_CONF_SET] = set_layer_lock,
+        [LAYER_CONF_RESET] = reset_layer_lock,
+    };
+    struct LayerConf * head = NULL;
+    int count = cache_read_index(reader, 256);
+    while (count-- && !reader->error) {
+        int layer = cache_read_index(reader, layer_count);
+        int kind = cache_read_index(reader, 3);
+        append_layer_conf(&head, new_layer_conf(layer, confs[kind]));
+    }
+    return head;
+}
+
+// The extension of the file name is replaced, a '.' in a directory name is kept.
+static void put_config_cache_path(wchar_t * cache_path, const wchar_t * config_path) {
+    wcscpy(cache_path, config_path);
+    wchar_t * name = cache_path;
+    for (wchar_t * c = cache_path; *c; c++) {
+        if (*c == L'/' || *c == L'\\') name = c + 1;
+    }
+    wchar_t * ext = wcsrchr(name, L'.');
+    if (ext) *ext = L'\0';
+    wcscat(cache_path, L".bin");
+}
+
+static void write_string(struct CacheWriter * writer, const char * string) {
+    int32_t length = strlen(string);
+    cache_write_int(writer, length);
+    cache_write(writer, string, length);
+}
+
+/* @return string read, to be freed */
+static char * read_string(struct CacheReader * reader) {
+    int32_t length = cache_read_index(reader, 0x10000);
+    char * string = calloc(length + 1, 1);
+    cache_read(reader, string, length);
+    return string;
+}
+
+// Layers and remaps of one profile
+static void write_config_tables(struct CacheWriter * writer, struct Config * config) {
+    cache_write_int(writer, config->layer_count);
+    for (int id = 1; id < config->layer_count; id++) {
+        struct Layer * layer = &config->layers[id];
+        write_string(writer, layer->name);
+        write_layer_nodes(writer, layer->or_master_layers);
+        write_layer_nodes(writer, layer->and_master_layers);
+        write_layer_nodes(writer, layer->and_not_master_layers);
+        write_layer_nodes(writer, layer->slave_layers);
+    }
+
+    int remap_count = 0;
+    while (remap_count < 255 && config->remap_by_id[remap_count + 1]) remap_count++;
+    cache_write_int(writer, remap_count);
+    for (int id = 1; id <= remap_count; id++) {
+        struct Remap * remap = config->remap_by_id[id];
+        cache_write_int(writer, (int32_t)(remap->from - key_table));
+        cache_write_int(writer, remap->layer);
+        cache_write_int(writer, remap->to_when_press_layer);
+        cache_write_int(writer, remap->to_when_doublepress_layer);
+        cache_write_int(writer, remap->to_with_other_dummy);
+        write_layer_confs(writer, remap->to_when_tap_lock_layer);
+        write_layer_confs(writer, remap->to_when_double_tap_lock_layer);
+        write_key_nodes(writer, remap->to_when_alone);
+        write_key_nodes(writer, remap->to_with_other);
+        write_key_nodes(writer, remap->to_when_doublepress);
+        write_key_nodes(writer, remap->to_when_tap_lock);
+        write_key_nodes(writer, remap->to_when_double_tap_lock);
+    }
+}
+
+/* @return error */
+int save_config_cache(struct Config * config, wchar_t * config_path) {
+    struct ConfigCacheHeader header = {CONFIG_CACHE_MAGIC, CONFIG_CACHE_VERSION, key_table_hash()};
+    if (platform_file_info(config_path, &header.source_size, &header.source_time)) {
+        return 1;
+    }
+
+    struct CacheWriter writer = {NULL, 0, 0};
+    int32_t settings[] = {config->debug, config->hold_delay, config->tap_timeout,
+                          config->doublepress_timeout, config->rehook_timeout,
+                          config->unlock_timeout, config->scancode, config->priority,
+                          config->wheel_momentum, config->full_capture};
+    cache_write(&writer, settings, sizeof(settings));
+
+    int profile_count = 0;
+    for (struct Config * profile = config->next_profile; profile; profile = profile->next_profile) {
+        profile_count++;
+    }
+    cache_write_int(&writer, profile_count);
+    for (struct Config * profile = config->next_profile; profile; profile = profile->next_profile) {
+        write_string(&writer, profile->profile_name);
+        int match_count = 0;
+        for (struct ProfileMatch * match = profile->matches; match; match = match->next) match_count++;
+        cache_write_int(&writer, match_count);
+        for (struct ProfileMatch * match = profile->matches; match; match = match->next) {
+            write_string(&writer, match->name);
+        }
+    }
+    for (struct Config * profile = config; profile; profile = profile->next_profile) {
+        write_config_tables(&writer, profile);
+    }
+
+    header.size = writer.size;
+    header.checksum = cache_checksum(writer.data, writer.size);
+
+    wchar_t cache_path[MAX_PATH];
+    put_config_cache_path(cache_path, config_path);
+    // Written aside then renamed over the old cache, a reader never sees it half written.
+    wchar_t temp_path[MAX_PATH + 4];
+    wcscpy(temp_path, cache_path);
+    wcscat(temp_path, L".tmp");
+    FILE * file = platform_fopen(temp_path, "wb");
+    int err = 1;
+    if (file) {
+        err = fwrite(&header, sizeof(header), 1, file) != 1 ||
+            (writer.size && fwrite(writer.data, writer.size, 1, file) != 1);
+        err = fclose(file) != 0 || err;
+        err = err || platform_replace_file(temp_path, cache_path);
+    }
+    free(writer.data);
+    return err;
+}
+
+static void read_config_tables(struct CacheReader * reader, struct Config * config) {
+    // Register all the names first, so that master and slave ids resolve.
+    int layer_count = cache_read_index(reader, 0x10000);
+    uint32_t layers_pos = reader->pos;
+    for (int id = 1; id < layer_count && !reader->error; id++) {
+        char * name = read_string(reader);
+        if (register_layer(config, name) != id) reader->error = 1;
+        free(name);
+        for (int list = 0; list < 4; list++) {
+            int count = cache_read_index(reader, layer_count);
+            reader->pos += count * sizeof(int32_t);
+        }
+    }
+    reader->pos = layers_pos;
+    for (int id = 1; id < layer_count && !reader->error; id++) {
+        struct Layer * layer = &config->layers[id];
+        int32_t length = cache_read_int(reader);
+        reader->pos += length;
+        layer->or_master_layers = read_layer_nodes(reader, layer_count);
+        layer->and_master_layers = read_layer_nodes(reader, layer_count);
+        layer->and_not_master_layers = read_layer_nodes(reader, layer_count);
+        layer->slave_layers = read_layer_nodes(reader, layer_count);
+    }
+
+    int remap_count = cache_read_index(reader, 256);
+    for (int id = 1; id <= remap_count && !reader->error; id++) {
+        KEY_DEF * from = key_table + cache_read_index(reader, KEY_TABLE_LEN);
+        int layer = cache_read_index(reader, layer_count);
+        struct Remap * remap = new_remap(from, layer, NULL, NULL, NULL, NULL, NULL);
+        remap->to_when_press_layer = cache_read_index(reader, layer_count);
+        remap->to_when_doublepress_layer = cache_read_index(reader, layer_count);
+        remap->to_with_other_dummy = cache_read_int(reader);
+        remap->to_when_tap_lock_layer = read_layer_confs(reader, layer_count);
+        remap->to_when_double_tap_lock_layer = read_layer_confs(reader, layer_count);
+        remap->to_when_alone = read_key_nodes(reader);
+        remap->to_with_other = read_key_nodes(reader);
+        remap->to_when_doublepress = read_key_nodes(reader);
+        remap->to_when_tap_lock = read_key_nodes(reader);
+        remap->to_when_double_tap_lock = read_key_nodes(reader);
+        if (register_remap(config, remap)) {
+            free_remap(remap);
+            reader->error = 1;
+        }
+    }
+}
+
+/* @return error */
+static int read_config_cache(struct Config * config, const uint8_t * data, uint32_t size, const wchar_t * config_path) {
+    struct ConfigCacheHeader header;
+    uint32_t source_size;
+    uint64_t source_time;
+    if (size < sizeof(header)) return 1;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != CONFIG_CACHE_MAGIC ||
+        header.version != CONFIG_CACHE_VERSION ||
+        header.key_table_hash != key_table_hash() ||
+        header.size != size - sizeof(header) ||
+        header.checksum != cache_checksum(data + sizeof(header), header.size)) {
+        return 1;
+    }
+    // Stale if config.txt has been edited since the cache was written.
+    if (platform_file_info(config_path, &source_size, &source_time) ||
+        source_size != header.source_size || source_time != header.source_time) {
+        return 1;
+    }
+
+    struct CacheReader reader = {data + sizeof(header), header.size, 0, 0};
+    int32_t settings[10];
+    cache_read(&reader, settings, sizeof(settings));
+
+    int profile_count = cache_read_index(&reader, 256);
+    struct Config ** tail = &config->next_profile;
+    for (int i = 0; i < profile_count && !reader.error; i++) {
+        *tail = new_config();
+        (*tail)->profile_name = read_string(&reader);
+        int match_count = cache_read_index(&reader, 0x10000);
+        struct ProfileMatch ** match_tail = &(*tail)->matches;
+        for (int j = 0; j < match_count && !reader.error; j++) {
+            *match_tail = malloc(sizeof(struct ProfileMatch));
+            (*match_tail)->name = read_string(&reader);
+            (*match_tail)->next = NULL;
+            match_tail = &(*match_tail)->next;
+        }
+        tail = &(*tail)->next_profile;
+    }
+    for (struct Config * profile = config; profile && !reader.error; profile = profile->next_profile) {
+        read_config_tables(&reader, profile);
+    }
+    if (reader.error || reader.pos != reader.size) {
+        return 1;
+    }
+    config->debug = settings[0];
+    config->hold_delay = settings[1];
+    config->tap_timeout = settings[2];
+    config->doublepress_timeout = settings[3];
+    config->rehook_timeout = settings[4];
+    config->unlock_timeout = settings[5];
+    config->scancode = settings[6];
+    config->priority = settings[7];
+    config->wheel_momentum = settings[8];
+    config->full_capture = settings[9];
+    return load_config_line(config, NULL, 0);
+}
+
+/* @return error, the config has to be parsed from config.txt and config freed */
+int load_config_cache(struct Config * config, wchar_t * config_path) {
+    wchar_t cache_path[MAX_PATH];
+    put_config_cache_path(cache_path, config_path);
+
+    struct PlatformFileMap map;
+    if (platform_map_file(cache_path, &map)) {
+        return 1;
+    }
+    int err = read_config_cache(config, map.data, map.size, config_path);
+    platform_unmap_file(&map);
+    return err;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <string.h>
+#include "platform.h"
+#include "input.h"
+
+// Full capture
+// --------------------------------------
+//
+// Normally handle_input runs in the hook callback, so the whole engine is
+// charged against the hook timeout. With full_capture=1 the backends start
+// an engine thread instead and the hook only calls capture_input, which
+// tells whether the input may be remapped:
+// - a key with a remap in any layer or profile, see capture_update_keys,
+// - any input while the engine has inputs left to handle or holds a remap,
+//   as a key passed at once would overtake the outputs of the earlier ones.
+// Those are blocked by the hook. Every input is queued for the engine thread
+// in hook order, the blocked ones and the ones already passed, which the
+// engine still has to see. capture_run hands them to handle_input and the
+// blocked ones to capture_send of the backend, which sends them again
+// unless handle_input blocked them.
+//
+// Injected inputs are never blocked. The queue has one producer, the hook
+// thread, and one consumer, the engine thread. When it is full the input is
+// passed unseen and counted. The engine clock is read when the input is
+// handled, a few microseconds after the hook.
+//
+// Working through a backlog, the engine outruns the output and would fill
+// the input buffer. Off the hook it can wait for the output instead of
+// dropping inputs, up to CAPTURE_OUTPUT_WAIT_US. Once the backend sets
+// g_capture_stop nothing drains the output any more: the inputs left in
+// the queue are passed through unremapped, without waiting, and unlock_all
+// then releases what the engine held.
+
+#define CAPTURE_QUEUE_SIZE 4096 // power of 2
+#define CAPTURE_QUEUE_MASK (CAPTURE_QUEUE_SIZE-1)
+#define CAPTURE_OUTPUT_ROOM (INPUT_BUFFER_SIZE/2) // for the outputs of one input
+#define CAPTURE_OUTPUT_WAIT_US 100000
+
+struct CaptureQueue {
+    struct CapturedInput inputs[CAPTURE_QUEUE_SIZE];
+    volatile LONG64 head; // written by the hook thread
+    volatile LONG64 tail; // written by the engine thread
+};
+
+static struct CaptureQueue g_capture_queue;
+static uint8_t g_capture_by_virt[256]; // keys with a remap
+static uint8_t g_capture_by_scan[512];
+static volatile int g_capture_engaged = 0; // a remap is held or locked
+volatile LONG64 g_capture_overflows = 0;
+volatile int g_capture_stop = 0; // set by the backend when closing
+
+/* Keys remapped in any profile of config, on the engine thread: the hook
+ * cannot follow g_profile, which may be freed under it by a reload. Built
+ * aside, the keys remapped before and after never read as passed. */
+void capture_update_keys(struct Config * config) {
+    uint8_t by_virt[256] = {0};
+    uint8_t by_scan[512] = {0};
+    for (; config; config = config->next_profile) {
+        for (int i = 0; i < 256; i++) {
+            if (config->remap_array[i]) by_virt[i] = 1;
+        }
+        for (int i = 0; i < 512; i++) {
+            if (config->remap_by_scan[i]) by_scan[i] = 1;
+        }
+    }
+    memcpy(g_capture_by_virt, by_virt, sizeof(by_virt));
+    memcpy(g_capture_by_scan, by_scan, sizeof(by_scan));
+}
+
+/* Queues an input for the engine thread, from the hook thread.
+ * @return block_input */
+int capture_input(int scan_code, int virt_code, enum Direction direction, int is_injected, DWORD flags,
+                  ULONG_PTR dwExtraInfo, DWORD data) {
+    struct CaptureQueue * queue = &g_capture_queue;
+    LONG64 head = queue->head;
+    if (head - queue->tail >= CAPTURE_QUEUE_SIZE) {
+        InterlockedIncrement64(&g_capture_overflows);
+        return 0;
+    }
+    int scan_index = virt_code == MOUSE_DUMMY_VK ? -1 : ((scan_code & 0xFF) | ((flags & LLKHF_EXTENDED) ? 0x100 : 0));
+    int captured = !is_injected && (head != queue->tail || g_capture_engaged ||
+                                    g_capture_by_virt[virt_code & 0xFF] ||
+                                    (scan_index >= 0 && g_capture_by_scan[scan_index]));
+    struct CapturedInput * input = &queue->inputs[head & CAPTURE_QUEUE_MASK];
+    input->scan_code = (uint16_t)scan_code;
+    input->virt_code = (uint16_t)virt_code;
+    input->direction = (uint8_t)direction;
+    input->is_injected = (uint8_t)is_injected;
+    input->captured = (uint8_t)captured;
+    input->flags = flags;
+    input->extra = dwExtraInfo;
+    input->data = data;
+    InterlockedIncrement64(&queue->head);
+    return captured;
+}
+
+/* Queues the release of a mouse button whose press was blocked, it has to
+ * follow the press sent again. */
+void capture_follow(int scan_code, DWORD data) {
+    struct CaptureQueue * queue = &g_capture_queue;
+    LONG64 head = queue->head;
+    if (head - queue->tail >= CAPTURE_QUEUE_SIZE) {
+        InterlockedIncrement64(&g_capture_overflows);
+        return;
+    }
+    struct CapturedInput * input = &queue->inputs[head & CAPTURE_QUEUE_MASK];
+    memset(input, 0, sizeof(struct CapturedInput));
+    input->scan_code = (uint16_t)scan_code;
+    input->virt_code = MOUSE_DUMMY_VK;
+    input->direction = UP;
+    input->captured = 1;
+    input->data = data;
+    InterlockedIncrement64(&queue->head);
+}
+
+static void wait_output_room(struct InputBuffer * input_buffer) {
+    if (input_buffer_free_count(input_buffer) >= CAPTURE_OUTPUT_ROOM) return;
+    uint64_t start = platform_time_us();
+    wake_output();
+    while (input_buffer_free_count(input_buffer) < CAPTURE_OUTPUT_ROOM &&
+           platform_time_us() - start < CAPTURE_OUTPUT_WAIT_US) {
+        platform_sleep_ms(0);
+    }
+}
+
+/* Handles the queued inputs, on the engine thread.
+ * @return inputs handled */
+int capture_run(struct InputBuffer * input_buffer) {
+    // Woken for the profile of a new foreground window too.
+    switch_profile(input_buffer);
+    ipc_run_commands(input_buffer);
+    struct CaptureQueue * queue = &g_capture_queue;
+    int count = 0;
+    for (; queue->tail != queue->head; count++) {
+        struct CapturedInput * input = &queue->inputs[queue->tail & CAPTURE_QUEUE_MASK];
+        // Mouse releases are not handled, only sent again after their press.
+        int block_input = 0;
+        if (!g_capture_stop) wait_output_room(input_buffer);
+        if (!g_capture_stop && (input->virt_code != MOUSE_DUMMY_VK || input->direction == DOWN)) {
+            block_input = handle_input(input->scan_code, input->virt_code, input->direction, input->is_injected,
+                                       input->flags, input->extra, input_buffer);
+        }
+        if (input->captured) capture_send(input, block_input);
+        g_capture_engaged = g_remap_list != NULL;
+        InterlockedIncrement64(&queue->tail);
+    }
+    return count;
+}
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <ctype.h>
+#include "platform.h"
+
+// Engine clock
+// --------------------------------------
+//
+// handle_input and the mouse timer read the time from one monotonic clock,
+// in 64-bit microseconds. The times of the hook events are not used: they
+// are milliseconds, wrap after 49 days and tell when the event was queued,
+// not when it is handled. The timeouts of config.txt are written in
+// milliseconds, with up to 3 decimals, and kept in microseconds.
+//
+// The clock is platform_time_us unless another source is set, e.g. the
+// virtual clock of the replays, which runs on the times of the trace.
+
+struct ClockSource {
+    // @return microseconds, never going back
+    uint64_t (*now_us)();
+};
+
+static const struct ClockSource init_clock_source = {platform_time_us};
+static const struct ClockSource * clock_source = &init_clock_source;
+
+void set_clock_source(const struct ClockSource * source) {
+    clock_source = (source != NULL) ? source : &init_clock_source;
+}
+
+uint64_t clock_now_us() {
+    return clock_source->now_us();
+}
+
+/* Parses milliseconds with up to 3 decimals, e.g. "200" or "0.25".
+ * @return error */
+int parse_time_ms(const char * text, uint64_t * us) {
+    const char * p = text;
+    uint64_t ms = 0;
+    if (!isdigit((unsigned char)*p)) return 1;
+    for (; isdigit((unsigned char)*p); p++) {
+        ms = ms * 10 + (*p - '0');
+        if (ms > UINT32_MAX) return 1;
+    }
+    uint64_t fraction = 0;
+    int digits = 0;
+    if (*p == '.') {
+        for (p++; isdigit((unsigned char)*p) && digits < 3; p++, digits++) {
+            fraction = fraction * 10 + (*p - '0');
+        }
+        if (digits == 0) return 1;
+    }
+    for (; digits < 3; digits++) fraction *= 10;
+    *us = ms * 1000 + fraction;
+    return *p != '\0';
+}
+
+// Prints microseconds as milliseconds, with decimals only if needed.
+void print_time_ms(FILE * out, uint64_t us) {
+    if (us % 1000) {
+        fprintf(out, "%llu.%03llu", (unsigned long long)(us / 1000), (unsigned long long)(us % 1000));
+    } else {
+        fprintf(out, "%llu", (unsigned long long)(us / 1000));
+    }
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#include "platform.h"
+#include "input.h"
+#include "keys.c"
+#include "clock.c"
+#include "log.c"
+#include "budget.c"
+#include "trace.c"
+#include "remap.c"
+#include "mouse.c"
+#include "cache.c"
+#include "analyze.c"
+#include "profile.c"
+#include "recorder.c"
+#include "invariants.c"
+#include "stats.c"
+#include "ipc.c"
+#include "capture.c"
+
+// Remap engine
+// --------------------------------------
+//
+// Everything but the input hooks and the output thread, shared by the
+// backends: keyboard_remapper.c on Windows, keyboard_remapper_linux.c and
+// headless.c on Linux. Inputs are handed to handle_input, outputs are queued
+// to g_input_buffer and the backend is told with wake_output.
+
+struct InputBuffer g_input_buffer;
+
+// Written to debug.log by the log thread, see log.c.
+void debug_file(const char * message) {
+    uint32_t tail;
+    struct LogRecord * record = log_reserve(LOG_FILE, &tail);
+    if (!record) return;
+    record->time = time(NULL);
+    snprintf(record->text, sizeof(record->text), "%s", message);
+    log_commit(tail);
+}
+
+// Formatted here, printed by the log thread, see log.c.
+void debug_print(const char * color, const char * format, ...) {
+    uint32_t tail;
+    struct LogRecord * record = log_reserve(LOG_TEXT, &tail);
+    if (!record) return;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+    record->color = color;
+    log_commit(tail);
+}
+
+void send_input(int scan_code, int virt_code, enum Direction direction, int remap_id, struct InputBuffer * input_buffer) {
+    if (virt_code) {
+        uint32_t n, tail;
+        int index;
+        n = input_buffer_move_prod_head(input_buffer, &tail);
+        index = tail & INPUT_BUFFER_MASK;
+        if (n == 0) {
+            if (g_debug) debug_print(RED, "\nError: input buffer is full!");
+            debug_file("Error: input buffer is full!");
+            return;
+        }
+        ZeroMemory(&input_buffer->inputs[index], sizeof(INPUT));
+
+        input_buffer->inputs[index].type = INPUT_KEYBOARD;
+        input_buffer->inputs[index].ki.time = 0;
+        input_buffer->inputs[index].ki.dwExtraInfo = (ULONG_PTR)(INJECTED_KEY_ID | remap_id);
+
+        // The scan code of PAUSE stands in for E1 1D 45, sent alone it is NUMLOCK.
+        int by_scan_code = g_scancode && scan_code != 0x00 && virt_code != PAUSE->virt_code;
+        input_buffer->inputs[index].ki.wScan = scan_code;
+        input_buffer->inputs[index].ki.wVk = (by_scan_code ? 0 : virt_code);
+        // Per MS Docs: https://learn.microsoft.com/en-us/windows/win32/api/winuser/nf-winuser-keybd_even
+        // we need to flag whether "the scan code was preceded by a prefix byte having the value 0xE0 (224)"
+        int is_extended_key = scan_code>>8 == 0xE0;
+        input_buffer->inputs[index].ki.dwFlags = (direction == UP ? KEYEVENTF_KEYUP : 0) |
+            (is_extended_key ? KEYEVENTF_EXTENDEDKEY : 0) |
+            (by_scan_code ? KEYEVENTF_SCANCODE : 0);
+        input_buffer_commit(input_buffer, tail, n);
+        trace_enqueue(virt_code, direction);
+    } else {
+        mouse_emulation(scan_code, direction, remap_id, &g_input_buffer);
+    }
+}
+
+/* @return length of the line read into *line, -1 at the end of the file */
+int read_line(FILE * file, char ** line, size_t * capacity) {
+    size_t length = 0;
+    while (1) {
+        if (length + 2 > *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 256;
+            *line = realloc(*line, *capacity);
+        }
+        if (!fgets(*line + length, (int)(*capacity - length), file)) break;
+        length += strlen(*line + length);
+        if (length > 0 && (*line)[length - 1] == '\n') break;
+    }
+    return length ? (int)length : -1;
+}
+
+int load_config_file(struct Config * config, wchar_t * path) {
+    char * line = NULL;
+    size_t capacity = 0;
+
+    FILE * file = platform_fopen(path, "r");
+    if (file == NULL) {
+        printf("Cannot open configuration file '%ls'. Make sure it is in the same directory as 'keyboard_remapper.exe'.\n",
+            path);
+        return 1;
+    }
+
+    int linenum = 1;
+    while (read_line(file, &line, &capacity) >= 0) {
+        if (load_config_line(config, line, linenum++)) {
+            free(line);
+            fclose(file);
+            return 1;
+        }
+    };
+    free(line);
+    fclose(file);
+    return load_config_line(config, NULL, linenum++);
+}
+
+/* @return the parsed config, NULL on error */
+struct Config * read_config(wchar_t * config_path) {
+    struct Config * config = new_config();
+    if (load_config_cache(config, config_path) == 0) {
+        return config;
+    }
+    free_config(config);
+    config = new_config();
+    if (load_config_file(config, config_path)) {
+        free_config(config);
+        return NULL;
+    }
+    save_config_cache(config, config_path);
+    return config;
+}
+
+/* @return exit code, 1 if config.txt has errors or problems */
+int check_config(wchar_t * config_path) {
+    struct Config * config = new_config();
+    if (load_config_file(config, config_path)) {
+        free_config(config);
+        return 1;
+    }
+    int problems = 0;
+    for (struct Config * profile = config; profile; profile = profile->next_profile) {
+        if (profile->profile_name) printf("\nProfile '%s':\n", profile->profile_name);
+        problems += analyze_config(profile);
+        dump_decision_table(profile);
+    }
+    printf("\n%d problem(s) found.\n", problems);
+    free_config(config);
+    return problems ? 1 : 0;
+}
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform_posix.c"
+#include "engine.c"
+#include "replay.c"
+
+// Fuzzing
+// --------------------------------------
+//
+// libFuzzer target of handle_input, see `make fuzz`. The bytes of an input
+// pick one of FUZZ_CONFIGS with its timeouts, then a sequence of key events
+// replayed like a trace: the invariants (see invariants.c) are checked at
+// every quiescent point, and once more after the keys still held are
+// released. Any violation aborts, libFuzzer keeps the input.
+//
+// Input bytes:
+// - config index,
+// - timeouts: bits 0-1 hold_delay, 2-3 tap_timeout, 4 doublepress_timeout,
+//   5 unlock_timeout, see fuzz_hold_delays and the next tables,
+// - then 2 bytes per event: key index in the keys of the config, the low bit
+//   of the next byte chooses DOWN or UP and the rest the time since the
+//   previous event. An UP of a key not held is a DOWN, a DOWN of a held key
+//   is a repeat.
+// The configs have no mouse actions, the mouse timer runs on its own thread.
+
+#define FUZZ_CONFIGS (sizeof(fuzz_configs) / sizeof(fuzz_configs[0]))
+#define FUZZ_MAX_KEYS 16
+#define FUZZ_LINE_SIZE 64 // longest line of fuzz_configs
+
+struct FuzzConfig {
+    const char * text;
+    const char * keys[FUZZ_MAX_KEYS]; // driven by the events, NULL ended
+};
+
+static const struct FuzzConfig fuzz_configs[] = {
+    // Layers, and_layer and and_not_layer, tap locks, a double press layer.
+    {
+        "remap_key=SPACE\n"
+        "when_alone=SPACE\n"
+        "with_other=RIGHT_CTRL\n"
+        "when_press=layer_space\n"
+        "remap_key=LEFT_CTRL\n"
+        "with_other=LEFT_CTRL\n"
+        "when_press=layer_ctrl\n"
+        "remap_key=LEFT_SHIFT\n"
+        "with_other=LEFT_SHIFT\n"
+        "when_press=layer_shift\n"
+        "remap_key=LEFT_WIN\n"
+        "with_other=LEFT_WIN\n"
+        "when_press=layer_win\n"
+        "remap_key=TAB\n"
+        "when_alone=TAB\n"
+        "with_other=\n"
+        "when_press=layer_tab\n"
+        "remap_key=RIGHT_ALT\n"
+        "when_alone=CTRL\n"
+        "when_alone=ALT\n"
+        "when_alone=SHIFT\n"
+        "define_layer=layer_ctrl_win\n"
+        "and_layer=layer_ctrl\n"
+        "and_layer=layer_win\n"
+        "remap_key=RIGHT_WIN\n"
+        "when_tap_lock=set_layer_vi\n"
+        "remap_key=RIGHT_WIN\n"
+        "layer=layer_vi\n"
+        "when_tap_lock=reset_layer_vi\n"
+        "remap_key=LEFT_CTRL\n"
+        "layer=layer_space\n"
+        "when_press=layer_vi\n"
+        "when_doublepress=layer_page\n"
+        "define_layer=layer_vi\n"
+        "or_layer=layer_tab\n"
+        "and_layer=layer_ctrl_win\n"
+        "and_not_layer=layer_shift\n"
+        "remap_key=SPACE\n"
+        "layer=layer_vi\n"
+        "when_tap_lock=toggle_layer_vi\n"
+        "remap_key=KEY_H\n"
+        "layer=layer_vi\n"
+        "when_alone=LEFT\n"
+        "remap_key=KEY_J\n"
+        "layer=layer_vi\n"
+        "when_alone=DOWN\n"
+        "remap_key=KEY_H\n"
+        "layer=layer_page\n"
+        "when_alone=HOME\n",
+        {"SPACE", "LEFT_CTRL", "LEFT_SHIFT", "LEFT_WIN", "TAB", "RIGHT_ALT", "RIGHT_WIN", "KEY_H", "KEY_J",
+         "KEY_A", NULL},
+    },
+    // Dual keys typed fast.
+    {
+        "remap_key=SPACE\n"
+        "when_alone=SPACE\n"
+        "with_other=LEFT_CTRL\n"
+        "remap_key=CAPSLOCK\n"
+        "when_alone=ESCAPE\n"
+        "with_other=ESCAPE\n"
+        "remap_key=ENTER\n"
+        "when_alone=ENTER\n"
+        "with_other=RIGHT_CTRL\n",
+        {"SPACE", "CAPSLOCK", "ENTER", "KEY_A", "KEY_X", "LEFT_SHIFT", NULL},
+    },
+    // Key locks and double presses.
+    {
+        "remap_key=CAPSLOCK\n"
+        "when_alone=ESCAPE\n"
+        "with_other=LEFT_CTRL\n"
+        "when_doublepress=CAPSLOCK\n"
+        "when_tap_lock=LEFT_SHIFT\n"
+        "remap_key=LEFT_ALT\n"
+        "when_alone=LEFT_ALT\n"
+        "with_other=LEFT_ALT\n"
+        "when_double_tap_lock=LEFT_ALT\n"
+        "remap_key=SPACE\n"
+        "when_alone=SPACE\n"
+        "with_other=LEFT_SHIFT\n"
+        "when_doublepress=ENTER\n",
+        {"CAPSLOCK", "LEFT_ALT", "SPACE", "KEY_A", "LEFT_SHIFT", NULL},
+    },
+};
+
+static const char * fuzz_hold_delays[] = {"0", "0.5", "60", "200"};
+static const char * fuzz_tap_timeouts[] = {"0", "50", "200", "500"};
+static const char * fuzz_doublepress_timeouts[] = {"0", "200"};
+static const char * fuzz_unlock_timeouts[] = {"60000", "1000"};
+
+// Stands in for SendInput, the queued inputs are dropped.
+void wake_output() {
+    record_inputs(NULL, &g_input_buffer);
+}
+
+// There are no hooks to renew.
+void rehook() {
+}
+
+// Nor requests to serve.
+void wake_engine() {
+}
+
+// Nor an engine thread, see capture.c.
+void capture_send(struct CapturedInput * input, int block_input) {
+}
+
+static void fuzz_report(const char * message) {
+    fprintf(stderr, "Invariant: %s\n", message);
+}
+
+/* @return the config with the timeouts chosen by the bits of timeouts, NULL on error */
+static struct Config * load_fuzz_config(const struct FuzzConfig * fuzz_config, uint8_t timeouts) {
+    struct Config * config = new_config();
+    int linenum = 1;
+    char line[FUZZ_LINE_SIZE];
+    for (const char * text = fuzz_config->text; *text; ) {
+        size_t length = strcspn(text, "\n");
+        memcpy(line, text, length);
+        line[length] = '\0';
+        if (load_config_line(config, line, linenum++)) goto error;
+        text += length + (text[length] == '\n');
+    }
+    snprintf(line, sizeof(line), "hold_delay=%s", fuzz_hold_delays[timeouts & 3]);
+    if (load_config_line(config, line, linenum++)) goto error;
+    snprintf(line, sizeof(line), "tap_timeout=%s", fuzz_tap_timeouts[(timeouts >> 2) & 3]);
+    if (load_config_line(config, line, linenum++)) goto error;
+    snprintf(line, sizeof(line), "doublepress_timeout=%s", fuzz_doublepress_timeouts[(timeouts >> 4) & 1]);
+    if (load_config_line(config, line, linenum++)) goto error;
+    snprintf(line, sizeof(line), "unlock_timeout=%s", fuzz_unlock_timeouts[(timeouts >> 5) & 1]);
+    if (load_config_line(config, line, linenum++)) goto error;
+    if (load_config_line(config, NULL, linenum)) goto error;
+    return config;
+error:
+    free_config(config);
+    return NULL;
+}
+
+// Times between events: mostly below the timeouts, some past the unlock timeout.
+static uint64_t fuzz_delay_us(uint8_t value) {
+    value >>= 1;
+    return value < 100 ? value * 5000ull : (value - 99) * 1000000ull;
+}
+
+static void fuzz_event(KEY_DEF * key, enum Direction direction, uint64_t time) {
+    struct TraceEvent event = {time, key->scan_code, key->virt_code, direction, 0, 0};
+    replay_event(&event, time, NULL);
+}
+
+int LLVMFuzzerInitialize(int * argc, char *** argv) {
+    build_key_index();
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+    if (size < 2) return 0;
+    const struct FuzzConfig * fuzz_config = &fuzz_configs[data[0] % FUZZ_CONFIGS];
+    struct Config * config = load_fuzz_config(fuzz_config, data[1]);
+    if (config == NULL) abort();
+    KEY_DEF * keys[FUZZ_MAX_KEYS];
+    int key_count = 0;
+    for (; fuzz_config->keys[key_count]; key_count++) {
+        keys[key_count] = find_key_def_by_name((char *)fuzz_config->keys[key_count]);
+        if (keys[key_count] == NULL) abort();
+    }
+
+    activate_config(config);
+    input_buffer_init(&g_input_buffer);
+    set_clock_source(&replay_clock_source);
+    g_last_input = 0;
+    g_recorder_auto_dump = 0;
+    reset_invariants();
+    g_invariant_report = fuzz_report;
+
+    uint8_t down[FUZZ_MAX_KEYS] = {0};
+    uint64_t time = 1000000;
+    for (size_t i = 2; i + 1 < size; i += 2) {
+        int k = data[i] % key_count;
+        time += fuzz_delay_us(data[i + 1]);
+        down[k] = !down[k] || !(data[i + 1] & 1);
+        fuzz_event(keys[k], down[k] ? DOWN : UP, time);
+    }
+    // The last quiescent point.
+    for (int k = 0; k < key_count; k++) {
+        if (!down[k]) continue;
+        time += 10000;
+        fuzz_event(keys[k], UP, time);
+    }
+    int violations = g_invariant_violations;
+
+    g_invariant_report = NULL;
+    unlock_all(&g_input_buffer);
+    record_inputs(NULL, &g_input_buffer);
+    free_config(g_config);
+    g_config = NULL;
+    set_clock_source(NULL);
+    if (violations) abort();
+    return 0;
+}
@@ -0,0 +1,108 @@
+#define VERSION "1.1.2"
+
+#include <stdio.h>
+#include <string.h>
+#include "platform_posix.c"
+#include "engine.c"
+#include "replay.c"
+
+// Headless backend
+// --------------------------------------
+//
+// Builds the remap engine without input hooks or SendInput, see `make headless`.
+// Queued outputs are printed instead of being sent, inputs come from traces.
+
+// Stands in for SendInput, the queued inputs are printed.
+void wake_output() {
+    record_inputs(stdout, &g_input_buffer);
+}
+
+// There are no hooks to renew.
+void rehook() {
+}
+
+// Nor requests to serve.
+void wake_engine() {
+}
+
+// Nor an engine thread, see capture.c.
+void capture_send(struct CapturedInput * input, int block_input) {
+}
+
+/* Walks key_table through the lookup indexes of keys.c: every name finds
+ * its key, every virtual code names a key with that code, every scan code
+ * finds a key with that scan code, and the names found lead back to it.
+ * @return exit code, 1 if a lookup disagrees with the table */
+static int check_keys() {
+    int errors = 0;
+    for (int i = 0; i < KEY_TABLE_LEN; i++) {
+        KEY_DEF * key = &key_table[i];
+        if (find_key_def_by_name(key->name) != key) {
+            printf("%s: the name finds another key\n", key->name);
+            errors++;
+        }
+        // Mouse keys have no codes.
+        if (key->virt_code <= 0) continue;
+        KEY_DEF * by_name = find_key_def_by_name(friendly_virt_code_name(key->virt_code));
+        if (by_name == NULL || by_name->virt_code != key->virt_code) {
+            printf("%s: virtual code 0x%02X is named %s\n", key->name, key->virt_code,
+                   friendly_virt_code_name(key->virt_code));
+            errors++;
+        }
+        if (key->scan_code == 0) continue;
+        KEY_DEF * by_scan = find_key_def_by_scan_code(key->scan_code);
+        if (by_scan == NULL || by_scan->scan_code != key->scan_code ||
+            find_key_def_by_name(by_scan->name) != by_scan) {
+            printf("%s: scan code 0x%04X finds %s\n", key->name, key->scan_code, by_scan ? by_scan->name : "nothing");
+            errors++;
+        }
+    }
+    printf("%d keys, %d error(s).\n", (int)KEY_TABLE_LEN, errors);
+    return errors ? 1 : 0;
+}
+
+int main(int argc, char ** argv) {
+    build_key_index();
+    if (argc > 1 && strcmp(argv[1], "--check") == 0) {
+        wchar_t check_path[MAX_PATH];
+        mbstowcs(check_path, argc > 2 ? argv[2] : "config.txt", MAX_PATH);
+        return check_config(check_path);
+    }
+    if (argc > 1 && strcmp(argv[1], "--check-keys") == 0) {
+        return check_keys();
+    }
+    if (argc > 2 && strcmp(argv[1], "--decode") == 0) {
+        return decode_recording(argv[2], stdout);
+    }
+    if (argc > 3 && strcmp(argv[1], "--replay") == 0) {
+        int first = 2;
+        for (; first < argc && argv[first][0] == '-'; first++) {
+            if (strcmp(argv[first], "--json") == 0) {
+                g_replay_json = 1;
+            } else if (strcmp(argv[first], "--stats") == 0) {
+                g_replay_stats = 1;
+            } else {
+                goto usage;
+            }
+        }
+        if (argc < first + 2) goto usage;
+        wchar_t config_path[MAX_PATH];
+        mbstowcs(config_path, argv[first], MAX_PATH);
+        int exit_code = 0;
+        if (argc == first + 2) {
+            return replay_trace(config_path, argv[first + 1], NULL);
+        }
+        // Pairs of trace and expected record.
+        for (int i = first + 1; i + 1 < argc; i += 2) {
+            exit_code |= replay_trace(config_path, argv[i], argv[i + 1]);
+        }
+        return exit_code;
+    }
+usage:
+    printf("keyboard_remapper %s (headless)\n\n", VERSION);
+    printf("Usage: %s --check [config.txt]\n", argv[0]);
+    printf("       %s --check-keys\n", argv[0]);
+    printf("       %s --replay [--json] [--stats] config.txt trace.txt [expected.txt [trace.txt expected.txt...]]\n", argv[0]);
+    printf("       %s --decode flight_recorder.bin\n", argv[0]);
+    return 2;
+}
@@ -1,6 +1,8 @@
 #ifndef INPUT_H
 #define INPUT_H
 
+#include "platform.h"
+
 //#define DEBUG(cond, x) do { if ((cond & 1 || cond & 0) && g_debug) { x;} } while (0)
 #define DEBUG(cond, x)
 
@@ -22,7 +24,7 @@
 #define CYAN        "\033[36m"
 #define WHITE       "\033[37m"
 
-union __declspec(align(8)) rte_ring_hts_headtail {
+union PLATFORM_ALIGN(8) rte_ring_hts_headtail {
     volatile LONG64 raw;
     struct {
         volatile uint32_t head;
@@ -90,6 +92,16 @@ static inline void input_buffer_update_tail(volatile union rte_ring_hts_headtail
     ht->pos.tail = old_tail + n;
 }
 
+void recorder_output(INPUT * input);
+void invariants_output(INPUT * input);
+
+// Publishes the input at old_tail of the producer, recorded on the way.
+static inline void input_buffer_commit(struct InputBuffer * input_buffer, uint32_t old_tail, uint32_t n) {
+    recorder_output(&input_buffer->inputs[old_tail & INPUT_BUFFER_MASK]);
+    invariants_output(&input_buffer->inputs[old_tail & INPUT_BUFFER_MASK]);
+    input_buffer_update_tail(&input_buffer->prod, old_tail, n);
+}
+
 static inline uint32_t input_buffer_count(struct InputBuffer * input_buffer) {
     return (input_buffer->prod.pos.tail - input_buffer->cons.pos.tail) & INPUT_BUFFER_MASK;
 }
@@ -111,9 +123,132 @@ enum Direction {
     DOWN,
 };
 
+#define STATS_BUCKETS 12 // of durations, see stats.c
+
+enum RemapStat {
+    STAT_PRESS,
+    STAT_TAP,
+    STAT_HOLD, // released alone after tap_timeout
+    STAT_WITH_OTHER,
+    STAT_FORCED_TAP, // by hold_delay
+    STAT_DOUBLE_TAP,
+    STAT_TAP_LOCK, // toggles
+    STAT_DOUBLE_TAP_LOCK,
+    STAT_COUNT,
+};
+
+struct RemapStats {
+    uint32_t counts[STAT_COUNT];
+    uint32_t press_ms[STATS_BUCKETS];
+    uint32_t overlap_ms[STATS_BUCKETS];
+    uint64_t press_time; // us
+    uint64_t other_time; // us, of the first other key pressed while held
+    uint8_t held;
+    uint8_t overlapped;
+};
+
+struct Remap;
+struct Config;
+
 void debug_file(const char * message);
 void debug_print(const char * color, const char * format, ...);
 void send_input(int scan_code, int virt_code, enum Direction direction, int remap_id, struct InputBuffer * input_buffer);
+// Provided by the backends, wake_output hands the inputs added to the buffer to the output.
+void wake_output();
+// wake_engine gets the thread handling the inputs to call ipc_run_commands.
+void wake_engine();
 void rehook();
+// Engine clock, see clock.c.
+uint64_t clock_now_us();
+int parse_time_ms(const char * text, uint64_t * us);
+void print_time_ms(FILE * out, uint64_t us);
+// Hook time budget, see budget.c.
+uint64_t budget_start();
+void budget_end(uint64_t start);
+void slow_path();
+extern volatile int g_hook_degraded;
+extern uint64_t g_slow_path_us;
+const char * remap_state_name(int state);
+// Trace export, see trace.c.
+int trace_start(const char * path);
+void trace_stop();
+void trace_hook(uint64_t start, uint64_t end);
+void trace_state(int remap_id, int virt_code, int from, int to);
+void trace_layer(const char * name, int state);
+void trace_enqueue(int virt_code, enum Direction direction);
+void trace_send(uint64_t start, int count);
+void trace_move(int intervals);
+void print_json_escaped(FILE * out, const char * text);
+void print_json_string(FILE * out, const char * text);
+// Introspection and control, see ipc.c.
+extern int g_ipc_enabled;
+void ipc_publish();
+void ipc_publish_budget();
+void ipc_run_commands(struct InputBuffer * input_buffer);
+int ipc_request(const char * request, char * text, int size);
+// Full capture, see capture.c.
+struct CapturedInput {
+    uint16_t scan_code; // w_param of the mouse inputs
+    uint16_t virt_code;
+    uint8_t direction;
+    uint8_t is_injected;
+    uint8_t captured; // blocked by the hook, to be sent again by capture_send
+    DWORD flags;
+    ULONG_PTR extra;
+    DWORD data; // mouseData of the mouse inputs
+};
+void capture_update_keys(struct Config * config);
+int capture_input(int scan_code, int virt_code, enum Direction direction, int is_injected, DWORD flags,
+                  ULONG_PTR dwExtraInfo, DWORD data);
+void capture_follow(int scan_code, DWORD data);
+int capture_run(struct InputBuffer * input_buffer);
+// Provided by the backends running an engine thread, sends a captured input
+// again unless block_input is 1.
+void capture_send(struct CapturedInput * input, int block_input);
+extern volatile LONG64 g_capture_overflows;
+extern volatile int g_capture_stop;
+// Flight recorder, see recorder.c.
+void recorder_input(int scan_code, int virt_code, enum Direction direction, uint64_t time, int is_injected,
+                    DWORD flags, ULONG_PTR extra);
+void recorder_result(int block_input, int remap_id, int state, int locks);
+void recorder_layer(int id, int state);
+void recorder_unlock_all();
+int recorder_dump(const char * reason);
+int recorder_crash_dump(const char * reason);
+void recorder_request_dump(const char * reason);
+extern int g_recorder_auto_dump;
+int decode_recording(const char * path, FILE * out);
+// Remap statistics, see stats.c.
+void stats_count(struct Remap * remap, enum RemapStat stat);
+void stats_press(struct Remap * remap, uint64_t time);
+void stats_other(struct Remap * remap, uint64_t time);
+void stats_release(struct Remap * remap, uint64_t time);
+void reset_remap_stats(struct Config * config);
+void print_remap_stats(FILE * out, int json);
+int write_remap_stats();
+extern volatile int g_remap_stats_requested;
+// Invariants, see invariants.c.
+void invariants_input(int scan_index, int virt_code, enum Direction direction, int is_injected, int block_input);
+void reset_invariants();
+extern int g_invariant_violations;
+extern void (*g_invariant_report)(const char * message);
+// Application profiles, see profile.c.
+struct WindowSource {
+    // @return id of the process owning the window, 0 if unknown
+    unsigned long (*get_window_process)(void * window);
+    // Copies the executable file name of the process, without directory, to name.
+    // @return error
+    int (*get_process_name)(unsigned long process_id, char * name, int size);
+};
+void set_window_source(const struct WindowSource * source);
+struct Config * find_window_profile(struct Config * config, void * window);
+void foreground_changed(void * window);
+void switch_profile(struct InputBuffer * input_buffer);
+// Orbital mouse, see mouse.c.
+struct ScreenSource {
+    // Fills the rectangle of the whole (virtual) screen, in pixels.
+    void (*get_screen_rect)(int * left, int * top, int * width, int * height);
+};
+void set_orbital_mouse_screen_source(const struct ScreenSource * source);
 
 #endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "platform.h"
+#include "input.h"
+
+// Invariants
+// --------------------------------------
+//
+// Stuck keys come from states the engine should never be left in. Whenever
+// the last physical key is released (a quiescent point) the engine state is
+// checked:
+// - every key down for the applications, synthesized or passed, is held by
+//   a tap lock or a double tap lock,
+// - every active layer has a holder, a lock or active masters, see
+//   check_layer_state,
+// - no remap is left held down.
+// Violations are counted, logged to debug.log and the first one dumps the
+// flight recorder. A key found down is reported once until it changes.
+
+#define INVARIANT_LOG_MAX 20
+
+static uint8_t g_physical_down[512]; // by scan_code_index
+static int g_physical_count = 0;
+static uint8_t g_visible_down[256]; // by virt_code, keys down for the applications, 2 once reported
+int g_invariant_violations = 0;
+void (*g_invariant_report)(const char * message) = NULL; // e.g. the record of a replay
+
+static void invariant_violation(const char * format, ...) {
+    char message[128];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    g_invariant_violations++;
+    DEBUG(1, debug_print(RED, "\nInvariant: %s", message));
+    if (g_invariant_violations == 1 && g_recorder_auto_dump) recorder_request_dump("invariant");
+    if (g_invariant_violations <= INVARIANT_LOG_MAX) {
+        char line[160];
+        snprintf(line, sizeof(line), "Invariant: %s", message);
+        debug_file(line);
+    }
+    if (g_invariant_report) g_invariant_report(message);
+}
+
+void reset_invariants() {
+    memset(g_physical_down, 0, sizeof(g_physical_down));
+    memset(g_visible_down, 0, sizeof(g_visible_down));
+    g_physical_count = 0;
+    g_invariant_violations = 0;
+}
+
+static int key_nodes_have(struct KeyDefNode * head, int virt_code) {
+    struct KeyDefNode * cur = head;
+    if (!cur) return 0;
+    do {
+        if (cur->key_def->virt_code == virt_code) return 1;
+        cur = cur->next;
+    } while (cur != head);
+    return 0;
+}
+
+static int is_key_locked(int virt_code) {
+    for (struct Remap * remap = g_remap_list; remap; remap = remap->next) {
+        if ((remap->tap_lock && key_nodes_have(remap->to_when_tap_lock, virt_code)) ||
+            (remap->double_tap_lock && key_nodes_have(remap->to_when_double_tap_lock, virt_code))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void check_invariants() {
+    for (int code = 1; code < 256; code++) {
+        if (g_visible_down[code] == 1 && !is_key_locked(code)) {
+            invariant_violation("%s is down without a lock", friendly_virt_code_name(code));
+            g_visible_down[code] = 2;
+        }
+    }
+    for (int id = 1; id < g_profile->layer_count; id++) {
+        if (g_profile->layers[id].state && !check_layer_state(id)) {
+            invariant_violation("layer %s is active without a holder or a lock", g_profile->layers[id].name);
+        }
+    }
+    for (struct Remap * remap = g_remap_list; remap; remap = remap->next) {
+        if (remap->state == HELD_DOWN_ALONE || remap->state == HELD_DOWN_WITH_OTHER ||
+            remap->state == TAP || remap->state == DOUBLE_TAP) {
+            invariant_violation("remap %d (%s) is held down after its key was released",
+                remap->id, remap->from->name);
+        }
+    }
+}
+
+// Keys the applications see down, from the inputs sent and the inputs passed on.
+static void track_visible(int virt_code, enum Direction direction) {
+    g_visible_down[virt_code & 0xFF] = direction == DOWN;
+}
+
+void invariants_output(INPUT * input) {
+    if (input->type != INPUT_KEYBOARD) return;
+    int virt_code = input->ki.wVk;
+    if (!virt_code) {
+        KEY_DEF * key = find_key_def_by_scan_code(input->ki.wScan |
+            ((input->ki.dwFlags & KEYEVENTF_EXTENDEDKEY) ? 0xE000 : 0));
+        virt_code = key ? key->virt_code : 0;
+    }
+    if (virt_code > 0) track_visible(virt_code, (input->ki.dwFlags & KEYEVENTF_KEYUP) ? UP : DOWN);
+}
+
+void invariants_input(int scan_index, int virt_code, enum Direction direction, int is_injected, int block_input) {
+    if (virt_code == MOUSE_DUMMY_VK) return;
+    // Blocked inputs are not seen, the others are passed or sent again by the backend.
+    if (block_input != 1) track_visible(virt_code, direction);
+    if (is_injected || scan_index < 0) return;
+    uint8_t down = direction == DOWN;
+    if (g_physical_down[scan_index] == down) return; // repeats
+    g_physical_down[scan_index] = down;
+    g_physical_count += down ? 1 : -1;
+    if (g_physical_count == 0) check_invariants();
+}
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "platform.h"
+#include "input.h"
+
+// Introspection and control
+// --------------------------------------
+//
+// The backends serve one line commands on a local endpoint (a named pipe on
+// Windows, a Unix socket on Linux) from their own thread, see IPC_COMMANDS.
+// That thread never touches the engine state:
+// - handle_input publishes a snapshot of the layers, the active remaps, the
+//   mouse emulation and the counters after each input, guarded by a
+//   sequence counter: odd while it is written, a reader copies it again if
+//   the counter moved meanwhile. The engine never waits for the readers.
+//   budget_end publishes the hook time budget the same way, from the hook
+//   thread once the input is timed.
+//   Each input copies states, ids and codes only: the names of the profile
+//   and its layers go with the config, they are copied when the profile
+//   changes.
+// - Layer changes and unlock_all are posted to a single command slot and
+//   run by the engine, on the next input or as soon as wake_engine gets
+//   the backend to call ipc_run_commands. The request waits for the engine
+//   up to IPC_COMMAND_TIMEOUT_MS, then withdraws the command unless the
+//   engine has taken it.
+// While the hooks are short of time, see budget.c, only the counters and
+// the budget are published: the layers, remaps and mouse state keep their last values.
+// Replies are text lines ended by an empty line.
+
+#define IPC_MAX_LAYERS 32
+#define IPC_MAX_REMAPS 32
+#define IPC_NAME_SIZE 24
+#define IPC_COMMAND_TIMEOUT_MS 1000
+#define IPC_COMMANDS "layers, remaps, mouse, stats, set <layer>, reset <layer> or unlock"
+
+struct IpcLayer {
+    char name[IPC_NAME_SIZE];
+    uint8_t state;
+    uint8_t lock;
+};
+
+struct IpcRemap {
+    uint8_t id;
+    uint8_t state;
+    uint8_t tap_lock;
+    uint8_t double_tap_lock;
+    uint16_t virt_code;
+};
+
+struct IpcSnapshot {
+    char profile[IPC_NAME_SIZE];
+    int layer_count;
+    struct IpcLayer layers[IPC_MAX_LAYERS];
+    int remap_count; // held or locked, more are not listed
+    struct IpcRemap remaps[IPC_MAX_REMAPS];
+    int mouse_active;
+    int mouse_buttons;
+    int mouse_held_keys;
+    int mouse_selected_button;
+    double mouse_speed;
+    double mouse_angle;
+    int invariant_violations;
+    LONG64 log_dropped;
+    LONG64 capture_overflows;
+};
+
+struct IpcBudget {
+    struct HookBudget budget;
+    int degraded;
+};
+
+enum IpcSlot {
+    IPC_SLOT_EMPTY,
+    IPC_SLOT_POSTED,
+    IPC_SLOT_RUNNING, // taken by the engine, can't be withdrawn
+    IPC_SLOT_DONE,
+};
+
+enum IpcCommandType {
+    IPC_SET_LAYER,
+    IPC_RESET_LAYER,
+    IPC_UNLOCK,
+};
+
+struct IpcCommand {
+    enum IpcCommandType type;
+    char layer[IPC_NAME_SIZE];
+};
+
+int g_ipc_enabled = 0; // set by the backend serving the requests
+static struct IpcSnapshot g_ipc_snapshot;
+static volatile LONG64 g_ipc_sequence = 0;
+static struct IpcBudget g_ipc_budget;
+static volatile LONG64 g_ipc_budget_sequence = 0;
+static int g_ipc_profile_changes = -1; // g_profile_changes of the names in the snapshot
+static struct IpcCommand g_ipc_command;
+static volatile LONG g_ipc_slot = IPC_SLOT_EMPTY; // enum IpcSlot
+static volatile int g_ipc_error = 0; // of the last command done
+
+// On the engine thread only.
+void ipc_publish() {
+    if (!g_ipc_enabled) return;
+    struct IpcSnapshot * snapshot = &g_ipc_snapshot;
+    InterlockedIncrement64(&g_ipc_sequence);
+    snapshot->invariant_violations = g_invariant_violations;
+    snapshot->log_dropped = g_log_buffer.dropped;
+    snapshot->capture_overflows = g_capture_overflows;
+    if (g_hook_degraded) {
+        InterlockedIncrement64(&g_ipc_sequence);
+        return;
+    }
+    if (g_ipc_profile_changes != g_profile_changes) {
+        // Names are copied, they go with the config.
+        g_ipc_profile_changes = g_profile_changes;
+        snprintf(snapshot->profile, IPC_NAME_SIZE, "%s", g_profile->profile_name ? g_profile->profile_name : "");
+        snapshot->layer_count = g_profile->layer_count - 1 < IPC_MAX_LAYERS ? g_profile->layer_count - 1 : IPC_MAX_LAYERS;
+        for (int i = 0; i < snapshot->layer_count; i++) {
+            snprintf(snapshot->layers[i].name, IPC_NAME_SIZE, "%s", g_profile->layers[i + 1].name);
+        }
+    }
+    for (int i = 0; i < snapshot->layer_count; i++) {
+        struct Layer * layer = &g_profile->layers[i + 1];
+        snapshot->layers[i].state = (uint8_t)layer->state;
+        snapshot->layers[i].lock = (uint8_t)layer->lock;
+    }
+    int count = 0;
+    for (struct Remap * remap = g_remap_list; remap && count < IPC_MAX_REMAPS; remap = remap->next) {
+        struct IpcRemap * item = &snapshot->remaps[count++];
+        item->id = (uint8_t)remap->id;
+        item->state = (uint8_t)remap->state;
+        item->tap_lock = (uint8_t)remap->tap_lock;
+        item->double_tap_lock = (uint8_t)remap->double_tap_lock;
+        item->virt_code = (uint16_t)remap->from->virt_code;
+    }
+    snapshot->remap_count = count;
+    snapshot->mouse_active = g_active;
+    snapshot->mouse_buttons = state.buttons;
+    snapshot->mouse_held_keys = state.held_keys;
+    snapshot->mouse_selected_button = state.selected_button;
+    snapshot->mouse_speed = state.speed;
+    snapshot->mouse_angle = state.angle;
+    InterlockedIncrement64(&g_ipc_sequence);
+}
+
+// On the hook thread only, the budget is timed after handle_input.
+void ipc_publish_budget() {
+    if (!g_ipc_enabled) return;
+    InterlockedIncrement64(&g_ipc_budget_sequence);
+    g_ipc_budget.budget = g_hook_budget;
+    g_ipc_budget.degraded = g_hook_degraded;
+    InterlockedIncrement64(&g_ipc_budget_sequence);
+}
+
+// Copies the last snapshot, from the thread serving the requests.
+static void read_snapshot(struct IpcSnapshot * snapshot) {
+    LONG64 before, after;
+    do {
+        before = InterlockedCompareExchange64(&g_ipc_sequence, 0, 0);
+        if (before & 1) continue;
+        memcpy(snapshot, &g_ipc_snapshot, sizeof(struct IpcSnapshot));
+        after = InterlockedCompareExchange64(&g_ipc_sequence, 0, 0);
+    } while ((before & 1) || before != after);
+}
+
+// Copies the last budget, from the thread serving the requests.
+static void read_budget(struct IpcBudget * budget) {
+    LONG64 before, after;
+    do {
+        before = InterlockedCompareExchange64(&g_ipc_budget_sequence, 0, 0);
+        if (before & 1) continue;
+        memcpy(budget, &g_ipc_budget, sizeof(struct IpcBudget));
+        after = InterlockedCompareExchange64(&g_ipc_budget_sequence, 0, 0);
+    } while ((before & 1) || before != after);
+}
+
+/* Runs the posted command, on the engine thread only.
+ * @return error */
+static int run_command(struct IpcCommand * command, struct InputBuffer * input_buffer) {
+    if (command->type == IPC_UNLOCK) {
+        unlock_all(input_buffer);
+        return 0;
+    }
+    int id = find_layer(g_profile, command->layer);
+    if (!id) return 1;
+    if (command->type == IPC_SET_LAYER) {
+        set_layer_lock(get_layer(id));
+        set_layer_state(id, 1);
+    } else {
+        reset_layer_lock(get_layer(id));
+        set_layer_state(id, check_layer_state(id));
+    }
+    return 0;
+}
+
+void ipc_run_commands(struct InputBuffer * input_buffer) {
+    if (g_ipc_slot != IPC_SLOT_POSTED) return;
+    // Taken unless withdrawn meanwhile.
+    if (InterlockedCompareExchange(&g_ipc_slot, IPC_SLOT_RUNNING, IPC_SLOT_POSTED) != IPC_SLOT_POSTED) return;
+    g_ipc_error = run_command(&g_ipc_command, input_buffer);
+    InterlockedExchange(&g_ipc_slot, IPC_SLOT_DONE);
+    ipc_publish();
+}
+
+/* Posts a command to the engine and waits for it, one request at a time.
+ * @return reply */
+static const char * post_command(enum IpcCommandType type, const char * layer) {
+    g_ipc_command.type = type;
+    snprintf(g_ipc_command.layer, IPC_NAME_SIZE, "%s", layer ? layer : "");
+    InterlockedExchange(&g_ipc_slot, IPC_SLOT_POSTED);
+    wake_engine();
+    for (int waited = 0; g_ipc_slot != IPC_SLOT_DONE; waited++) {
+        if (waited >= IPC_COMMAND_TIMEOUT_MS &&
+            InterlockedCompareExchange(&g_ipc_slot, IPC_SLOT_EMPTY, IPC_SLOT_POSTED) == IPC_SLOT_POSTED) {
+            return "error: no answer from the engine, the command is withdrawn";
+        }
+        platform_sleep_ms(1);
+    }
+    InterlockedExchange(&g_ipc_slot, IPC_SLOT_EMPTY);
+    return g_ipc_error ? "error: unknown layer" : "ok";
+}
+
+struct IpcReply {
+    char * text;
+    int size;
+    int length;
+};
+
+static void reply_printf(struct IpcReply * reply, const char * format, ...) {
+    if (reply->length >= reply->size - 1) return;
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(reply->text + reply->length, reply->size - reply->length, format, args);
+    va_end(args);
+    if (length > 0) reply->length += length;
+    if (reply->length > reply->size - 1) reply->length = reply->size - 1;
+}
+
+/* Answers one command line, from the thread serving the requests.
+ * @return length of the reply */
+int ipc_request(const char * request, char * text, int size) {
+    struct IpcReply reply = {text, size, 0};
+    char command[16] = "";
+    char argument[IPC_NAME_SIZE] = "";
+    sscanf(request, "%15s %23s", command, argument);
+    text[0] = '\0';
+    if (strcmp(command, "set") == 0 || strcmp(command, "reset") == 0) {
+        reply_printf(&reply, "%s\n", argument[0]
+            ? post_command(command[0] == 's' ? IPC_SET_LAYER : IPC_RESET_LAYER, argument)
+            : "error: no layer given");
+    } else if (strcmp(command, "unlock") == 0) {
+        reply_printf(&reply, "%s\n", post_command(IPC_UNLOCK, NULL));
+    } else if (strcmp(command, "layers") == 0 || strcmp(command, "remaps") == 0 ||
+               strcmp(command, "mouse") == 0 || strcmp(command, "stats") == 0) {
+        static struct IpcSnapshot snapshot; // one request at a time
+        read_snapshot(&snapshot);
+        if (command[0] == 'l') {
+            reply_printf(&reply, "profile %s\n", snapshot.profile[0] ? snapshot.profile : "-");
+            for (int i = 0; i < snapshot.layer_count; i++) {
+                reply_printf(&reply, "layer %s state %d lock %d\n", snapshot.layers[i].name,
+                             snapshot.layers[i].state, snapshot.layers[i].lock);
+            }
+        } else if (command[0] == 'r') {
+            for (int i = 0; i < snapshot.remap_count; i++) {
+                struct IpcRemap * remap = &snapshot.remaps[i];
+                reply_printf(&reply, "remap %d %s %s%s%s\n", remap->id, friendly_virt_code_name(remap->virt_code),
+                             remap_state_name(remap->state),
+                             remap->tap_lock ? " tap_lock" : "", remap->double_tap_lock ? " double_tap_lock" : "");
+            }
+        } else if (command[0] == 'm') {
+            reply_printf(&reply, "mouse active %d buttons 0x%02X keys 0x%02X selected_button %d speed %.1f angle %.1f\n",
+                         snapshot.mouse_active, snapshot.mouse_buttons, snapshot.mouse_held_keys,
+                         snapshot.mouse_selected_button, snapshot.mouse_speed, snapshot.mouse_angle);
+        } else {
+            struct IpcBudget ipc_budget;
+            read_budget(&ipc_budget);
+            struct HookBudget * budget = &ipc_budget.budget;
+            reply_printf(&reply, "inputs %llu\nslow_inputs %llu\ndegraded_inputs %llu\ndegraded_count %llu\n"
+                                 "max_us %llu\naverage_us %llu\nmean_us %.2f\ndegraded %d\n",
+                         (unsigned long long)budget->inputs, (unsigned long long)budget->slow_inputs,
+                         (unsigned long long)budget->degraded_inputs, (unsigned long long)budget->degraded_count,
+                         (unsigned long long)budget->max_us, (unsigned long long)budget->average_us,
+                         budget->inputs ? (double)budget->total_us / budget->inputs : 0.0, ipc_budget.degraded);
+            reply_printf(&reply, "invariant_violations %d\nlog_dropped %lld\ncapture_overflows %lld\n",
+                         snapshot.invariant_violations, (long long)snapshot.log_dropped,
+                         (long long)snapshot.capture_overflows);
+        }
+    } else {
+        reply_printf(&reply, "error: unknown command, expected " IPC_COMMANDS "\n");
+    }
+    reply_printf(&reply, "\n");
+    return reply.length;
+}
@@ -2,88 +2,154 @@
 
 #include <windows.h>
 #include <stdio.h>
-#include <ctype.h>
-#include <stdint.h>
-#include <time.h>
-#include "input.h"
-#include "keys.c"
-#include "remap.c"
-#include "mouse.c"
+#include "platform_win32.c"
+#include "engine.c"
 
 #pragma comment(lib, "winmm.lib") // for timeGetTime()
 
+#define CONFIG_RELOAD_DELAY_MS 100
+#define RECORDER_DUMP_EVENT "keyboard_remapper.flight-recorder"
+#define IPC_PIPE_NAME "\\\\.\\pipe\\keyboard_remapper"
+#define IPC_REQUEST_SIZE 256
+#define IPC_REPLY_SIZE 4096
+#define WM_IPC_COMMAND (WM_APP + 1)
+#define WM_REHOOK (WM_APP + 2)
+
 // Globals
 // ----------------
 
 HHOOK g_keyboard_hook;
 HHOOK g_mouse_hook;
+HWINEVENTHOOK g_foreground_hook;
+HANDLE g_foreground_event; // wakes config_reload_thread
+HWND volatile g_foreground = NULL; // set by foreground_callback
 HANDLE ghEvent;
-HANDLE ghTimerQueue = NULL;
-struct InputBuffer g_input_buffer;
-
-void debug_file(const char * message) {
-    FILE * log_file = fopen("debug.log", "a");
-    if (log_file == NULL) {
-        return;
+DWORD g_hook_thread_id;
+
+// Full capture, see capture.c. The setting is read at launch only.
+static int g_capturing = 0;
+static HANDLE g_capture_event;
+static HANDLE g_capture_thread;
+static int g_captured_buttons = 0; // pressed while blocked, on the hook thread
+static int g_reinjected_buttons = 0; // pressed again, on the engine thread
+
+/* Queues the mouse input of a hook message to the output.
+ * @return error, the buffer is full */
+static int queue_mouse_input(WPARAM w_param, DWORD mouse_data) {
+    uint32_t n, tail;
+    int index;
+    n = input_buffer_move_prod_head(&g_input_buffer, &tail);
+    index = tail & INPUT_BUFFER_MASK;
+    if (n == 0) {
+        if (g_debug) debug_print(RED, "\nError: input buffer is full!");
+        debug_file("Error: input buffer is full!");
+        return 1;
     }
-
-    time_t now = time(NULL);
-    char * timestamp = ctime(&now);
-    timestamp[strlen(timestamp) - 1] = '\0';
-
-    fprintf(log_file, "[%s] %s\n", timestamp, message);
-    fclose(log_file);
+    ZeroMemory(&g_input_buffer.inputs[index], sizeof(INPUT));
+
+    g_input_buffer.inputs[index].type = INPUT_MOUSE;
+    g_input_buffer.inputs[index].mi.dwExtraInfo = (ULONG_PTR)INJECTED_KEY_ID;
+
+    switch (w_param) {
+    case WM_LBUTTONDOWN:
+        g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_LEFTDOWN;
+        break;
+    case WM_LBUTTONUP:
+        g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_LEFTUP;
+        break;
+    case WM_RBUTTONDOWN:
+        g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_RIGHTDOWN;
+        break;
+    case WM_RBUTTONUP:
+        g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_RIGHTUP;
+        break;
+    case WM_MBUTTONDOWN:
+        g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_MIDDLEDOWN;
+        break;
+    case WM_MBUTTONUP:
+        g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_MIDDLEUP;
+        break;
+    case WM_XBUTTONDOWN:
+        g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_XDOWN;
+        g_input_buffer.inputs[index].mi.mouseData = mouse_data;
+        break;
+    case WM_XBUTTONUP:
+        g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_XUP;
+        g_input_buffer.inputs[index].mi.mouseData = mouse_data;
+        break;
+    case WM_MOUSEWHEEL:
+        g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_WHEEL;
+        g_input_buffer.inputs[index].mi.mouseData = ((int)mouse_data)>>16;
+        break;
+    }
+    input_buffer_commit(&g_input_buffer, tail, n);
+    return 0;
 }
 
-void debug_print(const char * color, const char * format, ...) {
-    va_list args;
-    va_start(args, format);
-
-    printf("%s", color);
-    vprintf(format, args);
-    printf("%s", RESET);
-
-    va_end(args);
+// Bit of the button of a hook message, 0 for the wheel.
+static int mouse_button_bit(WPARAM w_param, DWORD mouse_data) {
+    switch (w_param) {
+    case WM_LBUTTONDOWN:
+    case WM_LBUTTONUP:
+        return 0x01;
+    case WM_RBUTTONDOWN:
+    case WM_RBUTTONUP:
+        return 0x02;
+    case WM_MBUTTONDOWN:
+    case WM_MBUTTONUP:
+        return 0x04;
+    case WM_XBUTTONDOWN:
+    case WM_XBUTTONUP:
+        return HIWORD(mouse_data) == XBUTTON1 ? 0x08 : 0x10;
+    }
+    return 0;
 }
 
-void send_input(int scan_code, int virt_code, enum Direction direction, int remap_id, struct InputBuffer * input_buffer) {
-    if (virt_code) {
-        uint32_t n, tail;
-        int index;
-        n = input_buffer_move_prod_head(input_buffer, &tail);
-        index = tail & INPUT_BUFFER_MASK;
-        if (n == 0) {
-            if (g_debug) debug_print(RED, "\nError: input buffer is full!");
-            debug_file("Error: input buffer is full!");
-            return;
+/* The mouse hook with full capture: the presses and the wheel are queued,
+ * the releases of the blocked presses follow them.
+ * @return block_input */
+static int capture_mouse(WPARAM w_param, MSLLHOOKSTRUCT * data, int is_injected) {
+    int bit = mouse_button_bit(w_param, data->mouseData);
+    int block_input = 0;
+    switch (w_param) {
+    case WM_LBUTTONDOWN:
+    case WM_RBUTTONDOWN:
+    case WM_MBUTTONDOWN:
+    case WM_XBUTTONDOWN:
+    case WM_MOUSEWHEEL:
+        block_input = capture_input(w_param, MOUSE_DUMMY_VK, DOWN, is_injected, data->flags, data->dwExtraInfo,
+                                    data->mouseData);
+        if (block_input) g_captured_buttons |= bit;
+        SetEvent(g_capture_event);
+        break;
+    case WM_LBUTTONUP:
+    case WM_RBUTTONUP:
+    case WM_MBUTTONUP:
+    case WM_XBUTTONUP:
+        if (!is_injected && (g_captured_buttons & bit)) {
+            g_captured_buttons &= ~bit;
+            capture_follow(w_param, data->mouseData);
+            SetEvent(g_capture_event);
+            block_input = 1;
         }
-        ZeroMemory(&input_buffer->inputs[index], sizeof(INPUT));
-
-        input_buffer->inputs[index].type = INPUT_KEYBOARD;
-        input_buffer->inputs[index].ki.time = 0;
-        input_buffer->inputs[index].ki.dwExtraInfo = (ULONG_PTR)(INJECTED_KEY_ID | remap_id);
-
-        input_buffer->inputs[index].ki.wScan = scan_code;
-        input_buffer->inputs[index].ki.wVk = ((g_scancode && scan_code != 0x00) ? 0 : virt_code);
-        // Per MS Docs: https://learn.microsoft.com/en-us/windows/win32/api/winuser/nf-winuser-keybd_even
-        // we need to flag whether "the scan code was preceded by a prefix byte having the value 0xE0 (224)"
-        int is_extended_key = scan_code>>8 == 0xE0;
-        input_buffer->inputs[index].ki.dwFlags = (direction == UP ? KEYEVENTF_KEYUP : 0) |
-            (is_extended_key ? KEYEVENTF_EXTENDEDKEY : 0) |
-            ((g_scancode && scan_code != 0x00) ? KEYEVENTF_SCANCODE : 0);
-        input_buffer_update_tail(&input_buffer->prod, tail, n);
-    } else {
-        mouse_emulation(scan_code, direction, remap_id, &g_input_buffer);
+        break;
     }
+    return block_input;
 }
 
 LRESULT CALLBACK mouse_callback(int msg_code, WPARAM w_param, LPARAM l_param) {
+    uint64_t start = budget_start();
     int block_input = 0;
 
     // Per MS docs we should only act for HC_ACTION's
     if (msg_code == HC_ACTION) {
         MSLLHOOKSTRUCT * data = (MSLLHOOKSTRUCT *)l_param;
         int is_injected = ((LLMHF_INJECTED & data->flags) && data->dwExtraInfo != 0x00) ? 1 : 0;
+        if (g_capturing) {
+            block_input = capture_mouse(w_param, data, is_injected);
+            budget_end(start);
+            return (block_input) ? 1 : CallNextHookEx(NULL, msg_code, w_param, l_param);
+        }
         switch (w_param) {
         case WM_LBUTTONDOWN:
         case WM_RBUTTONDOWN:
@@ -95,58 +161,27 @@ LRESULT CALLBACK mouse_callback(int msg_code, WPARAM w_param, LPARAM l_param) {
                 w_param,
                 MOUSE_DUMMY_VK,
                 DOWN,
-                data->time,
                 is_injected,
                 data->flags,
                 data->dwExtraInfo,
                 &g_input_buffer);
         }
 
-        if (block_input == -1) {
-            uint32_t n, tail;
-            int index;
-            n = input_buffer_move_prod_head(&g_input_buffer, &tail);
-            index = tail & INPUT_BUFFER_MASK;
-            if (n == 0) {
-                if (g_debug) debug_print(RED, "\nError: input buffer is full!");
-                debug_file("Error: input buffer is full!");
-                return 1;
-            }
-            ZeroMemory(&g_input_buffer.inputs[index], sizeof(INPUT));
-
-            g_input_buffer.inputs[index].type = INPUT_MOUSE;
-            g_input_buffer.inputs[index].mi.dwExtraInfo = (ULONG_PTR)INJECTED_KEY_ID;
-
-            switch (w_param) {
-            case WM_LBUTTONDOWN:
-                g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_LEFTDOWN;
-                break;
-            case WM_RBUTTONDOWN:
-                g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_RIGHTDOWN;
-                break;
-            case WM_MBUTTONDOWN:
-                g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_MIDDLEDOWN;
-                break;
-            case WM_XBUTTONDOWN:
-                g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_XDOWN;
-                g_input_buffer.inputs[index].mi.mouseData = data->mouseData;
-                break;
-            case WM_MOUSEWHEEL:
-                g_input_buffer.inputs[index].mi.dwFlags |= MOUSEEVENTF_WHEEL;
-                g_input_buffer.inputs[index].mi.mouseData = ((int)data->mouseData)>>16;
-                break;
-            }
-            input_buffer_update_tail(&g_input_buffer.prod, tail, n);
+        if (block_input == -1 && queue_mouse_input(w_param, data->mouseData)) {
+            budget_end(start);
+            return 1;
         }
     }
     if (!input_buffer_empty(&g_input_buffer)) {
         SetEvent(ghEvent);
     }
 
+    budget_end(start);
     return (block_input) ? 1 : CallNextHookEx(NULL, msg_code, w_param, l_param);
 }
 
 LRESULT CALLBACK keyboard_callback(int msg_code, WPARAM w_param, LPARAM l_param) {
+    uint64_t start = budget_start();
     int block_input = 0;
     
     // Per MS docs we should only act for HC_ACTION's
@@ -154,11 +189,17 @@ LRESULT CALLBACK keyboard_callback(int msg_code, WPARAM w_param, LPARAM l_param)
         KBDLLHOOKSTRUCT * data = (KBDLLHOOKSTRUCT *)l_param;
         enum Direction direction = (LLKHF_UP & data->flags) ? UP : DOWN;
         int is_injected = (LLKHF_INJECTED & data->flags) ? 1 : 0;
+        if (g_capturing) {
+            block_input = capture_input(data->scanCode, data->vkCode, direction, is_injected, data->flags,
+                                        data->dwExtraInfo, 0);
+            SetEvent(g_capture_event);
+            budget_end(start);
+            return (block_input) ? 1 : CallNextHookEx(NULL, msg_code, w_param, l_param);
+        }
         block_input = handle_input(
             data->scanCode,
             data->vkCode,
             direction,
-            data->time,
             is_injected,
             data->flags,
             data->dwExtraInfo,
@@ -173,9 +214,52 @@ LRESULT CALLBACK keyboard_callback(int msg_code, WPARAM w_param, LPARAM l_param)
         }
     }
 
+    budget_end(start);
     return (block_input) ? 1 : CallNextHookEx(NULL, msg_code, w_param, l_param);
 }
 
+// Runs on the hook thread, like keyboard_callback: the profile of the window
+// is resolved by config_reload_thread, which looks up its process name.
+void CALLBACK foreground_callback(HWINEVENTHOOK hook, DWORD event, HWND window, LONG object_id, LONG child_id,
+                                  DWORD event_thread, DWORD event_time) {
+    g_foreground = window;
+    SetEvent(g_foreground_event);
+}
+
+// Sends a blocked input again from the engine thread, unless the engine blocked it.
+void capture_send(struct CapturedInput * input, int block_input) {
+    if (input->virt_code != MOUSE_DUMMY_VK) {
+        if (block_input != 1) {
+            // Keeps e.g. the arrows apart from the keypad.
+            int extended = input->flags & LLKHF_EXTENDED ? 0xE000 : 0;
+            send_input(input->scan_code | extended, input->virt_code, input->direction, 0, &g_input_buffer);
+        }
+        return;
+    }
+    // A release goes out only after its press did.
+    int bit = mouse_button_bit(input->scan_code, input->data);
+    if (input->direction == DOWN) {
+        if (block_input == 1) return;
+        g_reinjected_buttons |= bit;
+    } else if (g_reinjected_buttons & bit) {
+        g_reinjected_buttons &= ~bit;
+    } else {
+        return;
+    }
+    queue_mouse_input(input->scan_code, input->data);
+}
+
+// The engine thread of full capture.
+DWORD WINAPI capture_thread(LPVOID arg) {
+    while (WaitForSingleObject(g_capture_event, INFINITE) == WAIT_OBJECT_0 && !g_capture_stop) {
+        capture_run(&g_input_buffer);
+        if (!input_buffer_empty(&g_input_buffer)) {
+            SetEvent(ghEvent);
+        }
+    }
+    return 0;
+}
+
 void enable_ansi_support() {
     HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
     DWORD mode = 0;
@@ -198,35 +282,145 @@ void destroy_console() {
     FreeConsole();
 }
 
-int load_config_file(wchar_t * path) {
-    FILE * file;
-    char line[255];
+void put_config_path(wchar_t * path) {
+    HMODULE module = GetModuleHandleW(NULL);
+    GetModuleFileNameW(module, path, MAX_PATH);
+    path[wcslen(path) - strlen("keyboard_remapper.exe")] = '\0';
+    wcscat(path, L"config.txt");
+}
+
+uint64_t get_config_write_time(wchar_t * config_path) {
+    uint32_t size;
+    uint64_t time;
+    return platform_file_info(config_path, &size, &time) ? 0 : time;
+}
 
-    if (_wfopen_s(&file, path, L"r") > 0) {
-        printf("Cannot open configuration file '%ws'. Make sure it is in the same directory as 'keyboard_remapper.exe'.\n",
-            path);
-        return 1;
+// Watches config.txt and parses it again when it is saved. The new config is
+// handed to the hook thread with publish_config, so the hook never parses.
+// Also resolves the profile of the foreground window when it changes.
+DWORD WINAPI config_reload_thread(LPVOID arg) {
+    wchar_t * config_path = (wchar_t *)arg;
+    wchar_t config_dir[MAX_PATH];
+    wcscpy(config_dir, config_path);
+    config_dir[wcslen(config_dir) - wcslen(L"config.txt")] = '\0';
+
+    HANDLE events[2] = {g_foreground_event, NULL};
+    events[1] = FindFirstChangeNotificationW(config_dir, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE);
+    if (events[1] == INVALID_HANDLE_VALUE) {
+        // Keep following the foreground window.
+        debug_file("Error: cannot watch config.txt for changes");
+        events[1] = NULL;
     }
+    HANDLE change = events[1];
+    uint64_t write_time = get_config_write_time(config_path);
+    DWORD wait;
+    while ((wait = WaitForMultipleObjects(change ? 2 : 1, events, FALSE, INFINITE)) == WAIT_OBJECT_0 + 1 ||
+           wait == WAIT_OBJECT_0) {
+        if (wait == WAIT_OBJECT_0) {
+            foreground_changed(g_foreground);
+            // The engine switches between inputs, or now if it is idle.
+            wake_engine();
+            continue;
+        }
+        // Editors may write the file in several steps, let them finish.
+        Sleep(CONFIG_RELOAD_DELAY_MS);
+        FindNextChangeNotification(change);
+        uint64_t time = get_config_write_time(config_path);
+        if (time == 0 || time == write_time) {
+            continue;
+        }
+        write_time = time;
+
+        struct Config * config = read_config(config_path);
+        if (config == NULL) {
+            // Keep running with the current config.
+            DEBUG(1, debug_print(RED, "\nConfig reload failed, config.txt has errors"));
+            debug_file("Error: config reload failed, config.txt has errors");
+            continue;
+        }
+        config->debug = config->debug || getenv("DEBUG") != NULL;
+        publish_config(config);
+    }
+    if (change) FindCloseChangeNotification(change);
+    return 0;
+}
 
-    int linenum = 1;
-    while (fgets(line, 255, file)) {
-        if (load_config_line((char *)&line, linenum++)) {
-            fclose(file);
+// Dumps the flight recorder when `keyboard_remapper.exe --dump` asks for it.
+DWORD WINAPI recorder_dump_thread(LPVOID arg) {
+    HANDLE dump_event = (HANDLE)arg;
+    while (WaitForSingleObject(dump_event, INFINITE) == WAIT_OBJECT_0) {
+        recorder_request_dump("on demand");
+        // Written by the hook thread, which owns the remaps.
+        g_remap_stats_requested = 1;
+    }
+    return 0;
+}
+
+LONG WINAPI crash_filter(EXCEPTION_POINTERS * exception) {
+    recorder_crash_dump("crash");
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+void wake_output() {
+    SetEvent(ghEvent);
+}
+
+// The message loop of the hook thread runs the commands, or the engine thread with full capture.
+void wake_engine() {
+    if (g_capturing) {
+        SetEvent(g_capture_event);
+    } else {
+        PostThreadMessage(g_hook_thread_id, WM_IPC_COMMAND, 0, 0);
+    }
+}
+
+// Serves `keyboard_remapper.exe --ipc` one client at a time, one reply per message.
+DWORD WINAPI ipc_thread(LPVOID arg) {
+    char request[IPC_REQUEST_SIZE];
+    char reply[IPC_REPLY_SIZE];
+    while (1) {
+        HANDLE pipe = CreateNamedPipe(IPC_PIPE_NAME, PIPE_ACCESS_DUPLEX,
+                                      PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                      1, IPC_REPLY_SIZE, IPC_REQUEST_SIZE, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE) {
+            debug_file("Error: cannot create the introspection pipe");
             return 1;
         }
-    };
-    fclose(file);
-    return load_config_line(NULL, linenum++);
+        if (ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED) {
+            DWORD size;
+            while (ReadFile(pipe, request, sizeof(request) - 1, &size, NULL)) {
+                request[size] = '\0';
+                int length = ipc_request(request, reply, sizeof(reply));
+                if (!WriteFile(pipe, reply, length, &size, NULL)) break;
+            }
+        }
+        DisconnectNamedPipe(pipe);
+        CloseHandle(pipe);
+    }
 }
 
-void put_config_path(wchar_t * path) {
-    HMODULE module = GetModuleHandleW(NULL);
-    GetModuleFileNameW(module, path, MAX_PATH);
-    path[wcslen(path) - strlen("keyboard_remapper.exe")] = '\0';
-    wcscat(path, L"config.txt");
+// `keyboard_remapper.exe --ipc command...`: asks the running instance, prints the reply.
+int ipc_client(int argc, char ** argv) {
+    char request[IPC_REQUEST_SIZE] = "";
+    for (int i = 0; i < argc; i++) {
+        snprintf(request + strlen(request), sizeof(request) - strlen(request), "%s%s", argv[i], i + 1 < argc ? " " : "");
+    }
+    char reply[IPC_REPLY_SIZE];
+    DWORD size;
+    if (!CallNamedPipe(IPC_PIPE_NAME, request, (DWORD)strlen(request), reply, sizeof(reply), &size, 1000)) {
+        printf("keyboard_remapper.exe is not running.\n");
+        return 1;
+    }
+    fwrite(reply, 1, size, stdout);
+    return size >= 6 && strncmp(reply, "error:", 6) == 0;
 }
 
 void rehook() {
+    // The hooks belong to the thread that set them, the engine thread asks it.
+    if (GetCurrentThreadId() != g_hook_thread_id) {
+        PostThreadMessage(g_hook_thread_id, WM_REHOOK, 0, 0);
+        return;
+    }
     UnhookWindowsHookEx(g_keyboard_hook);
     UnhookWindowsHookEx(g_mouse_hook);
     g_mouse_hook = SetWindowsHookEx(WH_MOUSE_LL, mouse_callback, NULL, 0);
@@ -245,7 +439,9 @@ DWORD WINAPI send_input_thread(LPVOID arg) {
             n = input_buffer_move_cons_head(input_buffer, -2, &tail);
             index = tail & INPUT_BUFFER_MASK;
             if (n > 0) {
+                uint64_t start = platform_time_us();
                 SendInput(n, &input_buffer->inputs[index], sizeof(INPUT));
+                trace_send(start, n);
                 input_buffer_update_tail(&input_buffer->cons, tail, n);
             }
         }
@@ -255,18 +451,61 @@ DWORD WINAPI send_input_thread(LPVOID arg) {
 void close_all() {
     UnhookWindowsHookEx(g_keyboard_hook);
     UnhookWindowsHookEx(g_mouse_hook);
-    if (g_active) g_active = 0;
-    if (ghTimer) DeleteTimerQueueTimer(ghTimerQueue, ghTimer, NULL);
+    if (g_foreground_hook) UnhookWinEvent(g_foreground_hook);
+    if (g_capture_thread) {
+        // Passes what is left in the queue, unlock_all then runs alone.
+        g_capture_stop = 1;
+        SetEvent(g_capture_event);
+        WaitForSingleObject(g_capture_thread, 1000);
+        capture_run(&g_input_buffer);
+    }
+    stop_move_timer();
+    log_stop();
+    trace_stop();
     CloseHandle(ghEvent);
     DeleteTimerQueue(ghTimerQueue);
     unlock_all(&g_input_buffer);
-    free_all();
+    free_config(g_config);
+    free_config(g_config_pending);
 }
 
-int main() {
+int main(int argc, char ** argv) {
     HANDLE threadHandle;
     DWORD threadId;
 
+    build_key_index();
+
+    if (argc > 1 && strcmp(argv[1], "--check") == 0) {
+        wchar_t check_path[MAX_PATH];
+        if (argc > 2) {
+            mbstowcs(check_path, argv[2], MAX_PATH);
+        } else {
+            put_config_path(check_path);
+        }
+        return check_config(check_path);
+    }
+    if (argc > 2 && strcmp(argv[1], "--decode") == 0) {
+        return decode_recording(argv[2], stdout);
+    }
+    if (argc > 2 && strcmp(argv[1], "--ipc") == 0) {
+        return ipc_client(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "--dump") == 0) {
+        HANDLE dump_event = OpenEvent(EVENT_MODIFY_STATE, FALSE, RECORDER_DUMP_EVENT);
+        if (dump_event == NULL) {
+            printf("keyboard_remapper.exe is not running.\n");
+            return 1;
+        }
+        SetEvent(dump_event);
+        CloseHandle(dump_event);
+        return 0;
+    }
+
+    const char * trace_path = NULL;
+    if (argc > 2 && strcmp(argv[1], "--trace") == 0) {
+        trace_path = argv[2];
+    }
+
     // Initialization may print errors to stdout, create a console to show that output.
     create_console();
     debug_print(GREEN, "== keyboard_remapper %s ==\n\n", VERSION);
@@ -278,12 +517,14 @@ int main() {
         goto end;
     }
 
-    wchar_t config_path[MAX_PATH];
+    static wchar_t config_path[MAX_PATH];
     put_config_path(config_path);
-    int err = load_config_file(config_path);
-    if (err) {
+    struct Config * config = read_config(config_path);
+    if (config == NULL) {
         goto end;
     }
+    config->debug = config->debug || getenv("DEBUG") != NULL;
+    activate_config(config);
 
     if (g_priority) {
         if (!SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS)) {
@@ -309,10 +550,56 @@ int main() {
         goto end;
     }
     ghTimerQueue = CreateTimerQueue();
+    if (log_start()) {
+        printf("Error creating the log timer: %d\n", GetLastError());
+        goto end;
+    }
+    if (trace_path && trace_start(trace_path)) {
+        goto end;
+    }
+    SetUnhandledExceptionFilter(crash_filter);
+    HANDLE dump_event = CreateEvent(NULL, FALSE, FALSE, RECORDER_DUMP_EVENT);
+    if (dump_event == NULL || CreateThread(NULL, 0, recorder_dump_thread, dump_event, 0, NULL) == NULL) {
+        printf("Error creating the flight recorder thread: %d\n", GetLastError());
+        goto end;
+    }
+
+    g_foreground_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (g_foreground_event == NULL ||
+        CreateThread(NULL, 0, config_reload_thread, config_path, 0, NULL) == NULL) {
+        printf("Error creating the config reload thread: %d\n", GetLastError());
+        goto end;
+    }
+
+    g_hook_thread_id = GetCurrentThreadId();
+    g_capturing = g_full_capture;
+    if (g_capturing) {
+        g_capture_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        g_capture_thread = g_capture_event ? CreateThread(NULL, 0, capture_thread, NULL, CREATE_SUSPENDED, NULL) : NULL;
+        if (g_capture_thread == NULL) {
+            printf("Error creating the engine thread: %d\n", GetLastError());
+            goto end;
+        }
+        SetThreadPriority(g_capture_thread, THREAD_PRIORITY_HIGHEST);
+    }
+
+    // Not needed to remap, only reported.
+    g_ipc_enabled = 1;
+    ipc_publish();
+    if (CreateThread(NULL, 0, ipc_thread, NULL, 0, NULL) == NULL) {
+        printf("Error creating the introspection thread: %d\n", GetLastError());
+        g_ipc_enabled = 0;
+    }
 
-    g_debug = g_debug || getenv("DEBUG") != NULL;
     g_mouse_hook = SetWindowsHookEx(WH_MOUSE_LL, mouse_callback, NULL, 0);
     g_keyboard_hook = SetWindowsHookEx(WH_KEYBOARD_LL, keyboard_callback, NULL, 0);
+    // Profiles may also come with a reloaded config, always follow the foreground window.
+    g_foreground_hook = SetWinEventHook(EVENT_SYSTEM_FOREGROUND, EVENT_SYSTEM_FOREGROUND, NULL,
+                                        foreground_callback, 0, 0, WINEVENT_OUTOFCONTEXT);
+    g_foreground = GetForegroundWindow();
+    SetEvent(g_foreground_event);
+    // The hooks only run in the message loop, the engine is left to this thread.
+    if (g_capture_thread) ResumeThread(g_capture_thread);
 
     // We're all good if we got this far. Hide the console window unless we're debugging.
     if (g_debug) {
@@ -324,6 +611,19 @@ int main() {
     MSG msg;
     while (GetMessage(&msg, NULL, 0, 0) > 0)
     {
+        if (msg.message == WM_IPC_COMMAND) {
+            // Sent for the profile of a new foreground window too.
+            switch_profile(&g_input_buffer);
+            ipc_run_commands(&g_input_buffer);
+            if (!input_buffer_empty(&g_input_buffer)) {
+                SetEvent(ghEvent);
+            }
+            continue;
+        }
+        if (msg.message == WM_REHOOK) {
+            rehook();
+            continue;
+        }
         TranslateMessage(&msg);
         DispatchMessage(&msg);
     }
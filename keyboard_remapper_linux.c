@@ -0,0 +1,1072 @@
+#define VERSION "1.1.2"
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "platform_posix.c"
+#include "engine.c"
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+// Linux backend
+// --------------------------------------
+//
+// Grabs keyboards exclusively through evdev and hands their key events to
+// handle_input, outputs are written to a uinput virtual device. The grabbed
+// devices are read in batches from one epoll loop, which is also the only
+// consumer of g_input_buffer. Events without a KEY_DEF name are forwarded
+// unchanged.
+//
+// A FIFO works as a stand-in device (no grab), and --output writes the events
+// to a file or FIFO instead of uinput, so runs need no hardware nor root.
+
+#define MAX_DEVICES 16
+#define EVENT_BATCH 64
+#define GRAB_WAIT_MS 2000
+#define DEVICE_PATH_SIZE 300
+#define CONFIG_RELOAD_DELAY_MS 100
+#define IPC_SOCKET_NAME "keyboard_remapper.sock"
+#define IPC_REQUEST_SIZE 256
+#define IPC_REPLY_SIZE 4096
+
+// Linux key codes of the KEY_DEF names, in key code order. Outputs by
+// virtual key code use the first code of the key.
+static const struct {
+    int code;
+    char * name;
+} evdev_keys[] = {
+    {KEY_ESC, "ESCAPE"}, {KEY_1, "KEY_1"}, {KEY_2, "KEY_2"}, {KEY_3, "KEY_3"}, {KEY_4, "KEY_4"},
+    {KEY_5, "KEY_5"}, {KEY_6, "KEY_6"}, {KEY_7, "KEY_7"}, {KEY_8, "KEY_8"}, {KEY_9, "KEY_9"},
+    {KEY_0, "KEY_0"}, {KEY_MINUS, "MINUS"}, {KEY_EQUAL, "PLUS"}, {KEY_BACKSPACE, "BACKSPACE"},
+    {KEY_TAB, "TAB"}, {KEY_Q, "KEY_Q"}, {KEY_W, "KEY_W"}, {KEY_E, "KEY_E"}, {KEY_R, "KEY_R"},
+    {KEY_T, "KEY_T"}, {KEY_Y, "KEY_Y"}, {KEY_U, "KEY_U"}, {KEY_I, "KEY_I"}, {KEY_O, "KEY_O"},
+    {KEY_P, "KEY_P"}, {KEY_LEFTBRACE, "OEM_4"}, {KEY_RIGHTBRACE, "OEM_6"}, {KEY_ENTER, "ENTER"},
+    {KEY_LEFTCTRL, "LEFT_CTRL"}, {KEY_A, "KEY_A"}, {KEY_S, "KEY_S"}, {KEY_D, "KEY_D"},
+    {KEY_F, "KEY_F"}, {KEY_G, "KEY_G"}, {KEY_H, "KEY_H"}, {KEY_J, "KEY_J"}, {KEY_K, "KEY_K"},
+    {KEY_L, "KEY_L"}, {KEY_SEMICOLON, "OEM_1"}, {KEY_APOSTROPHE, "OEM_7"}, {KEY_GRAVE, "OEM_3"},
+    {KEY_LEFTSHIFT, "LEFT_SHIFT"}, {KEY_BACKSLASH, "OEM_5"}, {KEY_Z, "KEY_Z"}, {KEY_X, "KEY_X"},
+    {KEY_C, "KEY_C"}, {KEY_V, "KEY_V"}, {KEY_B, "KEY_B"}, {KEY_N, "KEY_N"}, {KEY_M, "KEY_M"},
+    {KEY_COMMA, "COMMA"}, {KEY_DOT, "PERIOD"}, {KEY_SLASH, "OEM_2"}, {KEY_RIGHTSHIFT, "RIGHT_SHIFT"},
+    {KEY_KPASTERISK, "NUMPAD_MULTIPLY"}, {KEY_LEFTALT, "LEFT_ALT"}, {KEY_SPACE, "SPACE"},
+    {KEY_CAPSLOCK, "CAPSLOCK"}, {KEY_F1, "F1"}, {KEY_F2, "F2"}, {KEY_F3, "F3"}, {KEY_F4, "F4"},
+    {KEY_F5, "F5"}, {KEY_F6, "F6"}, {KEY_F7, "F7"}, {KEY_F8, "F8"}, {KEY_F9, "F9"}, {KEY_F10, "F10"},
+    {KEY_NUMLOCK, "NUMLOCK"}, {KEY_SCROLLLOCK, "SCROLLLOCK"}, {KEY_KP7, "NUMPAD_7"},
+    {KEY_KP8, "NUMPAD_8"}, {KEY_KP9, "NUMPAD_9"}, {KEY_KPMINUS, "NUMPAD_SUBTRACT"},
+    {KEY_KP4, "NUMPAD_4"}, {KEY_KP5, "NUMPAD_5"}, {KEY_KP6, "NUMPAD_6"}, {KEY_KPPLUS, "NUMPAD_ADD"},
+    {KEY_KP1, "NUMPAD_1"}, {KEY_KP2, "NUMPAD_2"}, {KEY_KP3, "NUMPAD_3"}, {KEY_KP0, "NUMPAD_0"},
+    {KEY_KPDOT, "NUMPAD_DECIMAL"}, {KEY_102ND, "OEM_102"}, {KEY_F11, "F11"}, {KEY_F12, "F12"},
+    {KEY_RO, "ABNT_C1"}, {KEY_KATAKANAHIRAGANA, "IME_KANA"}, {KEY_HENKAN, "IME_CONVERT"},
+    {KEY_MUHENKAN, "IME_NONCONVERT"}, {KEY_KPENTER, "NUMPAD_ENTER"}, {KEY_RIGHTCTRL, "RIGHT_CTRL"},
+    {KEY_KPSLASH, "NUMPAD_DIVIDE"}, {KEY_SYSRQ, "PRINT_SCREEN"}, {KEY_RIGHTALT, "RIGHT_ALT"},
+    {KEY_HOME, "NAV_HOME"}, {KEY_UP, "NAV_UP"}, {KEY_PAGEUP, "NAV_PAGE_UP"}, {KEY_LEFT, "NAV_LEFT"},
+    {KEY_RIGHT, "NAV_RIGHT"}, {KEY_END, "NAV_END"}, {KEY_DOWN, "NAV_DOWN"},
+    {KEY_PAGEDOWN, "NAV_PAGE_DOWN"}, {KEY_INSERT, "NAV_INSERT"}, {KEY_DELETE, "NAV_DELETE"},
+    {KEY_MUTE, "VOLUME_MUTE"}, {KEY_VOLUMEDOWN, "VOLUME_DOWN"}, {KEY_VOLUMEUP, "VOLUME_UP"},
+    {KEY_PAUSE, "PAUSE"}, {KEY_KPCOMMA, "ABNT_C2"}, {KEY_LEFTMETA, "LEFT_WIN"},
+    {KEY_RIGHTMETA, "RIGHT_WIN"}, {KEY_COMPOSE, "APPS"}, {KEY_STOP, "BROWSER_STOP"},
+    {KEY_CALC, "LAUNCH_APP2"}, {KEY_SLEEP, "SLEEP"}, {KEY_MAIL, "LAUNCH_MAIL"},
+    {KEY_BOOKMARKS, "BROWSER_FAVORITES"}, {KEY_COMPUTER, "LAUNCH_APP1"}, {KEY_BACK, "BROWSER_BACK"},
+    {KEY_FORWARD, "BROWSER_FORWARD"}, {KEY_NEXTSONG, "MEDIA_NEXT_TRACK"},
+    {KEY_PLAYPAUSE, "MEDIA_PLAY_PAUSE"}, {KEY_PREVIOUSSONG, "MEDIA_PREV_TRACK"},
+    {KEY_STOPCD, "MEDIA_STOP"}, {KEY_HOMEPAGE, "BROWSER_HOME"}, {KEY_REFRESH, "BROWSER_REFRESH"},
+    {KEY_F13, "F13"}, {KEY_F14, "F14"}, {KEY_F15, "F15"}, {KEY_F16, "F16"}, {KEY_F17, "F17"},
+    {KEY_F18, "F18"}, {KEY_F19, "F19"}, {KEY_F20, "F20"}, {KEY_F21, "F21"}, {KEY_F22, "F22"},
+    {KEY_F23, "F23"}, {KEY_F24, "F24"}, {KEY_SEARCH, "BROWSER_SEARCH"}, {KEY_MEDIA, "LAUNCH_MEDIA_SELECT"},
+};
+
+// Globals
+// ----------------
+
+static KEY_DEF * g_key_by_evdev_code[KEY_CNT];
+static int g_evdev_code_by_virt[256];
+static int g_evdev_code_by_scan[512];
+
+static int g_output_fd = -1;
+static int g_output_is_uinput = 0;
+static int g_pointer_fd = -1; // absolute moves, the --output file too
+static int g_output_event = -1; // eventfd, wake_output from other threads
+static struct input_event g_output_events[EVENT_BATCH * 4];
+static int g_output_count = 0;
+static uint8_t g_output_key_down[KEY_CNT];
+static int g_wheel_rest[2];
+static struct sockaddr_un g_ipc_address;
+// Full capture, see capture.c. The setting is read at launch only.
+static int g_capturing = 0;
+static int g_capture_event = -1; // eventfd, wakes the engine thread
+static pthread_t g_capture_thread;
+static int g_captured_buttons = 0; // pressed while blocked, on the event loop thread
+static int g_reinjected_buttons = 0; // pressed again, on the engine thread
+
+/* @return error, on unknown names in evdev_keys */
+static int build_evdev_keys() {
+    for (size_t i = 0; i < sizeof(evdev_keys) / sizeof(evdev_keys[0]); i++) {
+        KEY_DEF * key = find_key_def_by_name(evdev_keys[i].name);
+        if (key == NULL) {
+            printf("Unknown key name '%s' for Linux key code %d\n", evdev_keys[i].name, evdev_keys[i].code);
+            return 1;
+        }
+        int code = evdev_keys[i].code;
+        g_key_by_evdev_code[code] = key;
+        if (!g_evdev_code_by_virt[key->virt_code & 0xFF]) {
+            g_evdev_code_by_virt[key->virt_code & 0xFF] = code;
+        }
+        int index = scan_code_index(key->scan_code);
+        if (key->scan_code && index >= 0 && !g_evdev_code_by_scan[index]) {
+            g_evdev_code_by_scan[index] = code;
+        }
+    }
+    return 0;
+}
+
+// Output
+// ----------------
+
+static void write_events() {
+    if (g_output_count == 0) return;
+    size_t size = g_output_count * sizeof(struct input_event);
+    uint64_t start = platform_time_us();
+    if (write(g_output_fd, g_output_events, size) != (ssize_t)size) {
+        debug_file("Error: cannot write to the output device");
+    }
+    trace_send(start, g_output_count);
+    g_output_count = 0;
+}
+
+static void emit(int type, int code, int value) {
+    if (g_output_count == sizeof(g_output_events) / sizeof(g_output_events[0])) {
+        write_events();
+    }
+    struct input_event * event = &g_output_events[g_output_count++];
+    memset(event, 0, sizeof(struct input_event));
+    event->type = type;
+    event->code = code;
+    event->value = value;
+}
+
+static void emit_key(int code, int down) {
+    // Key downs of a key already down are repeats, like the repeated key downs on Windows.
+    int value = down ? (g_output_key_down[code] ? 2 : 1) : 0;
+    g_output_key_down[code] = down;
+    emit(EV_KEY, code, value);
+}
+
+// Wheel deltas are in WHEEL_DELTA units per notch, like the high resolution wheel.
+static void emit_wheel(int notch_code, int hi_res_code, int delta, int * rest) {
+#ifdef REL_WHEEL_HI_RES
+    emit(EV_REL, hi_res_code, delta);
+#endif
+    *rest += delta;
+    int notches = *rest / WHEEL_DELTA;
+    *rest -= notches * WHEEL_DELTA;
+    if (notches) emit(EV_REL, notch_code, notches);
+}
+
+// Absolute moves (grid warps) go to the pointer device, normalized to
+// [0, 65535] over the desktop like on Windows, see platform_screen_rect.
+static void emit_absolute(int x, int y) {
+    if (g_pointer_fd < 0) return;
+    // After the events queued before it, with --output they share the file.
+    write_events();
+    struct input_event events[3];
+    memset(events, 0, sizeof(events));
+    events[0].type = EV_ABS;
+    events[0].code = ABS_X;
+    events[0].value = x;
+    events[1].type = EV_ABS;
+    events[1].code = ABS_Y;
+    events[1].value = y;
+    events[2].type = EV_SYN;
+    events[2].code = SYN_REPORT;
+    if (write(g_pointer_fd, events, sizeof(events)) != sizeof(events)) {
+        debug_file("Error: cannot write to the pointer device");
+    }
+}
+
+static void emit_input(INPUT * input) {
+    if (input->type == INPUT_KEYBOARD) {
+        int extended = input->ki.dwFlags & KEYEVENTF_EXTENDEDKEY;
+        int code = 0;
+        // Extended scan codes tell keys apart that share a virtual key code, e.g. NUMPAD_ENTER and ENTER.
+        if (extended || !input->ki.wVk) {
+            code = g_evdev_code_by_scan[(input->ki.wScan & 0xFF) | (extended ? 0x100 : 0)];
+        }
+        if (!code) code = g_evdev_code_by_virt[input->ki.wVk & 0xFF];
+        if (code) emit_key(code, !(input->ki.dwFlags & KEYEVENTF_KEYUP));
+        return;
+    }
+    DWORD flags = input->mi.dwFlags;
+    if ((flags & MOUSEEVENTF_MOVE) && (flags & MOUSEEVENTF_ABSOLUTE)) {
+        emit_absolute(input->mi.dx, input->mi.dy);
+    } else if (flags & MOUSEEVENTF_MOVE) {
+        if (input->mi.dx) emit(EV_REL, REL_X, input->mi.dx);
+        if (input->mi.dy) emit(EV_REL, REL_Y, input->mi.dy);
+    }
+    int x_button = input->mi.mouseData == XBUTTON2 ? BTN_EXTRA : BTN_SIDE;
+    if (flags & MOUSEEVENTF_LEFTDOWN) emit_key(BTN_LEFT, 1);
+    if (flags & MOUSEEVENTF_LEFTUP) emit_key(BTN_LEFT, 0);
+    if (flags & MOUSEEVENTF_RIGHTDOWN) emit_key(BTN_RIGHT, 1);
+    if (flags & MOUSEEVENTF_RIGHTUP) emit_key(BTN_RIGHT, 0);
+    if (flags & MOUSEEVENTF_MIDDLEDOWN) emit_key(BTN_MIDDLE, 1);
+    if (flags & MOUSEEVENTF_MIDDLEUP) emit_key(BTN_MIDDLE, 0);
+    if (flags & MOUSEEVENTF_XDOWN) emit_key(x_button, 1);
+    if (flags & MOUSEEVENTF_XUP) emit_key(x_button, 0);
+#ifdef REL_WHEEL_HI_RES
+    if (flags & MOUSEEVENTF_WHEEL) emit_wheel(REL_WHEEL, REL_WHEEL_HI_RES, (int)input->mi.mouseData, &g_wheel_rest[0]);
+    if (flags & MOUSEEVENTF_HWHEEL) emit_wheel(REL_HWHEEL, REL_HWHEEL_HI_RES, (int)input->mi.mouseData, &g_wheel_rest[1]);
+#else
+    if (flags & MOUSEEVENTF_WHEEL) emit_wheel(REL_WHEEL, 0, (int)input->mi.mouseData, &g_wheel_rest[0]);
+    if (flags & MOUSEEVENTF_HWHEEL) emit_wheel(REL_HWHEEL, 0, (int)input->mi.mouseData, &g_wheel_rest[1]);
+#endif
+}
+
+// Moves the queued inputs to the output events, on the event loop thread only.
+static void drain_input_buffer() {
+    uint32_t n, tail;
+    while (!input_buffer_empty(&g_input_buffer)) {
+        n = input_buffer_move_cons_head(&g_input_buffer, -2, &tail);
+        for (uint32_t i = 0; i < n; i++) {
+            emit_input(&g_input_buffer.inputs[(tail + i) & INPUT_BUFFER_MASK]);
+        }
+        if (n > 0) input_buffer_update_tail(&g_input_buffer.cons, tail, n);
+    }
+}
+
+static void flush_output() {
+    drain_input_buffer();
+    if (g_output_count == 0) return;
+    emit(EV_SYN, SYN_REPORT, 0);
+    write_events();
+}
+
+// Called from the mouse timer thread too, the event loop does the output.
+void wake_output() {
+    uint64_t one = 1;
+    if (write(g_output_event, &one, sizeof(one)) != sizeof(one)) {
+        debug_file("Error: cannot wake the output");
+    }
+}
+
+// The event loop runs the commands on its output wake ups, or the engine thread with full capture.
+void wake_engine() {
+    if (!g_capturing) {
+        wake_output();
+        return;
+    }
+    uint64_t one = 1;
+    if (write(g_capture_event, &one, sizeof(one)) != sizeof(one)) {
+        debug_file("Error: cannot wake the engine");
+    }
+}
+
+// There are no hooks to renew, grabbed devices stay grabbed.
+void rehook() {
+}
+
+/* @return fd of a uinput pointer with absolute axes, -1 on error */
+static int open_uinput_pointer() {
+    int fd = open("/dev/uinput", O_WRONLY);
+    if (fd < 0) return -1;
+    // A button makes it a pointer, like the tablet of a virtual machine.
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+    ioctl(fd, UI_SET_EVBIT, EV_ABS);
+    int axes[] = {ABS_X, ABS_Y};
+    for (int i = 0; i < 2; i++) {
+        struct uinput_abs_setup axis;
+        memset(&axis, 0, sizeof(axis));
+        axis.code = axes[i];
+        axis.absinfo.maximum = 65535;
+        ioctl(fd, UI_SET_ABSBIT, axes[i]);
+        ioctl(fd, UI_ABS_SETUP, &axis);
+    }
+
+    struct uinput_setup setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "keyboard_remapper pointer");
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* @return error */
+static int open_uinput() {
+    int fd = open("/dev/uinput", O_WRONLY);
+    if (fd < 0) {
+        printf("Cannot open /dev/uinput: %s\n", strerror(errno));
+        return 1;
+    }
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    for (int code = 1; code < KEY_CNT; code++) {
+        ioctl(fd, UI_SET_KEYBIT, code);
+    }
+    ioctl(fd, UI_SET_EVBIT, EV_REL);
+    ioctl(fd, UI_SET_RELBIT, REL_X);
+    ioctl(fd, UI_SET_RELBIT, REL_Y);
+    ioctl(fd, UI_SET_RELBIT, REL_WHEEL);
+    ioctl(fd, UI_SET_RELBIT, REL_HWHEEL);
+#ifdef REL_WHEEL_HI_RES
+    ioctl(fd, UI_SET_RELBIT, REL_WHEEL_HI_RES);
+    ioctl(fd, UI_SET_RELBIT, REL_HWHEEL_HI_RES);
+#endif
+
+    struct uinput_setup setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "keyboard_remapper");
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+        printf("Cannot create the uinput device: %s\n", strerror(errno));
+        close(fd);
+        return 1;
+    }
+    g_output_fd = fd;
+    g_output_is_uinput = 1;
+    // Kept apart: absolute axes would make the keyboard a tablet.
+    g_pointer_fd = open_uinput_pointer();
+    if (g_pointer_fd < 0) {
+        printf("Cannot create the uinput pointer device, no grid warps: %s\n", strerror(errno));
+    }
+    return 0;
+}
+
+// Input
+// ----------------
+
+static int is_keyboard(int fd) {
+    uint8_t keys[KEY_CNT / 8 + 1];
+    memset(keys, 0, sizeof(keys));
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0) return 0;
+    return (keys[KEY_A / 8] & (1 << (KEY_A % 8))) && (keys[KEY_SPACE / 8] & (1 << (KEY_SPACE % 8)));
+}
+
+// Grabbing while a key is down (e.g. ENTER starting this program) leaves it
+// down for the other clients, wait for the release first.
+static void wait_keys_released(int fd) {
+    uint8_t keys[KEY_CNT / 8 + 1];
+    struct timespec wait = {0, 10 * 1000000L};
+    for (int waited = 0; waited < GRAB_WAIT_MS; waited += 10) {
+        memset(keys, 0, sizeof(keys));
+        if (ioctl(fd, EVIOCGKEY(sizeof(keys)), keys) < 0) return;
+        int down = 0;
+        for (size_t i = 0; i < sizeof(keys); i++) down |= keys[i];
+        if (!down) return;
+        nanosleep(&wait, NULL);
+    }
+}
+
+/* @return fd of the device, -1 on error */
+static int open_device(const char * path) {
+    // Blocks until a FIFO has a writer.
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Cannot open '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISCHR(info.st_mode)) {
+        wait_keys_released(fd);
+        if (ioctl(fd, EVIOCGRAB, 1) < 0) {
+            printf("Cannot grab '%s': %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/* @return number of keyboards found in /dev/input */
+static int find_keyboards(char paths[][DEVICE_PATH_SIZE], int size) {
+    int count = 0;
+    DIR * dir = opendir("/dev/input");
+    if (dir == NULL) return 0;
+    struct dirent * entry;
+    while (count < size && (entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "event", 5) != 0) continue;
+        snprintf(paths[count], DEVICE_PATH_SIZE, "/dev/input/%s", entry->d_name);
+        int fd = open(paths[count], O_RDONLY | O_NONBLOCK);
+        if (fd < 0) continue;
+        if (is_keyboard(fd)) count++;
+        close(fd);
+    }
+    closedir(dir);
+    return count;
+}
+
+static void forward_event(struct input_event * event) {
+    drain_input_buffer();
+    if (event->type == EV_KEY) {
+        emit_key(event->code, event->value != 0);
+    } else {
+        emit(event->type, event->code, event->value);
+    }
+}
+
+// Queues a mouse button of a BTN_* code to the output.
+static void queue_button(int code, enum Direction direction) {
+    static const DWORD down_flags[] = {
+        MOUSEEVENTF_LEFTDOWN, MOUSEEVENTF_RIGHTDOWN, MOUSEEVENTF_MIDDLEDOWN, MOUSEEVENTF_XDOWN, MOUSEEVENTF_XDOWN
+    };
+    uint32_t n, tail;
+    n = input_buffer_move_prod_head(&g_input_buffer, &tail);
+    if (n == 0) {
+        debug_file("Error: input buffer is full!");
+        return;
+    }
+    INPUT * input = &g_input_buffer.inputs[tail & INPUT_BUFFER_MASK];
+    memset(input, 0, sizeof(INPUT));
+    input->type = INPUT_MOUSE;
+    // The up flags are the down flags shifted by one.
+    input->mi.dwFlags = down_flags[code - BTN_LEFT] << (direction == UP ? 1 : 0);
+    input->mi.mouseData = code == BTN_EXTRA ? XBUTTON2 : code == BTN_SIDE ? XBUTTON1 : 0;
+    input->mi.dwExtraInfo = (ULONG_PTR)INJECTED_KEY_ID;
+    input_buffer_commit(&g_input_buffer, tail, n);
+}
+
+// Sends a blocked input again from the engine thread, unless the engine blocked it.
+void capture_send(struct CapturedInput * input, int block_input) {
+    if (input->virt_code != MOUSE_DUMMY_VK) {
+        if (block_input != 1) {
+            int extended = input->flags & LLKHF_EXTENDED ? 0xE000 : 0;
+            send_input(input->scan_code | extended, input->virt_code, input->direction, 0, &g_input_buffer);
+        }
+        return;
+    }
+    // A release goes out only after its press did.
+    int bit = 1 << (input->scan_code - BTN_LEFT);
+    if (input->direction == DOWN) {
+        if (block_input == 1) return;
+        g_reinjected_buttons |= bit;
+    } else if (g_reinjected_buttons & bit) {
+        g_reinjected_buttons &= ~bit;
+    } else {
+        return;
+    }
+    queue_button(input->scan_code, input->direction);
+}
+
+// The engine thread of full capture, with the priority of the process.
+static void * capture_thread(void * arg) {
+    uint64_t count;
+    while (read(g_capture_event, &count, sizeof(count)) == sizeof(count) && !g_capture_stop) {
+        capture_run(&g_input_buffer);
+        if (!input_buffer_empty(&g_input_buffer)) wake_output();
+    }
+    return NULL;
+}
+
+/* process_event with full capture: the engine thread handles the keys and
+ * the button presses, the loop only passes the ones that are not blocked.
+ * The events are grabbed, a passed key is sent like a passthrough. */
+static void capture_event(struct input_event * event, KEY_DEF * key, enum Direction direction) {
+    uint64_t start = budget_start();
+    if (key) {
+        int block_input = capture_input(key->scan_code & 0xFF, key->virt_code, direction, 0,
+                                        key->scan_code>>8 == 0xE0 ? LLKHF_EXTENDED : 0, 0, 0);
+        if (!block_input) send_input(key->scan_code, key->virt_code, direction, 0, &g_input_buffer);
+        wake_engine();
+        budget_end(start);
+        return;
+    }
+    int bit = 1 << (event->code - BTN_LEFT);
+    int block_input = 0;
+    if (direction == DOWN) {
+        block_input = capture_input(event->code, MOUSE_DUMMY_VK, DOWN, 0, 0, 0, 0);
+        if (block_input) g_captured_buttons |= bit;
+        wake_engine();
+    } else if (g_captured_buttons & bit) {
+        g_captured_buttons &= ~bit;
+        capture_follow(event->code, 0);
+        wake_engine();
+        block_input = 1;
+    }
+    budget_end(start);
+    if (!block_input) forward_event(event);
+}
+
+static void process_event(struct input_event * event) {
+    if (event->type == EV_SYN) {
+        // The outputs of a report are written as one report.
+        if (event->code == SYN_REPORT) flush_output();
+        return;
+    }
+    if (event->type == EV_MSC) {
+        // Scan codes are known from the key codes.
+        return;
+    }
+    if (event->type != EV_KEY || event->code >= KEY_CNT) {
+        forward_event(event);
+        return;
+    }
+    KEY_DEF * key = g_key_by_evdev_code[event->code];
+    enum Direction direction = event->value ? DOWN : UP;
+    if (g_capturing && (key || (event->code >= BTN_LEFT && event->code <= BTN_EXTRA))) {
+        capture_event(event, key, direction);
+        return;
+    }
+    if (key) {
+        uint64_t start = budget_start();
+        int block_input = handle_input(
+            key->scan_code & 0xFF,
+            key->virt_code,
+            direction,
+            0,
+            key->scan_code>>8 == 0xE0 ? LLKHF_EXTENDED : 0,
+            0,
+            &g_input_buffer
+        );
+        // Grabbed keys do not reach the other clients, passthrough is sent.
+        if (block_input != 1) {
+            send_input(key->scan_code, key->virt_code, direction, 0, &g_input_buffer);
+        }
+        drain_input_buffer();
+        budget_end(start);
+        return;
+    }
+    if (event->code >= BTN_LEFT && event->code <= BTN_EXTRA && direction == DOWN) {
+        // Since no key corresponds to the mouse inputs; use a dummy input
+        uint64_t start = budget_start();
+        int block_input = handle_input(event->code, MOUSE_DUMMY_VK, DOWN, 0, 0, 0, &g_input_buffer);
+        budget_end(start);
+        if (block_input == 1) {
+            drain_input_buffer();
+            return;
+        }
+    }
+    forward_event(event);
+}
+
+// Config reload
+// ----------------
+
+static uint64_t get_config_write_time(wchar_t * config_path) {
+    uint32_t size;
+    uint64_t time;
+    return platform_file_info(config_path, &size, &time) ? 0 : time;
+}
+
+// Watches the directory of the config, editors often replace the file, and
+// parses it again when it is saved. Like on Windows the new config is handed
+// to the engine with publish_config, it is swapped in between inputs.
+static void * config_reload_thread(void * arg) {
+    wchar_t * config_path = arg;
+    char path[PLATFORM_PATH_SIZE];
+    wcstombs(path, config_path, sizeof(path));
+    path[sizeof(path) - 1] = '\0';
+    char * slash = strrchr(path, '/');
+    const char * name = slash ? slash + 1 : path;
+    const char * dir = ".";
+    if (slash == path) {
+        dir = "/";
+    } else if (slash) {
+        *slash = '\0';
+        dir = path;
+    }
+
+    int watch = inotify_init1(IN_CLOEXEC);
+    if (watch < 0 || inotify_add_watch(watch, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        debug_file("Error: cannot watch the config for changes");
+        if (watch >= 0) close(watch);
+        return NULL;
+    }
+    uint64_t write_time = get_config_write_time(config_path);
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t size = read(watch, events, sizeof(events));
+        if (size < 0 && errno == EINTR) continue;
+        if (size <= 0) break;
+        int changed = 0;
+        for (char * next = events; next < events + size; ) {
+            struct inotify_event * event = (struct inotify_event *)next;
+            if (event->len && strcmp(event->name, name) == 0) changed = 1;
+            next += sizeof(struct inotify_event) + event->len;
+        }
+        if (!changed) continue;
+        // Editors may write the file in several steps, let them finish.
+        platform_sleep_ms(CONFIG_RELOAD_DELAY_MS);
+        uint64_t time = get_config_write_time(config_path);
+        if (time == 0 || time == write_time) {
+            continue;
+        }
+        write_time = time;
+
+        struct Config * config = read_config(config_path);
+        if (config == NULL) {
+            // Keep running with the current config.
+            debug_file("Error: config reload failed, the config has errors");
+            continue;
+        }
+        config->debug = config->debug || getenv("DEBUG") != NULL;
+        publish_config(config);
+    }
+    close(watch);
+    return NULL;
+}
+
+// Introspection
+// ----------------
+
+// In $XDG_RUNTIME_DIR, private to the user, else in /tmp by user id.
+static void put_ipc_address(struct sockaddr_un * address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    const char * dir = getenv("XDG_RUNTIME_DIR");
+    if (dir && *dir) {
+        snprintf(address->sun_path, sizeof(address->sun_path), "%s/" IPC_SOCKET_NAME, dir);
+    } else {
+        snprintf(address->sun_path, sizeof(address->sun_path), "/tmp/" IPC_SOCKET_NAME ".%u", (unsigned)getuid());
+    }
+}
+
+// Serves the clients one at a time, one reply per line.
+static void * ipc_thread(void * arg) {
+    int server = (int)(intptr_t)arg;
+    char request[IPC_REQUEST_SIZE];
+    char reply[IPC_REPLY_SIZE];
+    while (1) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            return NULL;
+        }
+        FILE * in = fdopen(client, "r");
+        while (in && fgets(request, sizeof(request), in)) {
+            int length = ipc_request(request, reply, sizeof(reply));
+            if (write(client, reply, length) != length) break;
+        }
+        if (in) {
+            fclose(in);
+        } else {
+            close(client);
+        }
+    }
+}
+
+/* Listens on the introspection socket, from another thread.
+ * @return error */
+static int ipc_start() {
+    put_ipc_address(&g_ipc_address);
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(g_ipc_address.sun_path);
+    if (server < 0 || bind(server, (struct sockaddr *)&g_ipc_address, sizeof(g_ipc_address)) != 0 ||
+        chmod(g_ipc_address.sun_path, 0600) != 0 || listen(server, 4) != 0) {
+        printf("Cannot listen on '%s': %s\n", g_ipc_address.sun_path, strerror(errno));
+        if (server >= 0) close(server);
+        return 1;
+    }
+    g_ipc_enabled = 1;
+    ipc_publish();
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, ipc_thread, (void *)(intptr_t)server) != 0) {
+        printf("Cannot start the introspection thread.\n");
+        g_ipc_enabled = 0;
+        close(server);
+        return 1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// `--ipc command...`: sends the command to the running instance, prints the reply.
+static int ipc_client(int argc, char ** argv) {
+    char request[IPC_REQUEST_SIZE] = "";
+    for (int i = 0; i < argc; i++) {
+        snprintf(request + strlen(request), sizeof(request) - strlen(request), "%s%s", argv[i],
+                 i + 1 < argc ? " " : "\n");
+    }
+    struct sockaddr_un address;
+    put_ipc_address(&address);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        printf("keyboard_remapper is not running (%s).\n", address.sun_path);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    int exit_code = write(fd, request, strlen(request)) != (ssize_t)strlen(request);
+    shutdown(fd, SHUT_WR);
+    char reply[IPC_REPLY_SIZE];
+    ssize_t size;
+    while ((size = read(fd, reply, sizeof(reply))) > 0) {
+        fwrite(reply, 1, size, stdout);
+        if (size >= 6 && strncmp(reply, "error:", 6) == 0) exit_code = 1;
+    }
+    close(fd);
+    return exit_code;
+}
+
+// Signals read by event_loop, blocked for all threads.
+static void get_loop_signals(sigset_t * signals) {
+    sigemptyset(signals);
+    sigaddset(signals, SIGINT);
+    sigaddset(signals, SIGTERM);
+    sigaddset(signals, SIGUSR1);
+}
+
+// Reads the devices and the wake ups until all devices are gone or a signal.
+static void event_loop(int * devices, int device_count) {
+    int epoll = epoll_create1(0);
+    struct epoll_event event;
+    for (int i = 0; i < device_count; i++) {
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, devices[i], &event);
+    }
+    event.events = EPOLLIN;
+    event.data.u32 = MAX_DEVICES;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, g_output_event, &event);
+
+    sigset_t signals;
+    get_loop_signals(&signals);
+    int signal_fd = signalfd(-1, &signals, 0);
+    event.events = EPOLLIN;
+    event.data.u32 = MAX_DEVICES + 1;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, signal_fd, &event);
+
+    struct epoll_event ready[MAX_DEVICES + 2];
+    struct input_event events[EVENT_BATCH];
+    int open_count = device_count;
+    while (open_count > 0) {
+        int n = epoll_wait(epoll, ready, MAX_DEVICES + 2, -1);
+        if (n < 0 && errno != EINTR) break;
+        for (int i = 0; i < n; i++) {
+            uint32_t id = ready[i].data.u32;
+            if (id == MAX_DEVICES + 1) {
+                struct signalfd_siginfo info;
+                if (read(signal_fd, &info, sizeof(info)) == sizeof(info) && info.ssi_signo == SIGUSR1) {
+                    recorder_request_dump("on demand");
+                    // Taken by the thread handling the inputs, which owns the remaps.
+                    if (g_capturing) {
+                        g_remap_stats_requested = 1;
+                    } else {
+                        write_remap_stats();
+                    }
+                    continue;
+                }
+                open_count = 0;
+                break;
+            }
+            if (id == MAX_DEVICES) {
+                uint64_t count;
+                if (read(g_output_event, &count, sizeof(count)) < 0) continue;
+                if (!g_capturing) ipc_run_commands(&g_input_buffer);
+                flush_output();
+                continue;
+            }
+            ssize_t size = read(devices[id], events, sizeof(events));
+            if (size < 0 && errno == EAGAIN) continue;
+            if (size <= 0) {
+                // Unplugged device or closed FIFO.
+                epoll_ctl(epoll, EPOLL_CTL_DEL, devices[id], NULL);
+                close(devices[id]);
+                devices[id] = -1;
+                open_count--;
+                continue;
+            }
+            for (size_t j = 0; j < size / sizeof(struct input_event); j++) {
+                process_event(&events[j]);
+            }
+            flush_output();
+        }
+    }
+    close(signal_fd);
+    close(epoll);
+}
+
+static void crash_handler(int signal) {
+    recorder_crash_dump("crash");
+    raise(signal);
+}
+
+static void put_config_path(wchar_t * path) {
+    char exe[PLATFORM_PATH_SIZE];
+    ssize_t length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    exe[length > 0 ? length : 0] = '\0';
+    char * slash = strrchr(exe, '/');
+    snprintf(slash ? slash + 1 : exe, sizeof(exe) - (slash ? slash + 1 - exe : 0), "config.txt");
+    mbstowcs(path, exe, MAX_PATH);
+}
+
+// Test device
+// ----------------
+
+/* Writes the key events of a trace of keyboard_remapper_headless --replay
+ * to stdout at the times of the trace, e.g. to the FIFO of a test device.
+ * @return exit code */
+static int write_trace_events(const char * trace_path) {
+    FILE * file = fopen(trace_path, "r");
+    if (file == NULL) {
+        printf("Cannot open trace file '%s'.\n", trace_path);
+        return 1;
+    }
+    char * line = NULL;
+    size_t capacity = 0;
+    int linenum = 0;
+    int exit_code = 0;
+    uint64_t start = platform_time_us();
+    while (read_line(file, &line, &capacity) >= 0) {
+        linenum++;
+        char time_text[32], direction[8];
+        int scan_code, virt_code;
+        uint64_t time;
+        char * text = line + strspn(line, " \t\r\n");
+        if (*text == '\0' || *text == '#') continue;
+        if (sscanf(text, "%31s %i %i %7s", time_text, &scan_code, &virt_code, direction) != 4
+            || parse_time_ms(time_text, &time)
+            || (strcmp(direction, "DOWN") != 0 && strcmp(direction, "UP") != 0)) {
+            printf("Trace error (line %d): expected 'time_ms scan_code virt_code DOWN|UP'\n", linenum);
+            exit_code = 1;
+            break;
+        }
+        int index = scan_code_index(scan_code);
+        int code = index >= 0 ? g_evdev_code_by_scan[index] : 0;
+        if (!code) code = g_evdev_code_by_virt[virt_code & 0xFF];
+        if (!code) continue;
+        uint64_t now = platform_time_us();
+        if (start + time > now) usleep(start + time - now);
+        struct input_event events[2];
+        memset(events, 0, sizeof(events));
+        events[0].time.tv_sec = time / 1000000;
+        events[0].time.tv_usec = time % 1000000;
+        events[0].type = EV_KEY;
+        events[0].code = code;
+        events[0].value = strcmp(direction, "DOWN") == 0;
+        events[1].time = events[0].time;
+        events[1].type = EV_SYN;
+        events[1].code = SYN_REPORT;
+        if (write(STDOUT_FILENO, events, sizeof(events)) != sizeof(events)) {
+            exit_code = 1;
+            break;
+        }
+    }
+    free(line);
+    fclose(file);
+    return exit_code;
+}
+
+/* Prints the key events of an --output file, one per line, by KEY_DEF name.
+ * @return exit code */
+static int print_output_events(const char * path) {
+    static const char * values[] = {"UP", "DOWN", "REPEAT"};
+    FILE * file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Cannot open '%s'.\n", path);
+        return 1;
+    }
+    struct input_event event;
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        if (event.type == EV_SYN) continue;
+        KEY_DEF * key = event.type == EV_KEY && event.code < KEY_CNT ? g_key_by_evdev_code[event.code] : NULL;
+        if (key && event.value >= 0 && event.value <= 2) {
+            printf("%s %s\n", key->name, values[event.value]);
+        } else if (event.type == EV_ABS && (event.code == ABS_X || event.code == ABS_Y)) {
+            printf("%s %d\n", event.code == ABS_X ? "ABS_X" : "ABS_Y", event.value);
+        } else {
+            printf("type=%d code=%d value=%d\n", event.type, event.code, event.value);
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+static void print_usage(const char * name) {
+    printf("Usage: %s [--config config.txt] [--output path] [--trace trace.json] [--slow-path ms] [device...]\n", name);
+    printf("       %s --check [config.txt]\n", name);
+    printf("       %s --decode flight_recorder.bin\n", name);
+    printf("       %s --ipc layers|remaps|mouse|stats|set <layer>|reset <layer>|unlock\n", name);
+    printf("       %s --write-events trace.txt > device.fifo\n", name);
+    printf("       %s --print-events output.bin\n\n", name);
+    printf("Grabs the given /dev/input/event* devices, all keyboards by default.\n");
+    printf("SIGUSR1 dumps the flight recorder to flight_recorder.bin.\n");
+    printf("A FIFO can stand in for a device, --output writes the events to a file instead of uinput.\n");
+    printf("--trace writes a timeline of the inputs for chrome://tracing or Perfetto.\n");
+    printf("--write-events plays a trace of keyboard_remapper_headless on a FIFO device, --print-events\n");
+    printf("prints the key and absolute move events of an --output file.\n");
+    printf("--ipc asks the running instance, over the socket in $XDG_RUNTIME_DIR.\n");
+    printf("--slow-path makes each input that long to handle, to try the hook time budget.\n");
+}
+
+int main(int argc, char ** argv) {
+    static wchar_t config_path[MAX_PATH];
+    char paths[MAX_DEVICES][DEVICE_PATH_SIZE];
+    char * device_paths[MAX_DEVICES];
+    int devices[MAX_DEVICES];
+    int device_count = 0;
+    int exit_code = 1;
+    const char * output_path = NULL;
+    const char * trace_path = NULL;
+
+    build_key_index();
+
+    if (argc > 1 && strcmp(argv[1], "--check") == 0) {
+        if (argc > 2) {
+            mbstowcs(config_path, argv[2], MAX_PATH);
+        } else {
+            put_config_path(config_path);
+        }
+        return check_config(config_path);
+    }
+    if (argc > 2 && strcmp(argv[1], "--decode") == 0) {
+        return decode_recording(argv[2], stdout);
+    }
+    if (argc > 2 && strcmp(argv[1], "--ipc") == 0) {
+        return ipc_client(argc - 2, argv + 2);
+    }
+    if (argc > 2 && strcmp(argv[1], "--write-events") == 0) {
+        return build_evdev_keys() || write_trace_events(argv[2]);
+    }
+    if (argc > 2 && strcmp(argv[1], "--print-events") == 0) {
+        return build_evdev_keys() || print_output_events(argv[2]);
+    }
+
+    put_config_path(config_path);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            mbstowcs(config_path, argv[++i], MAX_PATH);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--slow-path") == 0 && i + 1 < argc) {
+            if (parse_time_ms(argv[++i], &g_slow_path_us)) {
+                print_usage(argv[0]);
+                return 2;
+            }
+        } else if (argv[i][0] == '-' || device_count == MAX_DEVICES) {
+            print_usage(argv[0]);
+            return 2;
+        } else {
+            device_paths[device_count++] = argv[i];
+        }
+    }
+
+    debug_print(GREEN, "== keyboard_remapper %s ==\n\n", VERSION);
+    if (build_evdev_keys()) {
+        return 1;
+    }
+    struct Config * config = read_config(config_path);
+    if (config == NULL) {
+        return 1;
+    }
+    config->debug = config->debug || getenv("DEBUG") != NULL;
+    activate_config(config);
+
+    struct sigaction crash;
+    memset(&crash, 0, sizeof(crash));
+    crash.sa_handler = crash_handler;
+    crash.sa_flags = SA_RESETHAND;
+    sigaction(SIGSEGV, &crash, NULL);
+    sigaction(SIGBUS, &crash, NULL);
+    sigaction(SIGFPE, &crash, NULL);
+    sigaction(SIGABRT, &crash, NULL);
+
+    if (g_priority && setpriority(PRIO_PROCESS, 0, -10) != 0) {
+        // Unlike on Windows not fatal, grabbing needs no privileges to raise the priority.
+        printf("Cannot raise the process priority: %s\n", strerror(errno));
+    }
+
+    if (device_count == 0) {
+        device_count = find_keyboards(paths, MAX_DEVICES);
+        for (int i = 0; i < device_count; i++) {
+            device_paths[i] = paths[i];
+        }
+        if (device_count == 0) {
+            printf("No keyboard found in /dev/input, is this user in the 'input' group?\n");
+            goto end;
+        }
+    }
+    // The uinput device is created after the search, so it is never grabbed.
+    if (output_path) {
+        g_output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (g_output_fd < 0) {
+            printf("Cannot open '%s': %s\n", output_path, strerror(errno));
+            goto end;
+        }
+        g_pointer_fd = g_output_fd;
+    } else if (open_uinput()) {
+        goto end;
+    }
+    g_output_event = eventfd(0, EFD_NONBLOCK);
+    input_buffer_init(&g_input_buffer);
+    // Before any thread is started, they inherit the mask.
+    sigset_t signals;
+    get_loop_signals(&signals);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    if (log_start()) {
+        printf("Cannot start the log thread.\n");
+        goto end;
+    }
+    if (trace_path && trace_start(trace_path)) {
+        goto end;
+    }
+    g_capturing = g_full_capture;
+    if (g_capturing) {
+        g_capture_event = eventfd(0, 0);
+        if (g_capture_event < 0 || pthread_create(&g_capture_thread, NULL, capture_thread, NULL) != 0) {
+            printf("Cannot start the engine thread.\n");
+            g_capturing = 0;
+            goto end;
+        }
+    }
+    pthread_t reload_thread;
+    if (pthread_create(&reload_thread, NULL, config_reload_thread, config_path) != 0) {
+        printf("Cannot start the config reload thread.\n");
+        goto end;
+    }
+    pthread_detach(reload_thread);
+    // Not needed to remap, only reported.
+    ipc_start();
+
+    int opened = 0;
+    for (int i = 0; i < device_count; i++) {
+        devices[opened] = open_device(device_paths[i]);
+        if (devices[opened] >= 0) {
+            printf("Grabbed %s\n", device_paths[i]);
+            opened++;
+        }
+    }
+    if (opened > 0) {
+        event_loop(devices, opened);
+        exit_code = 0;
+    }
+    for (int i = 0; i < opened; i++) {
+        if (devices[i] >= 0) close(devices[i]);
+    }
+
+end:
+    stop_move_timer();
+    log_stop();
+    trace_stop();
+    if (g_ipc_enabled) unlink(g_ipc_address.sun_path);
+    if (g_capturing) {
+        // Passes what is left in the queue, unlock_all then runs alone.
+        g_capture_stop = 1;
+        wake_engine();
+        pthread_join(g_capture_thread, NULL);
+        capture_run(&g_input_buffer);
+    }
+    if (g_output_fd >= 0) {
+        unlock_all(&g_input_buffer);
+        flush_output();
+        if (g_output_is_uinput) ioctl(g_output_fd, UI_DEV_DESTROY);
+        close(g_output_fd);
+    }
+    if (g_output_is_uinput && g_pointer_fd >= 0) {
+        ioctl(g_pointer_fd, UI_DEV_DESTROY);
+        close(g_pointer_fd);
+    }
+    if (g_output_event >= 0) close(g_output_event);
+    free_config(g_config);
+    free_config(g_config_pending);
+    return exit_code;
+}
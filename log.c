@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "platform.h"
+#include "input.h"
+
+// Debug log
+// --------------------------------------
+//
+// With debug=1 every input is logged from the hook callback, printing from
+// there is slow enough to hit the hook timeout and cause the very rehooks
+// being debugged. The log functions only fill fixed-size records in a ring,
+// a timer thread started by log_start formats them to the console. Like
+// g_input_buffer, the ring takes several producers (the hook thread and the
+// mouse timer thread). Records are dropped and counted when it is full.
+//
+// Until log_start, e.g. in the headless build, records are formatted as soon
+// as they are committed.
+//
+// debug_file messages go through the same ring to LOG_FILE_PATH, kept open
+// and flushed once per batch. It is rotated to debug.log.1 past LOG_FILE_MAX
+// bytes. A message repeating the previous one is counted instead of written,
+// e.g. a full input buffer under load.
+//
+// The timer thread also runs the work handed over with log_defer: writing
+// the flight recorder dump or the remap statistics from the hook thread would
+// block it on the disk.
+
+#define LOG_BUFFER_SIZE 1024 // power of 2
+#define LOG_BUFFER_MASK (LOG_BUFFER_SIZE-1)
+#define LOG_TEXT_SIZE 160
+#define LOG_INTERVAL_MS 20
+#define LOG_FILE_PATH "debug.log"
+#define LOG_FILE_MAX (1 << 20) // bytes
+#define LOG_WORK_SLOTS 4
+
+enum LogType {
+    LOG_INPUT,   // input handled, indented records follow
+    LOG_BLOCKED, // input blocked
+    LOG_SEND,    // key sent by a remap
+    LOG_TEXT,    // debug_print
+    LOG_FILE,    // debug_file
+};
+
+struct LogRecord {
+    uint8_t type;
+    uint8_t indent;
+    uint8_t direction;
+    uint8_t is_output;
+    uint16_t scan_code;
+    uint16_t virt_code;
+    DWORD flags;
+    ULONG_PTR extra;
+    int64_t time; // of LOG_FILE records, seconds since the epoch
+    // Static strings only, they are formatted later.
+    const char * name;
+    const char * key_name;
+    const char * color;
+    char text[LOG_TEXT_SIZE];
+};
+
+struct LogBuffer {
+    struct LogRecord records[LOG_BUFFER_SIZE];
+    volatile union rte_ring_hts_headtail prod;
+    volatile uint32_t cons_tail;
+    volatile LONG64 dropped;
+    volatile LONG64 lock; // of the formatter
+};
+
+static struct LogBuffer g_log_buffer;
+static void * g_log_timer = NULL;
+static int g_log_counter = 1;
+static LONG64 g_log_dropped_reported = 0;
+static FILE * g_log_file = NULL;
+static long g_log_file_size = 0;
+static char g_log_last[LOG_TEXT_SIZE]; // last message written to the file
+static int64_t g_log_last_time = 0;
+static int g_log_repeats = 0; // of g_log_last, not written yet
+
+typedef void (* LogWork)();
+static void * volatile g_log_work[LOG_WORK_SLOTS]; // LogWork, see log_defer
+static volatile LONG g_log_working = 0;
+
+/* Reserves the next record, to be filled and committed with log_commit.
+ * @return record, NULL if the ring is full */
+static struct LogRecord * log_reserve(enum LogType type, uint32_t * old_head) {
+    union rte_ring_hts_headtail new, old;
+    do {
+        do {
+            old = g_log_buffer.prod;
+        } while (old.pos.head != old.pos.tail);
+        if (old.pos.head - g_log_buffer.cons_tail >= LOG_BUFFER_SIZE) {
+            InterlockedIncrement64(&g_log_buffer.dropped);
+            return NULL;
+        }
+        new.pos.tail = old.pos.tail;
+        new.pos.head = old.pos.head + 1;
+    } while (InterlockedCompareExchange64(&g_log_buffer.prod.raw, new.raw, old.raw) != old.raw);
+    *old_head = old.pos.head;
+    struct LogRecord * record = &g_log_buffer.records[old.pos.head & LOG_BUFFER_MASK];
+    record->type = (uint8_t)type;
+    return record;
+}
+
+static void write_log_line(int64_t time, const char * message) {
+    if (!g_log_file) {
+        g_log_file = fopen(LOG_FILE_PATH, "a");
+        if (g_log_file == NULL) return;
+        fseek(g_log_file, 0, SEEK_END);
+        g_log_file_size = ftell(g_log_file);
+    }
+    time_t now = (time_t)time;
+    char * timestamp = ctime(&now);
+    int length = fprintf(g_log_file, "[%.24s] %s\n", timestamp ? timestamp : "?", message);
+    if (length > 0) g_log_file_size += length;
+    if (g_log_file_size > LOG_FILE_MAX) {
+        fclose(g_log_file);
+        g_log_file = NULL;
+        remove(LOG_FILE_PATH ".1");
+        rename(LOG_FILE_PATH, LOG_FILE_PATH ".1");
+    }
+}
+
+static void write_log_repeats() {
+    if (g_log_repeats == 0) return;
+    char message[48];
+    snprintf(message, sizeof(message), "Last message repeated %d times", g_log_repeats);
+    g_log_repeats = 0;
+    write_log_line(g_log_last_time, message);
+}
+
+static void write_log_record(struct LogRecord * record) {
+    if (strcmp(record->text, g_log_last) == 0) {
+        g_log_repeats++;
+        g_log_last_time = record->time;
+        return;
+    }
+    write_log_repeats();
+    write_log_line(record->time, record->text);
+    memcpy(g_log_last, record->text, sizeof(g_log_last));
+    g_log_last_time = record->time;
+}
+
+static void format_log_record(struct LogRecord * record) {
+    if (record->type == LOG_FILE) {
+        write_log_record(record);
+        return;
+    }
+    if (record->type == LOG_TEXT) {
+        printf("%s%s%s", record->color, record->text, RESET);
+        return;
+    }
+    printf("\n%03d. ", g_log_counter++);
+    for (int i = 0; i < record->indent; i++) {
+        printf("\t");
+    }
+    const char * direction = record->direction == DOWN ? "DOWN" : "UP";
+    switch (record->type) {
+    case LOG_INPUT:
+        printf("[%s] %s %s (scan:0x%04X virt:0x%02X flags:0x%02X dwExtraInfo:0x%llX)",
+               record->is_output ? "output" : "input",
+               friendly_virt_code_name(record->virt_code),
+               direction,
+               record->scan_code,
+               record->virt_code,
+               (unsigned)record->flags,
+               (unsigned long long)record->extra);
+        break;
+    case LOG_BLOCKED:
+        printf("#blocked-input# %s %s", friendly_virt_code_name(record->virt_code), direction);
+        break;
+    case LOG_SEND:
+        printf("(sending:%s) %s %s", record->name, record->key_name, direction);
+        break;
+    }
+}
+
+// Formats the committed records, from the timer thread or from log_commit.
+void log_flush() {
+    while (InterlockedCompareExchange64(&g_log_buffer.lock, 1, 0) != 0);
+    uint32_t tail = g_log_buffer.cons_tail;
+    uint32_t end = g_log_buffer.prod.pos.tail;
+    for (; tail != end; tail++) {
+        format_log_record(&g_log_buffer.records[tail & LOG_BUFFER_MASK]);
+    }
+    g_log_buffer.cons_tail = tail;
+    LONG64 dropped = g_log_buffer.dropped;
+    if (dropped != g_log_dropped_reported) {
+        printf("\n%s(%lld log records dropped)%s", RED, (long long)(dropped - g_log_dropped_reported), RESET);
+        g_log_dropped_reported = dropped;
+    }
+    fflush(stdout);
+    if (g_log_file) fflush(g_log_file);
+    InterlockedCompareExchange64(&g_log_buffer.lock, 0, 1);
+}
+
+static void log_commit(uint32_t old_tail) {
+    g_log_buffer.prod.pos.tail = old_tail + 1;
+    if (!g_log_timer) log_flush();
+}
+
+/* Runs work on the log thread, from now on if log_start was not called.
+ * Work already pending is not queued twice.
+ * @return error, no slot left */
+int log_defer(LogWork work) {
+    if (!g_log_timer) {
+        work();
+        return 0;
+    }
+    for (int i = 0; i < LOG_WORK_SLOTS; i++) {
+        if (g_log_work[i] == (void *)work) return 0;
+    }
+    for (int i = 0; i < LOG_WORK_SLOTS; i++) {
+        if (InterlockedCompareExchangePointer(&g_log_work[i], (void *)work, NULL) == NULL) return 0;
+    }
+    return 1;
+}
+
+// One at a time, the timer callbacks may overlap when the disk is slow.
+static void log_run_work() {
+    if (InterlockedCompareExchange(&g_log_working, 1, 0) != 0) return;
+    for (int i = 0; i < LOG_WORK_SLOTS; i++) {
+        LogWork work = (LogWork)InterlockedExchangePointer(&g_log_work[i], NULL);
+        if (work) work();
+    }
+    InterlockedExchange(&g_log_working, 0);
+}
+
+static VOID CALLBACK log_callback(PVOID arg, BOOLEAN timer_fired) {
+    if (g_log_buffer.cons_tail != g_log_buffer.prod.pos.tail) log_flush();
+    log_run_work();
+}
+
+/* Formats the records on a timer thread from now on.
+ * @return error */
+int log_start() {
+    g_log_timer = platform_timer_start(log_callback, NULL, LOG_INTERVAL_MS);
+    return g_log_timer == NULL;
+}
+
+// Runs the pending work, formats what is left and closes debug.log, later
+// records are formatted when committed.
+void log_stop() {
+    if (g_log_timer) platform_timer_stop(g_log_timer);
+    g_log_timer = NULL;
+    log_run_work();
+    log_flush();
+    write_log_repeats();
+    if (g_log_file) fclose(g_log_file);
+    g_log_file = NULL;
+    g_log_last[0] = '\0';
+}
@@ -20,13 +20,10 @@
  * <https://getreuer.info/posts/keyboards/orbital-mouse>
  */
 
-#include <windows.h>
 #include <stdio.h>
 #include <math.h>
 #include "input.h"
 
-#pragma comment(lib, "winmm.lib") // for timeGetTime()
-
 #ifndef ORBITAL_MOUSE_RADIUS
 #define ORBITAL_MOUSE_RADIUS 36
 #endif  // ORBITAL_MOUSE_RADIUS
@@ -39,9 +36,25 @@
 //     |               |               |               |           |
 // t = 0.000           1.024           2.048           3.072       3.840 s
 #endif  // ORBITAL_MOUSE_SPEED_CURVE
+#ifndef ORBITAL_MOUSE_WHEEL_SPEED_CURVE
+// Wheel speed in 1/16 of a notch (WHEEL_DELTA) per interval.
+#define ORBITAL_MOUSE_WHEEL_SPEED_CURVE \
+      {2, 2, 3, 4, 6, 8, 10, 12, 14, 16, 16, 16, 16, 16, 16, 16}
+//     |               |               |               |           |
+// t = 0.000           1.024           2.048           3.072       3.840 s
+#endif  // ORBITAL_MOUSE_WHEEL_SPEED_CURVE
+#ifndef ORBITAL_MOUSE_WHEEL_HIRES
+// When set, wheel deltas smaller than WHEEL_DELTA are sent as they
+// accumulate, otherwise only whole notches are sent.
+#define ORBITAL_MOUSE_WHEEL_HIRES 1
+#endif  // ORBITAL_MOUSE_WHEEL_HIRES
 #ifndef ORBITAL_MOUSE_INTERVAL_MS
 #define ORBITAL_MOUSE_INTERVAL_MS 16
 #endif  // ORBITAL_MOUSE_INTERVAL_MS
+#define ORBITAL_MOUSE_INTERVAL_US (ORBITAL_MOUSE_INTERVAL_MS * 1000)
+#ifndef ORBITAL_MOUSE_MAX_CATCH_UP
+#define ORBITAL_MOUSE_MAX_CATCH_UP 4
+#endif  // ORBITAL_MOUSE_MAX_CATCH_UP
 
 #if !(0 <= ORBITAL_MOUSE_RADIUS && ORBITAL_MOUSE_RADIUS <= 63)
 #error "Invalid ORBITAL_MOUSE_RADIUS. Value must be in [0, 63]."
@@ -59,12 +72,24 @@ typedef struct {
   int h;
 } report_mouse_t;
 
+/** Rectangle of the screen in pixels. */
+typedef struct {
+  int left;
+  int top;
+  int width;
+  int height;
+} grid_rect_t;
+
 static const int init_speed_curve[NUM_SPEED_CURVE_INTERVALS] =
   ORBITAL_MOUSE_SPEED_CURVE;
+static const int init_wheel_speed_curve[NUM_SPEED_CURVE_INTERVALS] =
+  ORBITAL_MOUSE_WHEEL_SPEED_CURVE;
 static struct MouseState {
   report_mouse_t report;
   // Current speed curve, should point to a table of 16 values.
   const int * speed_curve;
+  // Current wheel speed curve, should point to a table of 16 values.
+  const int * wheel_speed_curve;
   // Fractional displacement of the cursor as Q7.8 values.
   double x;
   double y;
@@ -73,10 +98,19 @@ static struct MouseState {
   double wheel_y;
   // Current cursor movement speed as a Q9.6 value.
   double speed;
+  // Current wheel speed in 1/256 of a notch per interval.
+  double wheel_speed;
+  // Wheel deltas of the last interval, kept for momentum after release.
+  double wheel_vx;
+  double wheel_vy;
   // Bitfield tracking which movement keys are currently held.
   int held_keys;
   // Cursor movement time, counted in number of intervals.
   int move_t;
+  // Wheel movement time, counted in number of intervals.
+  int wheel_t;
+  // Engine clock time of the last interval sent, in us.
+  uint64_t move_time;
   // Cursor movement direction, 1 => up, -1 => down.
   int move_v;
   // Cursor movement direction, 1 => left, -1 => right.
@@ -95,23 +129,47 @@ static struct MouseState {
   int last_buttons;
   // Selected mouse button as a base-0 index.
   int selected_button;
+  // Current grid of the grid warp.
+  grid_rect_t grid;
+  // Whether the grid has been narrowed since the last reset.
+  int grid_active;
+  // Grid key currently held, to ignore its auto-repeat.
+  int grid_key;
 } state = {.move_v = 0,
            .move_h = 0,
            .move_dir = 0,
            .last_buttons = 0,
            .selected_button = 0,
-           .speed_curve = init_speed_curve};
+           .speed_curve = init_speed_curve,
+           .wheel_speed_curve = init_wheel_speed_curve};
+
+// Display geometry of the grid warp, tests install a stub, see replay.c.
+static const struct ScreenSource init_screen_source = {platform_screen_rect};
+static const struct ScreenSource * screen_source = &init_screen_source;
 
-extern HANDLE ghEvent;
-extern HANDLE ghTimerQueue;
 extern struct InputBuffer g_input_buffer;
-HANDLE ghTimer = NULL;
-int g_active = 0;
+// Shared with the timer thread, which may stop itself, see move_callback.
+void * volatile g_move_timer = NULL;
+volatile LONG g_active = 0;
 
 void set_orbital_mouse_speed_curve(const int * speed_curve) {
   state.speed_curve = (speed_curve != NULL) ? speed_curve : init_speed_curve;
 }
 
+void set_orbital_mouse_wheel_speed_curve(const int * wheel_speed_curve) {
+  state.wheel_speed_curve = (wheel_speed_curve != NULL) ? wheel_speed_curve : init_wheel_speed_curve;
+}
+
+void set_orbital_mouse_screen_source(const struct ScreenSource * source) {
+  screen_source = (source != NULL) ? source : &init_screen_source;
+}
+
+/** Whether the wheel keeps scrolling by momentum after release. */
+static int wheel_coasting(struct MouseState * state) {
+  return g_wheel_momentum > 0 &&
+      (fabs(state->wheel_vx) >= 1 || fabs(state->wheel_vy) >= 1);
+}
+
 void buttons_send(struct MouseState * state, int remap_id, struct InputBuffer * input_buffer) {
     uint32_t n, tail;
     int index;
@@ -170,7 +228,7 @@ void buttons_send(struct MouseState * state, int remap_id, struct InputBuffer *
     if ((state->buttons ^ state->last_buttons) & (1 << 4)) {
         // If mouseData is used by button 4, send input and clear mi
         if ((state->buttons ^ state->last_buttons) & (1 << 3)) {
-            input_buffer_update_tail(&input_buffer->prod, tail, n);
+            input_buffer_commit(input_buffer, tail, n);
             n = input_buffer_move_prod_head(input_buffer, &tail);
             index = tail & INPUT_BUFFER_MASK;
             if (n == 0) {
@@ -190,7 +248,7 @@ void buttons_send(struct MouseState * state, int remap_id, struct InputBuffer *
             input_buffer->inputs[index].mi.mouseData |= XBUTTON2;
         }
     }
-    input_buffer_update_tail(&input_buffer->prod, tail, n);
+    input_buffer_commit(input_buffer, tail, n);
 }
 
 void set_orbital_mouse_angle(double angle) {
@@ -248,8 +306,40 @@ void move_send(struct MouseState * state, int remap_id, struct InputBuffer * inp
 
     // Update mouse wheel if active.
     if (state->wheel_x_dir || state->wheel_y_dir) {
-      state->wheel_x -= state->wheel_x_dir * ORBITAL_MOUSE_WHEEL_SPEED * WHEEL_DELTA;
-      state->wheel_y += state->wheel_y_dir * ORBITAL_MOUSE_WHEEL_SPEED * WHEEL_DELTA;
+      if (state->wheel_t == 0) {
+        // First interval scrolls a whole notch, so a tap behaves like a wheel click.
+        state->wheel_speed = state->wheel_speed_curve[0] * 16;
+        state->wheel_vx = -state->wheel_x_dir * ORBITAL_MOUSE_WHEEL_SPEED * WHEEL_DELTA;
+        state->wheel_vy = state->wheel_y_dir * ORBITAL_MOUSE_WHEEL_SPEED * WHEEL_DELTA;
+        ++state->wheel_t;
+      } else {
+        // Update wheel speed, interpolated from wheel_speed_curve.
+        if (state->wheel_t <= 16 * (NUM_SPEED_CURVE_INTERVALS - 1)) {
+          const int i = (state->wheel_t - 1) / 16;
+          state->wheel_speed += state->wheel_speed_curve[i + 1]
+              - state->wheel_speed_curve[i];
+          ++state->wheel_t;
+        }
+        state->wheel_vx = -state->wheel_x_dir * ORBITAL_MOUSE_WHEEL_SPEED * state->wheel_speed * WHEEL_DELTA / 256;
+        state->wheel_vy = state->wheel_y_dir * ORBITAL_MOUSE_WHEEL_SPEED * state->wheel_speed * WHEEL_DELTA / 256;
+      }
+      state->wheel_x += state->wheel_vx;
+      state->wheel_y += state->wheel_vy;
+      if (state->wheel_t == 1) {
+        // No momentum after a single notch.
+        state->wheel_vx = 0;
+        state->wheel_vy = 0;
+      }
+    } else if (wheel_coasting(state)) {
+      // Decay the wheel speed of the last interval with time constant g_wheel_momentum.
+      const double decay = exp(-(double)ORBITAL_MOUSE_INTERVAL_MS / g_wheel_momentum);
+      state->wheel_vx *= decay;
+      state->wheel_vy *= decay;
+      state->wheel_x += state->wheel_vx;
+      state->wheel_y += state->wheel_vy;
+    } else {
+      state->wheel_vx = 0;
+      state->wheel_vy = 0;
     }
 
     // Set whole part of movement deltas in report and retain fractional parts.
@@ -258,9 +348,14 @@ void move_send(struct MouseState * state, int remap_id, struct InputBuffer * inp
     state->x -= (double)state->report.x;
     state->y -= (double)state->report.y;
 
-    // Set whole part of movement deltas in report and retain fractional parts.
+    // Set whole part of wheel deltas in report and retain fractional parts.
+#if ORBITAL_MOUSE_WHEEL_HIRES
     state->report.h = (int)state->wheel_x;
     state->report.v = (int)state->wheel_y;
+#else
+    state->report.h = (int)(state->wheel_x / WHEEL_DELTA) * WHEEL_DELTA;
+    state->report.v = (int)(state->wheel_y / WHEEL_DELTA) * WHEEL_DELTA;
+#endif
     state->wheel_x -= (double)state->report.h;
     state->wheel_y -= (double)state->report.v;
 
@@ -281,7 +376,7 @@ void move_send(struct MouseState * state, int remap_id, struct InputBuffer * inp
     if (state->report.h != 0) {
         // If mouseData is used by wheel, send input and clear mi
         if (state->report.v != 0) {
-            input_buffer_update_tail(&input_buffer->prod, tail, n);
+            input_buffer_commit(input_buffer, tail, n);
             n = input_buffer_move_prod_head(input_buffer, &tail);
             index = tail & INPUT_BUFFER_MASK;
             if (n == 0) {
@@ -296,15 +391,114 @@ void move_send(struct MouseState * state, int remap_id, struct InputBuffer * inp
         input_buffer->inputs[index].mi.mouseData = state->report.h;
         input_buffer->inputs[index].mi.dwFlags |= MOUSEEVENTF_HWHEEL;
     }
-    input_buffer_update_tail(&input_buffer->prod, tail, n);
+    input_buffer_commit(input_buffer, tail, n);
+}
+
+/** Moves the cursor to the center of the current grid with an absolute move. */
+void warp_send(struct MouseState * state, int remap_id, struct InputBuffer * input_buffer) {
+    uint32_t n, tail;
+    int index;
+    grid_rect_t screen;
+    screen_source->get_screen_rect(&screen.left, &screen.top, &screen.width, &screen.height);
+    if (screen.width < 2 || screen.height < 2) return;
+
+    n = input_buffer_move_prod_head(input_buffer, &tail);
+    index = tail & INPUT_BUFFER_MASK;
+    if (n == 0) {
+        if (g_debug) debug_print(RED, "\nError: input buffer is full!");
+        debug_file("Error: input buffer is full!");
+        return;
+    }
+    ZeroMemory(&input_buffer->inputs[index], sizeof(INPUT));
+    input_buffer->inputs[index].type = INPUT_MOUSE;
+    input_buffer->inputs[index].mi.dwExtraInfo = (ULONG_PTR)INJECTED_KEY_ID | remap_id;
+
+    // Absolute coordinates are normalized to [0, 65535] over the virtual screen.
+    int x = state->grid.left + state->grid.width / 2 - screen.left;
+    int y = state->grid.top + state->grid.height / 2 - screen.top;
+    input_buffer->inputs[index].mi.dx = (LONG)(((int64_t)x * 65535) / (screen.width - 1));
+    input_buffer->inputs[index].mi.dy = (LONG)(((int64_t)y * 65535) / (screen.height - 1));
+    input_buffer->inputs[index].mi.dwFlags = MOUSEEVENTF_MOVE | MOUSEEVENTF_ABSOLUTE | MOUSEEVENTF_VIRTUALDESK;
+    input_buffer_commit(input_buffer, tail, n);
+}
+
+/**
+ * Narrows the grid to one of its cells and warps the cursor to its center.
+ * Cells 0-8 split the grid in 3x3 (row-major from top left), while MS_G_U,
+ * MS_G_D, MS_G_L and MS_G_R keep one half of it.
+ */
+static void grid_warp(int keycode, int remap_id, struct InputBuffer * input_buffer) {
+  if (!state.grid_active || keycode == MS_G_RST) {
+    screen_source->get_screen_rect(&state.grid.left, &state.grid.top, &state.grid.width, &state.grid.height);
+    state.grid_active = 1;
+  }
+  grid_rect_t * grid = &state.grid;
+  if (keycode >= MS_G_1 && keycode <= MS_G_9) {
+    const int cell = keycode - MS_G_1;
+    if (grid->width >= 3) {
+      grid->left += (cell % 3) * grid->width / 3;
+      grid->width /= 3;
+    }
+    if (grid->height >= 3) {
+      grid->top += (cell / 3) * grid->height / 3;
+      grid->height /= 3;
+    }
+  } else if (keycode == MS_G_U || keycode == MS_G_D) {
+    if (grid->height >= 2) {
+      if (keycode == MS_G_D) grid->top += grid->height / 2;
+      grid->height /= 2;
+    }
+  } else if (keycode == MS_G_L || keycode == MS_G_R) {
+    if (grid->width >= 2) {
+      if (keycode == MS_G_R) grid->left += grid->width / 2;
+      grid->width /= 2;
+    }
+  }
+  warp_send(&state, remap_id, input_buffer);
+}
+
+/** Intervals due since the last one sent. Timer ticks come late or early,
+ * counting on the engine clock keeps the speed from depending on them. */
+static int move_intervals_due(struct MouseState * state) {
+  uint64_t now = clock_now_us();
+  int due = (int)((int64_t)(now - state->move_time + ORBITAL_MOUSE_INTERVAL_US / 2) / ORBITAL_MOUSE_INTERVAL_US);
+  if (due > ORBITAL_MOUSE_MAX_CATCH_UP) {
+    // Stalled, not worth a jump of the cursor.
+    state->move_time = now;
+    return ORBITAL_MOUSE_MAX_CATCH_UP;
+  }
+  if (due < 0) due = 0;
+  state->move_time += (uint64_t)due * ORBITAL_MOUSE_INTERVAL_US;
+  return due;
+}
+
+// Stops the move timer from the engine thread, waiting for a running tick.
+void stop_move_timer() {
+  InterlockedExchange(&g_active, 0);
+  void * timer = InterlockedExchangePointer(&g_move_timer, NULL);
+  if (timer && platform_timer_stop(timer))
+    DEBUG(-1, debug_print(RED, "\nplatform_timer_stop failed (%d)", GetLastError()));
 }
 
 VOID CALLBACK move_callback(PVOID lpParam, BOOLEAN TimerOrWaitFired) {
-  int active = *(int *)lpParam;
-  if (active) {
-    move_send(&state, 0, &g_input_buffer);
+  volatile LONG * active = (volatile LONG *)lpParam;
+  if (*active) {
+    int due = move_intervals_due(&state);
+    trace_move(due);
+    for (; due > 0; due--) {
+      move_send(&state, 0, &g_input_buffer);
+    }
     if (!input_buffer_empty(&g_input_buffer)) {
-        SetEvent(ghEvent);
+        wake_output();
+    }
+    // Wheel momentum has run out with no key held: the timer stops itself.
+    // Whoever takes g_move_timer stops it; if a key started the mouse again
+    // meanwhile, the timer is put back unless a new one replaced it.
+    if (!state.held_keys && !wheel_coasting(&state) && InterlockedCompareExchange(active, 0, 1) == 1) {
+        void * timer = InterlockedExchangePointer(&g_move_timer, NULL);
+        if (timer && (!*active || InterlockedCompareExchangePointer(&g_move_timer, timer, NULL) != NULL)) {
+            platform_timer_cancel(timer);
+        }
     }
   }
 }
@@ -346,6 +540,8 @@ void mouse_emulation(int keycode, enum Direction direction, int remap_id, struct
     // Update `held_keys` bitfield.
     if (direction == DOWN) {
       state.held_keys |= held_mask;
+      // Relative movement leaves the grid, next grid warp starts from the whole screen.
+      state.grid_active = 0;
     } else {
       state.held_keys &= ~held_mask;
     }
@@ -369,34 +565,41 @@ void mouse_emulation(int keycode, enum Direction direction, int remap_id, struct
     // Update steering direction.
     state.steer_dir = get_dir_from_held_keys(6);
     // Update wheel movement.
-    state.wheel_y_dir = get_dir_from_held_keys(8);
-    state.wheel_x_dir = get_dir_from_held_keys(10);
+    dir = get_dir_from_held_keys(8);
+    if (state.wheel_y_dir != dir) {
+      state.wheel_y_dir = dir;
+      state.wheel_t = 0;
+    }
+    dir = get_dir_from_held_keys(10);
+    if (state.wheel_x_dir != dir) {
+      state.wheel_x_dir = dir;
+      state.wheel_t = 0;
+    }
 
     if (state.move_v || state.move_h || state.move_dir ||
         state.steer_dir || state.wheel_x_dir || state.wheel_y_dir) {
         if (!g_active){
+            state.move_time = clock_now_us();
             move_send(&state, remap_id, input_buffer);
         }
-    } else {
-        g_active = 0;
+    } else if (!g_active || !wheel_coasting(&state)) {
+        // Keep the timer running while the wheel coasts.
+        InterlockedExchange(&g_active, 0);
     }
     if (g_active) {
-      if (ghTimer == NULL) {
-        if (!CreateTimerQueueTimer(&ghTimer, ghTimerQueue, (WAITORTIMERCALLBACK)move_callback,
-                                   &g_active, 0, ORBITAL_MOUSE_INTERVAL_MS, 0)) {
-          DEBUG(-1, debug_print(RED, "\nCreateTimerQueueTimer failed (%d)", GetLastError()));
+      if (g_move_timer == NULL) {
+        void * timer = platform_timer_start(move_callback, (PVOID)&g_active, ORBITAL_MOUSE_INTERVAL_MS);
+        if (timer == NULL) {
+          DEBUG(-1, debug_print(RED, "\nplatform_timer_start failed (%d)", GetLastError()));
         }
+        g_move_timer = timer;
       }
     } else {
-      if (ghTimer) {
-        if (!DeleteTimerQueueTimer(ghTimerQueue, ghTimer, NULL))
-          DEBUG(-1, debug_print(RED, "\nDeleteTimerQueueTimer failed (%d)", GetLastError()));
-        ghTimer = NULL;
-      }
+      stop_move_timer();
     }
     if (state.move_v || state.move_h || state.move_dir ||
         state.steer_dir || state.wheel_x_dir || state.wheel_y_dir)
-        g_active = 1;
+        InterlockedExchange(&g_active, 1);
   } else {
     switch (keycode) {
       case MS_BTN1:
@@ -430,6 +633,29 @@ void mouse_emulation(int keycode, enum Direction direction, int remap_id, struct
           state.buttons = 0;
         }
         break;
+      case MS_G_1:
+      case MS_G_2:
+      case MS_G_3:
+      case MS_G_4:
+      case MS_G_5:
+      case MS_G_6:
+      case MS_G_7:
+      case MS_G_8:
+      case MS_G_9:
+      case MS_G_U:
+      case MS_G_D:
+      case MS_G_L:
+      case MS_G_R:
+      case MS_G_RST:
+        if (direction == DOWN) {
+          if (state.grid_key != keycode) {
+            state.grid_key = keycode;
+            grid_warp(keycode, remap_id, input_buffer);
+          }
+        } else if (state.grid_key == keycode) {
+          state.grid_key = 0;
+        }
+        break;
     }
     if (state.buttons != state.last_buttons) {
       buttons_send(&state, remap_id, input_buffer);
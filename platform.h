@@ -0,0 +1,183 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+// Platform layer
+// --------------------------------------
+//
+// The remap engine (engine.c) is written against the Win32 types it has
+// always used and the small interface below. On Windows the types come from
+// windows.h and the interface is platform_win32.c. Elsewhere the Win32 names
+// used by the engine are shimmed here and the interface is platform_posix.c,
+// so the engine builds and runs on Linux (`make linux`, `make headless`).
+//
+// Input hooks and the output thread stay in the backends, which provide the
+// functions declared at the end of input.h.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <wchar.h>
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+#define PLATFORM_ALIGN(n) __declspec(align(n))
+
+#else
+
+#include <errno.h>
+#include <string.h>
+
+#define PLATFORM_ALIGN(n) __attribute__((aligned(n)))
+
+#define CALLBACK
+#define VOID void
+#define FALSE 0
+#define TRUE 1
+#define MAX_PATH 260
+
+typedef uint8_t BOOLEAN;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef int64_t LONG64;
+typedef uintptr_t ULONG_PTR;
+typedef void * PVOID;
+typedef void * HANDLE;
+typedef void * HWND;
+
+typedef struct {
+    LONG dx;
+    LONG dy;
+    DWORD mouseData;
+    DWORD dwFlags;
+    DWORD time;
+    ULONG_PTR dwExtraInfo;
+} MOUSEINPUT;
+
+typedef struct {
+    WORD wVk;
+    WORD wScan;
+    DWORD dwFlags;
+    DWORD time;
+    ULONG_PTR dwExtraInfo;
+} KEYBDINPUT;
+
+typedef struct {
+    DWORD type;
+    union {
+        MOUSEINPUT mi;
+        KEYBDINPUT ki;
+    };
+} INPUT;
+
+#define INPUT_MOUSE 0
+#define INPUT_KEYBOARD 1
+
+#define KEYEVENTF_EXTENDEDKEY 0x0001
+#define KEYEVENTF_KEYUP 0x0002
+#define KEYEVENTF_SCANCODE 0x0008
+
+#define MOUSEEVENTF_MOVE 0x0001
+#define MOUSEEVENTF_LEFTDOWN 0x0002
+#define MOUSEEVENTF_LEFTUP 0x0004
+#define MOUSEEVENTF_RIGHTDOWN 0x0008
+#define MOUSEEVENTF_RIGHTUP 0x0010
+#define MOUSEEVENTF_MIDDLEDOWN 0x0020
+#define MOUSEEVENTF_MIDDLEUP 0x0040
+#define MOUSEEVENTF_XDOWN 0x0080
+#define MOUSEEVENTF_XUP 0x0100
+#define MOUSEEVENTF_WHEEL 0x0800
+#define MOUSEEVENTF_HWHEEL 0x1000
+#define MOUSEEVENTF_VIRTUALDESK 0x4000
+#define MOUSEEVENTF_ABSOLUTE 0x8000
+
+#define XBUTTON1 0x0001
+#define XBUTTON2 0x0002
+#define WHEEL_DELTA 120
+
+#define LLKHF_EXTENDED 0x01
+#define LLKHF_INJECTED 0x10
+#define LLKHF_UP 0x80
+
+#define InterlockedCompareExchange64(destination, exchange, comparand) \
+    __sync_val_compare_and_swap(destination, comparand, exchange)
+#define InterlockedCompareExchange(destination, exchange, comparand) \
+    __sync_val_compare_and_swap(destination, comparand, exchange)
+#define InterlockedCompareExchangePointer(destination, exchange, comparand) \
+    __sync_val_compare_and_swap(destination, comparand, exchange)
+#define InterlockedExchange(target, value) __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST)
+#define InterlockedExchangePointer(target, value) __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(addend) __atomic_add_fetch(addend, 1, __ATOMIC_SEQ_CST)
+#define CopyMemory(destination, source, length) memcpy(destination, source, length)
+#define ZeroMemory(destination, length) memset(destination, 0, length)
+#define GetLastError() errno
+
+#endif
+
+// Clock
+// ----------------
+
+// Microseconds on a monotonic clock, the engine clock by default (clock.c).
+uint64_t platform_time_us();
+
+// Threads
+// ----------------
+
+// @return id of the calling thread, as the system shows it
+unsigned long platform_thread_id();
+void platform_sleep_ms(int ms);
+
+// Timer
+// ----------------
+
+typedef VOID (CALLBACK * PlatformTimerCallback)(PVOID arg, BOOLEAN timer_fired);
+
+// Calls callback(arg, TRUE) every period_ms from another thread.
+// @return timer to be stopped, NULL on error
+void * platform_timer_start(PlatformTimerCallback callback, void * arg, int period_ms);
+// Waits for a running call, none follows.
+// @return error
+int platform_timer_stop(void * timer);
+// Stops the timer from its own callback, without waiting for it.
+void platform_timer_cancel(void * timer);
+
+// Files
+// ----------------
+
+struct PlatformFileMap {
+    const uint8_t * data;
+    uint32_t size;
+    void * handles[2];
+};
+
+// Opens path with a fopen mode, NULL on error.
+FILE * platform_fopen(const wchar_t * path, const char * mode);
+// @return error
+int platform_file_info(const wchar_t * path, uint32_t * size, uint64_t * write_time);
+// Renames from over to, which is replaced at once: a reader sees the old
+// file or the new one, never a partial write.
+// @return error
+int platform_replace_file(const wchar_t * from, const wchar_t * to);
+// Maps path read-only, empty files are an error.
+// @return error
+int platform_map_file(const wchar_t * path, struct PlatformFileMap * map);
+void platform_unmap_file(struct PlatformFileMap * map);
+// Writes count chunks to path, replacing it, with the system calls alone:
+// no stdio, no allocation, fit for crash handlers.
+// @return error
+int platform_write_file(const char * path, const void * const * chunks, const size_t * sizes, int count);
+
+// Desktop
+// ----------------
+
+// @return id of the process owning the window, 0 if unknown
+unsigned long platform_window_process(void * window);
+// Copies the executable file name of the process, without directory, to name.
+// @return error
+int platform_process_name(unsigned long process_id, char * name, int size);
+// Rectangle of the whole (virtual) screen in pixels, empty if there is no display.
+// Without a display server, the range of the absolute moves (POSIX).
+void platform_screen_rect(int * left, int * top, int * width, int * height);
+
+#endif
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "platform.h"
+
+// Platform layer on POSIX, see platform.h.
+//
+// Paths are wide strings in the engine, they are converted with the current
+// locale before use.
+
+#define PLATFORM_PATH_SIZE (MAX_PATH * 4)
+
+struct PlatformTimer {
+    pthread_t thread;
+    PlatformTimerCallback callback;
+    void * arg;
+    int period_ms;
+    volatile int stopped;
+    int cancelled; // by the callback, the thread frees the timer
+};
+
+uint64_t platform_time_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+unsigned long platform_thread_id() {
+#ifdef SYS_gettid
+    return (unsigned long)syscall(SYS_gettid);
+#else
+    return (unsigned long)pthread_self();
+#endif
+}
+
+void platform_sleep_ms(int ms) {
+    struct timespec period = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&period, NULL);
+}
+
+static void * platform_timer_thread(void * arg) {
+    struct PlatformTimer * timer = arg;
+    struct timespec period = {timer->period_ms / 1000, (timer->period_ms % 1000) * 1000000L};
+    // Like timer queue timers, the first call is immediate.
+    while (!timer->stopped) {
+        timer->callback(timer->arg, TRUE);
+        if (timer->cancelled) break;
+        nanosleep(&period, NULL);
+    }
+    if (timer->cancelled) free(timer);
+    return NULL;
+}
+
+void * platform_timer_start(PlatformTimerCallback callback, void * arg, int period_ms) {
+    struct PlatformTimer * timer = calloc(1, sizeof(struct PlatformTimer));
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->period_ms = period_ms;
+    if (pthread_create(&timer->thread, NULL, platform_timer_thread, timer) != 0) {
+        free(timer);
+        return NULL;
+    }
+    return timer;
+}
+
+int platform_timer_stop(void * arg) {
+    struct PlatformTimer * timer = arg;
+    timer->stopped = 1;
+    int err = pthread_join(timer->thread, NULL) != 0;
+    free(timer);
+    return err;
+}
+
+void platform_timer_cancel(void * arg) {
+    struct PlatformTimer * timer = arg;
+    timer->cancelled = 1;
+    pthread_detach(timer->thread);
+}
+
+/* @return error */
+static int platform_path(const wchar_t * path, char * buffer) {
+    size_t length = wcstombs(buffer, path, PLATFORM_PATH_SIZE);
+    return length == (size_t)-1 || length >= PLATFORM_PATH_SIZE;
+}
+
+FILE * platform_fopen(const wchar_t * path, const char * mode) {
+    char buffer[PLATFORM_PATH_SIZE];
+    if (platform_path(path, buffer)) return NULL;
+    return fopen(buffer, mode);
+}
+
+int platform_file_info(const wchar_t * path, uint32_t * size, uint64_t * write_time) {
+    char buffer[PLATFORM_PATH_SIZE];
+    struct stat info;
+    if (platform_path(path, buffer) || stat(buffer, &info) != 0) {
+        return 1;
+    }
+    *size = (uint32_t)info.st_size;
+    *write_time = (uint64_t)info.st_mtim.tv_sec * 1000000000u + info.st_mtim.tv_nsec;
+    return 0;
+}
+
+int platform_replace_file(const wchar_t * from, const wchar_t * to) {
+    char from_buffer[PLATFORM_PATH_SIZE];
+    char to_buffer[PLATFORM_PATH_SIZE];
+    return platform_path(from, from_buffer) || platform_path(to, to_buffer) ||
+        rename(from_buffer, to_buffer) != 0;
+}
+
+int platform_map_file(const wchar_t * path, struct PlatformFileMap * map) {
+    char buffer[PLATFORM_PATH_SIZE];
+    struct stat info;
+    if (platform_path(path, buffer)) return 1;
+    int file = open(buffer, O_RDONLY);
+    if (file < 0) return 1;
+    int err = 1;
+    if (fstat(file, &info) == 0 && info.st_size > 0 && info.st_size < 0x10000000) {
+        void * data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (data != MAP_FAILED) {
+            map->data = data;
+            map->size = (uint32_t)info.st_size;
+            err = 0;
+        }
+    }
+    close(file);
+    return err;
+}
+
+void platform_unmap_file(struct PlatformFileMap * map) {
+    munmap((void *)map->data, map->size);
+}
+
+int platform_write_file(const char * path, const void * const * chunks, const size_t * sizes, int count) {
+    int file = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file < 0) return 1;
+    int err = 0;
+    for (int i = 0; i < count && !err; i++) {
+        const char * data = chunks[i];
+        for (size_t done = 0; done < sizes[i]; ) {
+            ssize_t n = write(file, data + done, sizes[i] - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                err = 1;
+                break;
+            }
+            done += n;
+        }
+    }
+    return close(file) != 0 || err;
+}
+
+unsigned long platform_window_process(void * window) {
+    // There are no windows to follow headless.
+    return 0;
+}
+
+int platform_process_name(unsigned long process_id, char * name, int size) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%lu/comm", process_id);
+    FILE * file = fopen(path, "r");
+    if (!file) return 1;
+    int err = !fgets(name, size, file);
+    fclose(file);
+    if (err) return 1;
+    name[strcspn(name, "\n")] = '\0';
+    return 0;
+}
+
+void platform_screen_rect(int * left, int * top, int * width, int * height) {
+    // The display server is out of reach: a screen as large as the range of
+    // the absolute moves, which the display server maps over the desktop.
+    *left = *top = 0;
+    *width = *height = 65536;
+}
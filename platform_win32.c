@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+
+// Platform layer on Win32, see platform.h.
+
+HANDLE ghTimerQueue = NULL;
+
+uint64_t platform_time_us() {
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    // Seconds and remainder apart, counter * 1000000 would overflow.
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+           (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+unsigned long platform_thread_id() {
+    return GetCurrentThreadId();
+}
+
+void platform_sleep_ms(int ms) {
+    Sleep(ms);
+}
+
+void * platform_timer_start(PlatformTimerCallback callback, void * arg, int period_ms) {
+    HANDLE timer = NULL;
+    if (!CreateTimerQueueTimer(&timer, ghTimerQueue, (WAITORTIMERCALLBACK)callback, arg, 0, period_ms, 0)) {
+        return NULL;
+    }
+    return timer;
+}
+
+int platform_timer_stop(void * timer) {
+    return !DeleteTimerQueueTimer(ghTimerQueue, (HANDLE)timer, INVALID_HANDLE_VALUE);
+}
+
+// Fails with ERROR_IO_PENDING as the callback is running, the timer is deleted anyway.
+void platform_timer_cancel(void * timer) {
+    DeleteTimerQueueTimer(ghTimerQueue, (HANDLE)timer, NULL);
+}
+
+FILE * platform_fopen(const wchar_t * path, const char * mode) {
+    wchar_t wide_mode[8];
+    mbstowcs(wide_mode, mode, 8);
+    FILE * file;
+    if (_wfopen_s(&file, path, wide_mode) != 0) {
+        return NULL;
+    }
+    return file;
+}
+
+int platform_file_info(const wchar_t * path, uint32_t * size, uint64_t * write_time) {
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExW(path, GetFileExInfoStandard, &info)) {
+        return 1;
+    }
+    *size = info.nFileSizeLow;
+    *write_time = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    return 0;
+}
+
+int platform_replace_file(const wchar_t * from, const wchar_t * to) {
+    return !MoveFileExW(from, to, MOVEFILE_REPLACE_EXISTING);
+}
+
+int platform_map_file(const wchar_t * path, struct PlatformFileMap * map) {
+    HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && size.QuadPart < 0x10000000) {
+        HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            const uint8_t * data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if (data) {
+                map->data = data;
+                map->size = (uint32_t)size.QuadPart;
+                map->handles[0] = file;
+                map->handles[1] = mapping;
+                return 0;
+            }
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+    return 1;
+}
+
+void platform_unmap_file(struct PlatformFileMap * map) {
+    UnmapViewOfFile(map->data);
+    CloseHandle(map->handles[1]);
+    CloseHandle(map->handles[0]);
+}
+
+int platform_write_file(const char * path, const void * const * chunks, const size_t * sizes, int count) {
+    HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+    int err = 0;
+    for (int i = 0; i < count && !err; i++) {
+        DWORD written;
+        err = !WriteFile(file, chunks[i], (DWORD)sizes[i], &written, NULL) || written != sizes[i];
+    }
+    return !CloseHandle(file) || err;
+}
+
+unsigned long platform_window_process(void * window) {
+    DWORD process_id = 0;
+    GetWindowThreadProcessId((HWND)window, &process_id);
+    return process_id;
+}
+
+int platform_process_name(unsigned long process_id, char * name, int size) {
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, process_id);
+    if (!process) return 1;
+    char path[MAX_PATH];
+    DWORD length = MAX_PATH;
+    int err = !QueryFullProcessImageNameA(process, 0, path, &length);
+    CloseHandle(process);
+    if (err) return 1;
+    char * base = strrchr(path, '\\');
+    snprintf(name, size, "%s", base ? base + 1 : path);
+    return 0;
+}
+
+void platform_screen_rect(int * left, int * top, int * width, int * height) {
+    *left = GetSystemMetrics(SM_XVIRTUALSCREEN);
+    *top = GetSystemMetrics(SM_YVIRTUALSCREEN);
+    *width = GetSystemMetrics(SM_CXVIRTUALSCREEN);
+    *height = GetSystemMetrics(SM_CYVIRTUALSCREEN);
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "platform.h"
+#include "input.h"
+
+// Application profiles
+// --------------------------------------
+//
+// A profile= section of config.txt is used while the foreground window
+// belongs to one of the executables listed by its match= lines. The
+// foreground window is resolved to a profile when it changes, the result
+// is cached per window so the process name is only looked up once. The
+// lookups run on the thread watching config.txt (see foreground_changed
+// and publish_config) or at launch, never on the hook thread, which only
+// reads the profile resolved for its config.
+
+#define PROFILE_CACHE_SIZE 64 // power of 2
+#define PROCESS_NAME_SIZE 260
+
+struct ProfileCacheEntry {
+    void * window;
+    unsigned long process_id;
+    struct Config * profile;
+};
+
+static const struct WindowSource init_window_source = {platform_window_process, platform_process_name};
+static const struct WindowSource * window_source = &init_window_source;
+
+static struct ProfileCacheEntry profile_cache[PROFILE_CACHE_SIZE];
+static struct Config * profile_cache_config = NULL;
+
+// NULL for the platform's, tests install a stub, see replay.c.
+void set_window_source(const struct WindowSource * source) {
+    window_source = (source != NULL) ? source : &init_window_source;
+    profile_cache_config = NULL;
+}
+
+static int process_name_eq(const char * a, const char * b) {
+    while (*a && *b && tolower((unsigned char)*a) == tolower((unsigned char)*b)) {
+        a++;
+        b++;
+    }
+    return *a == '\0' && *b == '\0';
+}
+
+static struct Config * match_process_profile(struct Config * config, const char * process_name) {
+    for (struct Config * profile = config->next_profile; profile; profile = profile->next_profile) {
+        for (struct ProfileMatch * match = profile->matches; match; match = match->next) {
+            if (process_name_eq(match->name, process_name)) return profile;
+        }
+    }
+    return config;
+}
+
+/* @return the profile of config used for window, config itself if none matches */
+struct Config * find_window_profile(struct Config * config, void * window) {
+    if (config->next_profile == NULL || window == NULL) return config;
+    if (profile_cache_config != config) {
+        // The cached profiles belong to a config that has been replaced,
+        // the cache is only ever compared against live configs.
+        memset(profile_cache, 0, sizeof(profile_cache));
+        profile_cache_config = config;
+    }
+
+    // Window handles are reused, the process id tells a new window apart.
+    unsigned long process_id = window_source->get_window_process(window);
+    struct ProfileCacheEntry * entry = &profile_cache[((uintptr_t)window >> 4) & (PROFILE_CACHE_SIZE - 1)];
+    if (entry->window == window && entry->process_id == process_id && entry->profile) {
+        return entry->profile;
+    }
+
+    char process_name[PROCESS_NAME_SIZE];
+    struct Config * profile = config;
+    if (process_id && window_source->get_process_name(process_id, process_name, PROCESS_NAME_SIZE) == 0) {
+        profile = match_process_profile(config, process_name);
+    }
+    entry->window = window;
+    entry->process_id = process_id;
+    entry->profile = profile;
+    return profile;
+}
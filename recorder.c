@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <string.h>
+#include "platform.h"
+#include "input.h"
+
+// Flight recorder
+// --------------------------------------
+//
+// Always on, keeps the last inputs, their results and the synthesized
+// outputs in memory, for the stuck keys nobody can reproduce. The ring is
+// dumped to RECORDER_DUMP_FILE on demand, on crash and when the unlock
+// timeout releases held remaps. `--decode` turns a dump into a trace for
+// `--replay`. Dumps asked for by the engine are written by the log thread,
+// see recorder_request_dump.
+//
+// The ring is made of blocks, a record never spans two blocks and every
+// block starts at an absolute time, so the oldest block can be overwritten
+// without losing the start of the next one. A record is a type byte, the
+// zigzag varint delta to the time of the previous record of the block in us
+// on the engine clock, then varint fields. Outputs carry the time of the last
+// input.
+//
+// The hook thread and the mouse timer thread both record, a spin lock keeps
+// them apart. It is only ever held for a few copies.
+
+#define RECORDER_BLOCK_SIZE 4096
+#define RECORDER_BLOCKS 16
+#define RECORDER_DUMP_FILE "flight_recorder.bin"
+#define RECORDER_MAGIC "KRFR"
+#define RECORDER_VERSION 2
+#define RECORDER_RECORD_MAX 48
+
+enum RecordType {
+    RECORD_NONE,
+    RECORD_INPUT,        // scan_code | extended<<8, virt_code, DOWN<<0 | injected<<1, extra
+    RECORD_RESULT,       // block_input + 1, remap id, remap state, tap_lock | double_tap_lock<<1
+    RECORD_OUTPUT_KEY,   // wScan, wVk, dwFlags, dwExtraInfo & 0xFF
+    RECORD_OUTPUT_MOUSE, // dwFlags, dx, dy, mouseData (signed), dwExtraInfo & 0xFF
+    RECORD_LAYER,        // layer id, state
+    RECORD_UNLOCK,
+};
+
+struct RecorderBlock {
+    uint64_t time;
+    uint32_t used;
+    uint32_t reserved;
+    uint8_t data[RECORDER_BLOCK_SIZE - 16];
+};
+
+struct Recorder {
+    struct RecorderBlock blocks[RECORDER_BLOCKS];
+    uint32_t current;
+    uint64_t time; // of the last input
+    uint64_t last_time; // of the last record in the current block
+    volatile LONG64 lock;
+};
+
+static struct Recorder g_recorder;
+int g_recorder_auto_dump = 1; // dump on unlock timeout
+static struct RecorderBlock g_recorder_snapshot[RECORDER_BLOCKS];
+static const char * volatile g_recorder_dump_reason = NULL;
+
+static uint8_t * put_varint(uint8_t * p, uint64_t value) {
+    while (value >= 0x80) {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+static uint8_t * put_signed(uint8_t * p, int64_t value) {
+    return put_varint(p, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+/* @return 1 if locked, spins < 0 to wait for ever */
+static int recorder_lock(long spins) {
+    while (InterlockedCompareExchange64(&g_recorder.lock, 1, 0) != 0) {
+        if (spins >= 0 && spins-- == 0) return 0;
+    }
+    return 1;
+}
+
+static void recorder_unlock() {
+    InterlockedCompareExchange64(&g_recorder.lock, 0, 1);
+}
+
+static void recorder_write(enum RecordType type, const uint8_t * fields, size_t size) {
+    uint8_t header[12];
+    recorder_lock(-1);
+    struct RecorderBlock * block = &g_recorder.blocks[g_recorder.current];
+    if (block->used + sizeof(header) + size > sizeof(block->data)) {
+        g_recorder.current = (g_recorder.current + 1) % RECORDER_BLOCKS;
+        block = &g_recorder.blocks[g_recorder.current];
+        block->time = g_recorder.time;
+        block->used = 0;
+        g_recorder.last_time = g_recorder.time;
+    }
+    header[0] = type;
+    size_t header_size = put_signed(header + 1, (int64_t)(g_recorder.time - g_recorder.last_time)) - header;
+    g_recorder.last_time = g_recorder.time;
+    memcpy(block->data + block->used, header, header_size);
+    memcpy(block->data + block->used + header_size, fields, size);
+    block->used += header_size + size;
+    recorder_unlock();
+}
+
+void recorder_input(int scan_code, int virt_code, enum Direction direction, uint64_t time, int is_injected,
+                    DWORD flags, ULONG_PTR extra) {
+    uint8_t fields[RECORDER_RECORD_MAX];
+    uint8_t * p = fields;
+    g_recorder.time = time;
+    p = put_varint(p, (scan_code & 0xFF) | ((flags & LLKHF_EXTENDED) ? 0x100 : 0));
+    p = put_varint(p, virt_code & 0xFF);
+    *p++ = (direction == DOWN) | (is_injected ? 2 : 0);
+    p = put_varint(p, (uint64_t)extra);
+    recorder_write(RECORD_INPUT, fields, p - fields);
+}
+
+void recorder_result(int block_input, int remap_id, int state, int locks) {
+    uint8_t fields[4] = {(uint8_t)(block_input + 1), (uint8_t)remap_id, (uint8_t)state, (uint8_t)locks};
+    recorder_write(RECORD_RESULT, fields, sizeof(fields));
+}
+
+void recorder_output(INPUT * input) {
+    uint8_t fields[RECORDER_RECORD_MAX];
+    uint8_t * p = fields;
+    if (input->type == INPUT_KEYBOARD) {
+        p = put_varint(p, input->ki.wScan);
+        p = put_varint(p, input->ki.wVk);
+        p = put_varint(p, input->ki.dwFlags);
+        *p++ = (uint8_t)input->ki.dwExtraInfo;
+        recorder_write(RECORD_OUTPUT_KEY, fields, p - fields);
+    } else {
+        p = put_varint(p, input->mi.dwFlags);
+        p = put_signed(p, input->mi.dx);
+        p = put_signed(p, input->mi.dy);
+        p = put_signed(p, (int32_t)input->mi.mouseData);
+        *p++ = (uint8_t)input->mi.dwExtraInfo;
+        recorder_write(RECORD_OUTPUT_MOUSE, fields, p - fields);
+    }
+}
+
+void recorder_layer(int id, int state) {
+    uint8_t fields[RECORDER_RECORD_MAX];
+    uint8_t * p = put_varint(fields, id);
+    *p++ = (uint8_t)state;
+    recorder_write(RECORD_LAYER, fields, p - fields);
+}
+
+void recorder_unlock_all() {
+    recorder_write(RECORD_UNLOCK, NULL, 0);
+}
+
+/* Writes the ring to RECORDER_DUMP_FILE, reason is kept in the dump. It
+ * does not allocate and only makes system calls, see platform_write_file,
+ * and gives up the lock after a while: the crashing thread may hold it.
+ * @return error */
+static int write_dump(const char * reason) {
+    int locked = recorder_lock(1 << 20);
+    uint32_t current = g_recorder.current;
+    memcpy(g_recorder_snapshot, g_recorder.blocks, sizeof(g_recorder_snapshot));
+    if (locked) recorder_unlock();
+
+    static uint8_t header[32];
+    memset(header, 0, sizeof(header));
+    memcpy(header, RECORDER_MAGIC, 4);
+    header[4] = RECORDER_VERSION;
+    for (int i = 0; reason[i] && 8 + i < (int)sizeof(header) - 1; i++) {
+        header[8 + i] = reason[i];
+    }
+    const void * chunks[RECORDER_BLOCKS + 1] = {header};
+    size_t sizes[RECORDER_BLOCKS + 1] = {sizeof(header)};
+    int count = 1;
+    // Oldest block first.
+    for (int i = 1; i <= RECORDER_BLOCKS; i++) {
+        struct RecorderBlock * block = &g_recorder_snapshot[(current + i) % RECORDER_BLOCKS];
+        if (block->used == 0) continue;
+        chunks[count] = block;
+        sizes[count++] = sizeof(struct RecorderBlock);
+    }
+    return platform_write_file(RECORDER_DUMP_FILE, chunks, sizes, count);
+}
+
+/* For crash handlers: the dump alone, the debug log may be what crashed.
+ * @return error */
+int recorder_crash_dump(const char * reason) {
+    return write_dump(reason);
+}
+
+/* Dumps the ring and logs it.
+ * @return error */
+int recorder_dump(const char * reason) {
+    int err = write_dump(reason);
+    if (err) return err;
+    char message[64];
+    snprintf(message, sizeof(message), "Flight recorder dumped to %s (%s)", RECORDER_DUMP_FILE, reason);
+    debug_file(message);
+    return err;
+}
+
+static void run_requested_dump() {
+    recorder_dump(g_recorder_dump_reason);
+}
+
+// Dumps on the log thread, reason must be a static string.
+void recorder_request_dump(const char * reason) {
+    g_recorder_dump_reason = reason;
+    log_defer(run_requested_dump);
+}
+
+// Decoding
+// ----------------
+
+/* @return next varint, *p past it; stops at end */
+static uint64_t get_varint(const uint8_t ** p, const uint8_t * end) {
+    uint64_t value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*p)++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) break;
+    }
+    return value;
+}
+
+static int64_t get_signed(const uint8_t ** p, const uint8_t * end) {
+    uint64_t value = get_varint(p, end);
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/* Prints a dump as a trace for --replay, everything but the inputs as comments.
+ * @return error */
+int decode_recording(const char * path, FILE * out) {
+    FILE * file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Cannot open flight recorder dump '%s'.\n", path);
+        return 1;
+    }
+    uint8_t header[32];
+    if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, RECORDER_MAGIC, 4) != 0 ||
+        header[4] != RECORDER_VERSION) {
+        printf("'%s' is not a flight recorder dump.\n", path);
+        fclose(file);
+        return 1;
+    }
+    header[sizeof(header) - 1] = '\0';
+    fprintf(out, "# flight recorder dump (%s)\n", (char *)header + 8);
+
+    static struct RecorderBlock block;
+    int err = 0;
+    while (fread(&block, sizeof(block), 1, file) == 1) {
+        if (block.used > sizeof(block.data)) {
+            err = 1;
+            break;
+        }
+        const uint8_t * p = block.data;
+        const uint8_t * end = block.data + block.used;
+        uint64_t time = block.time;
+        while (p < end) {
+            enum RecordType type = *p++;
+            time += get_signed(&p, end);
+            switch (type) {
+            case RECORD_INPUT: {
+                int scan_code = (int)get_varint(&p, end);
+                int virt_code = (int)get_varint(&p, end);
+                int bits = p < end ? *p++ : 0;
+                uint64_t extra = get_varint(&p, end);
+                // The trace format, extended scan codes as 0xE0xx.
+                if (scan_code & 0x100) scan_code = 0xE000 | (scan_code & 0xFF);
+                print_time_ms(out, time);
+                fprintf(out, " 0x%02X 0x%02X %s %d 0x%llX\n", scan_code, virt_code,
+                        (bits & 1) ? "DOWN" : "UP", (bits & 2) ? 1 : 0, (unsigned long long)extra);
+                break;
+            }
+            case RECORD_RESULT:
+                if (end - p < 4) { p = end; break; }
+                fprintf(out, "#   -> %d remap=%d state=%d locks=%d\n", p[0] - 1, p[1], p[2], p[3]);
+                p += 4;
+                break;
+            case RECORD_OUTPUT_KEY: {
+                int scan_code = (int)get_varint(&p, end);
+                int virt_code = (int)get_varint(&p, end);
+                unsigned flags = (unsigned)get_varint(&p, end);
+                int remap_id = p < end ? *p++ : 0;
+                fprintf(out, "#   key scan=0x%04X vk=0x%02X flags=0x%X remap=%d\n", scan_code, virt_code, flags, remap_id);
+                break;
+            }
+            case RECORD_OUTPUT_MOUSE: {
+                unsigned flags = (unsigned)get_varint(&p, end);
+                int dx = (int)get_signed(&p, end);
+                int dy = (int)get_signed(&p, end);
+                int data = (int)get_signed(&p, end);
+                int remap_id = p < end ? *p++ : 0;
+                fprintf(out, "#   mouse dx=%d dy=%d data=%d flags=0x%X remap=%d\n", dx, dy, data, flags, remap_id);
+                break;
+            }
+            case RECORD_LAYER: {
+                int id = (int)get_varint(&p, end);
+                int state = p < end ? *p++ : 0;
+                fprintf(out, "#   layer %d state=%d\n", id, state);
+                break;
+            }
+            case RECORD_UNLOCK:
+                fprintf(out, "# ");
+                print_time_ms(out, time);
+                fprintf(out, " unlock_all\n");
+                break;
+            default:
+                // Unknown record, the rest of the block cannot be read.
+                p = end;
+                err = 1;
+            }
+        }
+    }
+    fclose(file);
+    if (err) printf("'%s' has unreadable records.\n", path);
+    return err;
+}
@@ -1,8 +1,11 @@
-#include <windows.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include "input.h"
 #include "keys.c"
 
@@ -18,6 +21,14 @@ enum State {
     DOUBLE_TAP,
 };
 
+static const char * state_names[] = {
+    "IDLE", "HELD_DOWN_ALONE", "HELD_DOWN_WITH_OTHER", "TAP", "TAPPED", "DOUBLE_TAP",
+};
+
+const char * remap_state_name(int state) {
+    return (state >= 0 && state <= DOUBLE_TAP) ? state_names[state] : "?";
+}
+
 struct KeyDefNode {
     KEY_DEF * key_def;
 
@@ -26,25 +37,26 @@ struct KeyDefNode {
 };
 
 struct LayerNode {
-    struct Layer * layer;
+    int layer;
 
     struct LayerNode * next;
 };
 
+// Layers are stored in the layers array of their config and referenced by
+// their id, the index assigned at parse time. Id 0 is reserved for "no layer".
 struct Layer {
     char * name;
+    int id;
     int state;
     int lock, prev_lock;
     struct LayerNode * or_master_layers;
     struct LayerNode * and_master_layers;
     struct LayerNode * and_not_master_layers;
     struct LayerNode * slave_layers;
-
-    struct Layer * next;
 };
 
 struct LayerConf {
-    struct Layer * layer;
+    int layer;
     void (*conf)(struct Layer * layer);
 
     struct LayerConf * next;
@@ -52,10 +64,11 @@ struct LayerConf {
 
 struct Remap {
     int id;
+    int line; // of the remap_key declaration, 0 if unknown
     KEY_DEF * from;
-    struct Layer * layer;
-    struct Layer * to_when_press_layer;
-    struct Layer * to_when_doublepress_layer;
+    int layer;
+    int to_when_press_layer;
+    int to_when_doublepress_layer;
     struct LayerConf * to_when_tap_lock_layer;
     struct LayerConf * to_when_double_tap_lock_layer;
     struct KeyDefNode * to_when_alone;
@@ -71,12 +84,14 @@ struct Remap {
     int to_when_double_tap_lock_modifiers;
     int to_when_alone_is_modifier_only;
     int to_when_doublepress_is_modifier_only;
+    int to_with_other_discarded; // not modifier-only, see register_remap
 
     int tap_lock;
     int double_tap_lock;
     enum State state;
-    DWORD time;
+    uint64_t time; // us, on the engine clock
     int active_modifiers;
+    struct RemapStats stats;
 
     struct Remap * next;
 };
@@ -87,24 +102,75 @@ struct RemapNode {
     struct RemapNode * next;
 };
 
+struct ProfileMatch {
+    char * name; // executable file name, e.g. "code.exe"
+
+    struct ProfileMatch * next;
+};
+
+// A parsed config.txt: settings, layers and remaps with their dispatch
+// tables. The active one is g_config, its settings are copied to the
+// g_ globals when it is activated.
+//
+// Each profile= section is parsed into its own Config, listed from the
+// default one with next_profile. Only the settings of the default one are
+// used. g_profile is the one whose tables handle the input.
+struct Config {
+    int debug;
+    int hold_delay; // us, like the other timeouts
+    int tap_timeout;
+    int doublepress_timeout;
+    int rehook_timeout;
+    int unlock_timeout;
+    int scancode;
+    int priority;
+    int wheel_momentum;
+    int full_capture;
+
+    struct Remap * remap_by_id[256];
+    struct RemapNode * remap_array[256]; // by virt_code & 0xFF
+    struct RemapNode * remap_by_scan[512]; // by scan_code_index, for keys with by_scan
+    struct Layer * layers; // indexed by layer id
+    int layer_count; // including the reserved id 0
+    int layer_capacity;
+    int * layer_index; // hash of layer names to ids, 0 if empty
+    int layer_index_size; // power of 2
+
+    char * profile_name; // NULL for the default profile
+    struct ProfileMatch * matches; // applications the profile is used for
+    struct Config * next_profile;
+    // Of the default one, the profile of the foreground window, resolved off
+    // the hook thread by foreground_changed and publish_config.
+    struct Config * volatile window_profile;
+
+    // Parser state
+    struct Remap * remap_list; // registered remaps, until dispatched
+    struct Remap * remap_parsee;
+    int layer_parsee;
+    struct Config * profile_parsee; // of the default config, NULL if none
+};
+
 // Globals
 // --------------------------------------
 
 int g_debug = 0;
-int g_hold_delay = 0;
-int g_tap_timeout = 0;
-int g_doublepress_timeout = 0;
-int g_rehook_timeout = 1000;
-int g_unlock_timeout = 60000;
+int g_hold_delay = 0; // us
+int g_tap_timeout = 0; // us
+int g_doublepress_timeout = 0; // us
+int g_rehook_timeout = 1000000; // us
+int g_unlock_timeout = 60000000; // us
 int g_scancode = 0;
 int g_priority = 1;
-int g_last_input = 0;
-struct Remap * g_remap_list = NULL;
-struct Remap * g_remap_parsee = NULL;
-struct Remap * g_remap_by_id[256] = {NULL};
-struct RemapNode * g_remap_array[256] = {NULL};
-struct Layer * g_layer_list = NULL;
-struct Layer * g_layer_parsee = NULL;
+int g_wheel_momentum = 0;
+int g_full_capture = 0; // read at launch, see capture.c
+uint64_t g_last_input = 0; // us, on the engine clock
+struct Remap * g_remap_list = NULL; // active remaps
+struct Config * g_config = NULL;
+struct Config * volatile g_config_pending = NULL; // reloaded config, not active yet
+struct Config * g_profile = NULL; // profile of g_config in use
+int g_profile_changes = 0; // of g_profile, ipc_publish copies the names again
+struct Config * g_config_latest = NULL; // activated or published last, see foreground_changed
+void * volatile g_foreground_window = NULL;
 
 // Debug Logging
 // --------------------------------------
@@ -113,53 +179,60 @@ char * fmt_dir(enum Direction direction) {
     return (direction == DOWN) ? "DOWN" : "UP";
 }
 
+// Records for the log thread, see log.c.
+
 int log_indent_level = 0;
-int log_counter = 1;
-void print_log_prefix() {
-    printf("\n%03d. ", log_counter++);
-    for (int i = 0; i < log_indent_level; i++)
-    {
-        printf("\t");
-    }
-}
 
 void log_handle_input_start(int scan_code, int virt_code, enum Direction direction, int is_injected, DWORD flags, ULONG_PTR dwExtraInfo) {
-    if (!g_debug) return;
-    print_log_prefix();
-    printf("[%s] %s %s (scan:0x%04X virt:0x%02X flags:0x%02X dwExtraInfo:0x%IX)",
-           (is_injected && ((dwExtraInfo & 0xFFFFFF00) == INJECTED_KEY_ID)) ? "output" : "input",
-           friendly_virt_code_name(virt_code),
-           fmt_dir(direction),
-           scan_code, // MapVirtualKeyA(virt_code, MAPVK_VK_TO_VSC_EX)
-           virt_code,
-           flags,
-           dwExtraInfo);
+    if (!g_debug || g_hook_degraded) return;
+    uint32_t tail;
+    struct LogRecord * record = log_reserve(LOG_INPUT, &tail);
+    if (record) {
+        record->indent = log_indent_level;
+        record->is_output = is_injected && ((dwExtraInfo & 0xFFFFFF00) == INJECTED_KEY_ID);
+        record->direction = direction;
+        record->scan_code = scan_code; // MapVirtualKeyA(virt_code, MAPVK_VK_TO_VSC_EX)
+        record->virt_code = virt_code;
+        record->flags = flags;
+        record->extra = dwExtraInfo;
+        log_commit(tail);
+    }
     log_indent_level++;
 }
 
 void log_handle_input_end(int scan_code, int virt_code, enum Direction direction, int block_input) {
-    if (!g_debug) return;
+    if (!g_debug || g_hook_degraded) return;
     log_indent_level--;
     if (block_input) {
-        print_log_prefix();
-        printf("#blocked-input# %s %s",
-            friendly_virt_code_name(virt_code),
-            fmt_dir(direction));
+        uint32_t tail;
+        struct LogRecord * record = log_reserve(LOG_BLOCKED, &tail);
+        if (!record) return;
+        record->indent = log_indent_level;
+        record->direction = direction;
+        record->virt_code = virt_code;
+        log_commit(tail);
     }
 }
 
 void log_send_input(char * remap_name, KEY_DEF * key, enum Direction direction) {
-    if (!g_debug) return;
-    print_log_prefix();
-    printf("(sending:%s) %s %s",
-        remap_name,
-        key ? key->name : "???",
-        fmt_dir(direction));
+    if (!g_debug || g_hook_degraded) return;
+    uint32_t tail;
+    struct LogRecord * record = log_reserve(LOG_SEND, &tail);
+    if (!record) return;
+    record->indent = log_indent_level;
+    record->direction = direction;
+    record->name = remap_name;
+    record->key_name = key ? key->name : "???";
+    log_commit(tail);
 }
 
 // Remapping
 // -------------------------------------
 
+struct Layer * get_layer(int id) {
+    return &g_profile->layers[id];
+}
+
 void toggle_layer_lock(struct Layer * layer) {
     layer->prev_lock = layer->lock;
     layer->lock = 1 - layer->lock;
@@ -175,17 +248,18 @@ void reset_layer_lock(struct Layer * layer) {
     layer->lock = 0;
 }
 
-int check_layer_state(struct Layer * layer) {
+int check_layer_state(int id) {
+    struct Layer * layer = get_layer(id);
     if (layer->lock) return 1;
     int state = layer->state;
     if (state) {
         struct Remap * remap_iter = g_remap_list;
         while (remap_iter) {
-            if ((remap_iter->to_when_press_layer == layer &&
+            if ((remap_iter->to_when_press_layer == id &&
                  (remap_iter->state == HELD_DOWN_ALONE ||
                   remap_iter->state == HELD_DOWN_WITH_OTHER ||
                   remap_iter->state == TAP)) ||
-                (remap_iter->to_when_doublepress_layer == layer &&
+                (remap_iter->to_when_doublepress_layer == id &&
                  remap_iter->state == DOUBLE_TAP)) {
                 return 1;
             }
@@ -222,12 +296,14 @@ int check_layer_state(struct Layer * layer) {
     return state;
 }
 
-void set_layer_state(struct Layer * layer, int state) {
-    //if (!layer) return;
-    layer->state = state;
-    struct LayerNode * slave_iter = layer->slave_layers;
+void set_layer_state(int id, int state) {
+    //if (!id) return;
+    get_layer(id)->state = state;
+    recorder_layer(id, state);
+    trace_layer(get_layer(id)->name, state);
+    struct LayerNode * slave_iter = get_layer(id)->slave_layers;
     while (slave_iter) {
-        set_layer_state(slave_iter->layer, check_layer_state(slave_iter->layer) ? 1 : slave_iter->layer->lock);
+        set_layer_state(slave_iter->layer, check_layer_state(slave_iter->layer) ? 1 : get_layer(slave_iter->layer)->lock);
         slave_iter = slave_iter->next;
     }
 }
@@ -240,16 +316,62 @@ struct KeyDefNode * new_key_node(KEY_DEF * key_def) {
     return key_node;
 }
 
-struct LayerNode * new_layer_node(struct Layer * layer) {
+struct LayerNode * new_layer_node(int layer) {
     struct LayerNode * layer_node = malloc(sizeof(struct LayerNode));
     layer_node->layer = layer;
     layer_node->next = NULL;
     return layer_node;
 }
 
-struct Layer * new_layer(char * name) {
-    struct Layer * layer = malloc(sizeof(struct Layer));
+unsigned int layer_name_hash(char * name) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void grow_layer_index(struct Config * config) {
+    int size = config->layer_index_size ? config->layer_index_size * 2 : 64;
+    int * index = calloc(size, sizeof(int));
+    for (int id = 1; id < config->layer_count; id++) {
+        unsigned int slot = layer_name_hash(config->layers[id].name) & (size - 1);
+        while (index[slot]) slot = (slot + 1) & (size - 1);
+        index[slot] = id;
+    }
+    free(config->layer_index);
+    config->layer_index = index;
+    config->layer_index_size = size;
+}
+
+/* @return layer id, 0 if not found */
+int find_layer(struct Config * config, char * name) {
+    if (config->layer_index_size == 0) return 0;
+    unsigned int slot = layer_name_hash(name) & (config->layer_index_size - 1);
+    while (config->layer_index[slot]) {
+        if (strcmp(config->layers[config->layer_index[slot]].name, name) == 0) {
+            return config->layer_index[slot];
+        }
+        slot = (slot + 1) & (config->layer_index_size - 1);
+    }
+    return 0;
+}
+
+/* @return id of the layer, added if not found */
+int register_layer(struct Config * config, char * name) {
+    int id = find_layer(config, name);
+    if (id) return id;
+
+    if (config->layer_count >= config->layer_capacity) {
+        config->layer_capacity = config->layer_capacity ? config->layer_capacity * 2 : 16;
+        config->layers = realloc(config->layers, config->layer_capacity * sizeof(struct Layer));
+    }
+    id = config->layer_count++;
+    struct Layer * layer = &config->layers[id];
     layer->name = strdup(name);
+    layer->id = id;
     layer->state = 0;
     layer->lock = 0;
     layer->prev_lock = 0;
@@ -257,11 +379,19 @@ struct Layer * new_layer(char * name) {
     layer->and_master_layers = NULL;
     layer->and_not_master_layers = NULL;
     layer->slave_layers = NULL;
-    layer->next = NULL;
-    return layer;
+
+    // Keep the load factor of the index below 1/2.
+    if (2 * config->layer_count > config->layer_index_size) {
+        grow_layer_index(config);
+    } else {
+        unsigned int slot = layer_name_hash(name) & (config->layer_index_size - 1);
+        while (config->layer_index[slot]) slot = (slot + 1) & (config->layer_index_size - 1);
+        config->layer_index[slot] = id;
+    }
+    return id;
 }
 
-struct LayerConf * new_layer_conf(struct Layer * layer, void (*conf)(struct Layer * layer)) {
+struct LayerConf * new_layer_conf(int layer, void (*conf)(struct Layer * layer)) {
     struct LayerConf * layer_conf = malloc(sizeof(struct LayerConf));
     layer_conf->layer = layer;
     layer_conf->conf = conf;
@@ -270,7 +400,7 @@ struct LayerConf * new_layer_conf(struct Layer * layer, void (*conf)(struct Laye
 }
 
 struct Remap * new_remap(KEY_DEF * from,
-                         struct Layer * layer,
+                         int layer,
                          struct KeyDefNode * to_when_alone,
                          struct KeyDefNode * to_with_other,
                          struct KeyDefNode * to_when_doublepress,
@@ -278,10 +408,11 @@ struct Remap * new_remap(KEY_DEF * from,
                          struct KeyDefNode * to_when_double_tap_lock) {
     struct Remap * remap = malloc(sizeof(struct Remap));
     remap->id = 0;
+    remap->line = 0;
     remap->from = from;
     remap->layer = layer;
-    remap->to_when_press_layer = NULL;
-    remap->to_when_doublepress_layer = NULL;
+    remap->to_when_press_layer = 0;
+    remap->to_when_doublepress_layer = 0;
     remap->to_when_tap_lock_layer = NULL;
     remap->to_when_double_tap_lock_layer = NULL;
     remap->to_when_alone = to_when_alone;
@@ -297,6 +428,7 @@ struct Remap * new_remap(KEY_DEF * from,
     remap->to_when_double_tap_lock_modifiers = 0;
     remap->to_when_alone_is_modifier_only = 0;
     remap->to_when_doublepress_is_modifier_only = 0;
+    remap->to_with_other_discarded = 0;
     remap->tap_lock = 0;
     remap->double_tap_lock = 0;
     remap->state = IDLE;
@@ -327,7 +459,7 @@ void append_layer_node(struct LayerNode ** list, struct LayerNode * elem) {
 
 int check_layer_states(struct LayerNode * layer_list, int expected_state) {
     while (layer_list) {
-        if (layer_list->layer->state != expected_state) {
+        if (get_layer(layer_list->layer)->state != expected_state) {
             return 0;
         }
         layer_list = layer_list->next;
@@ -335,17 +467,17 @@ int check_layer_states(struct LayerNode * layer_list, int expected_state) {
     return 1;
 }
 
-int is_master_layer(struct Layer * master_layer, struct Layer * slave_layer) {
-    struct LayerNode * master_iter = slave_layer->or_master_layers;
+int is_master_layer(int master_layer, int slave_layer) {
+    struct LayerNode * master_iter = get_layer(slave_layer)->or_master_layers;
     while (master_iter) {
         if (master_iter->layer == master_layer || is_master_layer(master_layer, master_iter->layer)) {
-            return master_iter->layer->state;
+            return get_layer(master_iter->layer)->state;
         }
         master_iter = master_iter->next;
     }
-    if (check_layer_states(slave_layer->and_master_layers, 1) &&
-        check_layer_states(slave_layer->and_not_master_layers, 0)) {
-        master_iter = slave_layer->and_master_layers;
+    if (check_layer_states(get_layer(slave_layer)->and_master_layers, 1) &&
+        check_layer_states(get_layer(slave_layer)->and_not_master_layers, 0)) {
+        master_iter = get_layer(slave_layer)->and_master_layers;
         while (master_iter) {
             if (master_iter->layer == master_layer || is_master_layer(master_layer, master_iter->layer)) {
                 return 1;
@@ -356,7 +488,7 @@ int is_master_layer(struct Layer * master_layer, struct Layer * slave_layer) {
     return 0;
 }
 
-int has_to_block_modifiers(struct Remap * remap, struct Layer * layer) {
+int has_to_block_modifiers(struct Remap * remap, int layer) {
     return remap && remap->layer &&
         (remap->layer == layer || is_master_layer(layer, remap->layer));
 }
@@ -415,20 +547,6 @@ void free_layer_nodes(struct LayerNode * head) {
     }
 }
 
-void free_layers(struct Layer * head) {
-    struct Layer * cur = head;
-    while (cur) {
-        struct Layer * layer = cur;
-        cur = cur->next;
-        free(layer->name);
-        free_layer_nodes(layer->or_master_layers);
-        free_layer_nodes(layer->and_master_layers);
-        free_layer_nodes(layer->and_not_master_layers);
-        free_layer_nodes(layer->slave_layers);
-        free(layer);
-    }
-}
-
 void free_layer_confs(struct LayerConf * head) {
     struct LayerConf * cur = head;
     while (cur) {
@@ -459,34 +577,75 @@ void free_remap_nodes(struct RemapNode * head) {
     }
 }
 
-void free_all() {
-    free(g_remap_parsee);
-    g_remap_parsee = NULL;
-    g_layer_parsee = NULL;
-    g_remap_list = NULL;
-    free_layers(g_layer_list);
-    g_layer_list = NULL;
+struct Config * new_config() {
+    struct Config * config = calloc(1, sizeof(struct Config));
+    config->rehook_timeout = 1000000;
+    config->unlock_timeout = 60000000;
+    config->priority = 1;
+    config->layer_count = 1;
+    return config;
+}
+
+void free_config(struct Config * config) {
+    if (!config) return;
+    free_config(config->next_profile);
+    free(config->profile_name);
+    struct ProfileMatch * match_iter = config->matches;
+    while (match_iter) {
+        struct ProfileMatch * match = match_iter;
+        match_iter = match_iter->next;
+        free(match->name);
+        free(match);
+    }
+    if (config->remap_parsee) free_remap(config->remap_parsee);
+    struct Remap * remap_iter = config->remap_list;
+    while (remap_iter) {
+        struct Remap * remap = remap_iter;
+        remap_iter = remap_iter->next;
+        free_remap(remap);
+    }
     for (int i = 0; i < 256; i++) {
-        free_remap_nodes(g_remap_array[i]);
-        g_remap_array[i] = NULL;
-        g_remap_by_id[i] = NULL;
+        free_remap_nodes(config->remap_array[i]);
     }
+    for (int i = 0; i < 512; i++) {
+        free_remap_nodes(config->remap_by_scan[i]);
+    }
+    for (int id = 1; id < config->layer_count; id++) {
+        struct Layer * layer = &config->layers[id];
+        free(layer->name);
+        free_layer_nodes(layer->or_master_layers);
+        free_layer_nodes(layer->and_master_layers);
+        free_layer_nodes(layer->and_not_master_layers);
+        free_layer_nodes(layer->slave_layers);
+    }
+    free(config->layers);
+    free(config->layer_index);
+    free(config);
 }
 
-struct Layer * find_layer(struct Layer * list, char * name) {
-    while (list) {
-        if (strcmp(list->name, name) == 0) {
-            return list;
-        }
-        list = list->next;
-    }
-    return NULL;
+static void use_config(struct Config * config) {
+    g_config = config;
+    g_profile = config->window_profile;
+    g_profile_changes++;
+    g_debug = config->debug;
+    g_hold_delay = config->hold_delay;
+    g_tap_timeout = config->tap_timeout;
+    g_doublepress_timeout = config->doublepress_timeout;
+    g_rehook_timeout = config->rehook_timeout;
+    g_unlock_timeout = config->unlock_timeout;
+    g_scancode = config->scancode;
+    g_priority = config->priority;
+    g_wheel_momentum = config->wheel_momentum;
+    g_full_capture = config->full_capture;
+    capture_update_keys(config);
 }
 
-struct Layer * append_layer(struct Layer ** list, struct Layer * elem) {
-    while (*list) list = &(*list)->next;
-    *list = elem;
-    return *list;
+/* Activates config at launch, or for a replay, before the thread of
+ * foreground_changed starts. */
+void activate_config(struct Config * config) {
+    g_config_latest = config;
+    config->window_profile = find_window_profile(config, g_foreground_window);
+    use_config(config);
 }
 
 void append_layer_conf(struct LayerConf ** list, struct LayerConf * elem) {
@@ -494,18 +653,18 @@ void append_layer_conf(struct LayerConf ** list, struct LayerConf * elem) {
     *list = elem;
 }
 
-int register_remap(struct Remap * remap) {
-    if (g_remap_list) {
-        struct Remap * tail = g_remap_list;
+int register_remap(struct Config * config, struct Remap * remap) {
+    if (config->remap_list) {
+        struct Remap * tail = config->remap_list;
         while (tail->next) tail = tail->next;
         if (tail->id == 255) return 1;
         tail->next = remap;
         remap->id = tail->id + 1;
     } else {
-        g_remap_list = remap;
+        config->remap_list = remap;
         remap->id = 1;
     }
-    g_remap_by_id[remap->id] = remap;
+    config->remap_by_id[remap->id] = remap;
     if (key_eq(remap->to_when_alone, remap->to_with_other)) {
         free_key_nodes(remap->to_with_other);
         remap->to_with_other = NULL;
@@ -521,6 +680,7 @@ int register_remap(struct Remap * remap) {
     if (remap->to_with_other) {
         remap->to_with_other_modifiers = modifiers(remap->to_with_other);
         if (!is_modifier_only(remap->to_with_other)) {
+            remap->to_with_other_discarded = 1;
             free_key_nodes(remap->to_with_other);
             remap->to_with_other = NULL;
             remap->to_with_other_modifiers = 0;
@@ -577,7 +737,7 @@ int send_key_def_input_down(char * input_name, struct KeyDefNode * head, int rem
     int key_sent = 0;
     struct KeyDefNode * cur = head;
     do {
-        if (!(modifiers_mask & KEY_ARRAY[cur->key_def->virt_code & 0xFF].modifier)) {
+        if (!(modifiers_mask & virt_code_modifier(cur->key_def->virt_code))) {
             log_send_input(input_name, cur->key_def, DOWN);
             send_input(cur->key_def->scan_code, cur->key_def->virt_code, DOWN, remap_id, input_buffer);
             key_sent = 1;
@@ -592,7 +752,7 @@ int send_key_def_input_up(char * input_name, struct KeyDefNode * head, int remap
     struct KeyDefNode * cur = head;
     do {
         cur = cur->previous;
-        if (!(modifiers_mask & KEY_ARRAY[cur->key_def->virt_code & 0xFF].modifier)) {
+        if (!(modifiers_mask & virt_code_modifier(cur->key_def->virt_code))) {
             log_send_input(input_name, cur->key_def, UP);
             send_input(cur->key_def->scan_code, cur->key_def->virt_code, UP, remap_id, input_buffer);
             key_sent = 1;
@@ -602,12 +762,11 @@ int send_key_def_input_up(char * input_name, struct KeyDefNode * head, int remap
 }
 
 void unlock_all(struct InputBuffer * input_buffer) {
-    struct Layer * layer_iter = g_layer_list;
-    while (layer_iter) {
-        layer_iter->state = 0;
-        layer_iter->lock = 0;
-        layer_iter->prev_lock = 0;
-        layer_iter = layer_iter->next;
+    recorder_unlock_all();
+    for (int id = 1; id < g_profile->layer_count; id++) {
+        g_profile->layers[id].state = 0;
+        g_profile->layers[id].lock = 0;
+        g_profile->layers[id].prev_lock = 0;
     }
     struct Remap * remap_iter = g_remap_list;
     while (remap_iter) {
@@ -643,8 +802,9 @@ void unlock_all(struct InputBuffer * input_buffer) {
 }
 
 /* @return block_input */
-int event_remapped_key_down(struct Remap * remap, DWORD time, struct InputBuffer * input_buffer) {
+int event_remapped_key_down(struct Remap * remap, uint64_t time, struct InputBuffer * input_buffer) {
     if (remap->state == IDLE) {
+        stats_press(remap, time);
         if (remap->to_with_other || remap->to_with_other_dummy) {
             remap->time = time;
             remap->state = HELD_DOWN_ALONE;
@@ -669,9 +829,12 @@ int event_remapped_key_down(struct Remap * remap, DWORD time, struct InputBuffer
             send_key_def_input_down("when_alone", remap->to_when_alone, remap->id, 0, input_buffer);
         }
     } else if (remap->state == TAPPED) {
+        stats_press(remap, time);
+        stats_count(remap, STAT_DOUBLE_TAP);
         remap->time = time;
         remap->state = DOUBLE_TAP;
         if (remap->to_when_tap_lock) {
+            stats_count(remap, STAT_TAP_LOCK);
             remap->tap_lock = 1 - remap->tap_lock;
             if (remap->tap_lock == 0) {
                 send_key_def_input_up("when_tap_lock", remap->to_when_tap_lock, remap->id, 0, input_buffer);
@@ -680,8 +843,9 @@ int event_remapped_key_down(struct Remap * remap, DWORD time, struct InputBuffer
         }
         struct LayerConf * layer_conf = remap->to_when_tap_lock_layer;
         while (layer_conf) {
-            layer_conf->layer->lock = layer_conf->layer->prev_lock;
-            set_layer_state(layer_conf->layer, layer_conf->layer->lock);
+            struct Layer * layer = get_layer(layer_conf->layer);
+            layer->lock = layer->prev_lock;
+            set_layer_state(layer_conf->layer, layer->lock);
             layer_conf = layer_conf->next;
         }
         if (remap->to_when_doublepress_layer) {
@@ -707,9 +871,11 @@ int event_remapped_key_down(struct Remap * remap, DWORD time, struct InputBuffer
 }
 
 /* @return block_input */
-int event_remapped_key_up(struct Remap * remap, DWORD time, struct InputBuffer * input_buffer) {
+int event_remapped_key_up(struct Remap * remap, uint64_t time, struct InputBuffer * input_buffer) {
+    stats_release(remap, time);
     if (remap->state == HELD_DOWN_ALONE) {
         if ((g_tap_timeout == 0) || (time - remap->time < g_tap_timeout)) {
+            stats_count(remap, STAT_TAP);
             remap->time = time;
             if (g_doublepress_timeout > 0)
                 remap->state = TAPPED;
@@ -720,6 +886,7 @@ int event_remapped_key_up(struct Remap * remap, DWORD time, struct InputBuffer *
                 send_key_def_input_up("when_alone", remap->to_when_alone, remap->id, 0, input_buffer);
             }
             if (remap->to_when_tap_lock) {
+                stats_count(remap, STAT_TAP_LOCK);
                 remap->tap_lock = 1 - remap->tap_lock;
                 if (remap->tap_lock) {
                     send_key_def_input_down("when_tap_lock", remap->to_when_tap_lock, remap->id, 0, input_buffer);
@@ -731,15 +898,16 @@ int event_remapped_key_up(struct Remap * remap, DWORD time, struct InputBuffer *
             }
             struct LayerConf * layer_conf = remap->to_when_tap_lock_layer;
             while (layer_conf) {
-                layer_conf->conf(layer_conf->layer);
-                set_layer_state(layer_conf->layer, layer_conf->layer->lock);
+                layer_conf->conf(get_layer(layer_conf->layer));
+                set_layer_state(layer_conf->layer, get_layer(layer_conf->layer)->lock);
                 layer_conf = layer_conf->next;
             }
         } else {
+            stats_count(remap, STAT_HOLD);
             remap->state = IDLE;
         }
         if (remap->to_when_press_layer) {
-            set_layer_state(remap->to_when_press_layer, remap->to_when_press_layer->lock);
+            set_layer_state(remap->to_when_press_layer, get_layer(remap->to_when_press_layer)->lock);
         }
     } else if (remap->state == HELD_DOWN_WITH_OTHER) {
         remap->state = IDLE;
@@ -748,10 +916,11 @@ int event_remapped_key_up(struct Remap * remap, DWORD time, struct InputBuffer *
             remap->active_modifiers = 0;
         }
         if (remap->to_when_press_layer) {
-            set_layer_state(remap->to_when_press_layer, remap->to_when_press_layer->lock);
+            set_layer_state(remap->to_when_press_layer, get_layer(remap->to_when_press_layer)->lock);
         }
     } else if (remap->state == TAP) {
         if ((g_tap_timeout == 0) || (time - remap->time < g_tap_timeout)) {
+            stats_count(remap, STAT_TAP);
             remap->time = time;
             if (g_doublepress_timeout > 0)
                 remap->state = TAPPED;
@@ -762,6 +931,7 @@ int event_remapped_key_up(struct Remap * remap, DWORD time, struct InputBuffer *
                 remap->active_modifiers = 0;
             }
             if (remap->to_when_tap_lock) {
+                stats_count(remap, STAT_TAP_LOCK);
                 remap->tap_lock = 1 - remap->tap_lock;
                 if (remap->tap_lock) {
                     send_key_def_input_down("when_tap_lock", remap->to_when_tap_lock, remap->id, 0, input_buffer);
@@ -773,11 +943,12 @@ int event_remapped_key_up(struct Remap * remap, DWORD time, struct InputBuffer *
             }
             struct LayerConf * layer_conf = remap->to_when_tap_lock_layer;
             while (layer_conf) {
-                layer_conf->conf(layer_conf->layer);
-                set_layer_state(layer_conf->layer, layer_conf->layer->lock);
+                layer_conf->conf(get_layer(layer_conf->layer));
+                set_layer_state(layer_conf->layer, get_layer(layer_conf->layer)->lock);
                 layer_conf = layer_conf->next;
             }
         } else {
+            stats_count(remap, STAT_HOLD);
             remap->state = IDLE;
             if (remap->to_when_alone) {
                 send_key_def_input_up("when_alone", remap->to_when_alone, remap->id, 0, input_buffer);
@@ -785,7 +956,7 @@ int event_remapped_key_up(struct Remap * remap, DWORD time, struct InputBuffer *
             }
         }
         if (remap->to_when_press_layer) {
-            set_layer_state(remap->to_when_press_layer, remap->to_when_press_layer->lock);
+            set_layer_state(remap->to_when_press_layer, get_layer(remap->to_when_press_layer)->lock);
         }
     } else if (remap->state == DOUBLE_TAP) {
         remap->state = IDLE;
@@ -799,6 +970,7 @@ int event_remapped_key_up(struct Remap * remap, DWORD time, struct InputBuffer *
         }
         if ((g_tap_timeout == 0) || (time - remap->time < g_tap_timeout)) {
             if (remap->to_when_double_tap_lock) {
+                stats_count(remap, STAT_DOUBLE_TAP_LOCK);
                 remap->double_tap_lock = 1 - remap->double_tap_lock;
                 if (remap->double_tap_lock) {
                     send_key_def_input_down("when_double_tap_lock", remap->to_when_double_tap_lock, remap->id, 0, input_buffer);
@@ -810,13 +982,13 @@ int event_remapped_key_up(struct Remap * remap, DWORD time, struct InputBuffer *
             }
             struct LayerConf * layer_conf = remap->to_when_double_tap_lock_layer;
             while (layer_conf) {
-                layer_conf->conf(layer_conf->layer);
-                set_layer_state(layer_conf->layer, layer_conf->layer->lock);
+                layer_conf->conf(get_layer(layer_conf->layer));
+                set_layer_state(layer_conf->layer, get_layer(layer_conf->layer)->lock);
                 layer_conf = layer_conf->next;
             }
         }
         if (remap->to_when_doublepress_layer) {
-            set_layer_state(remap->to_when_doublepress_layer, remap->to_when_doublepress_layer->lock);
+            set_layer_state(remap->to_when_doublepress_layer, get_layer(remap->to_when_doublepress_layer)->lock);
         }
     }
     if (remap->state == IDLE && remap->tap_lock == 0 && remap->double_tap_lock == 0) {
@@ -826,19 +998,22 @@ int event_remapped_key_up(struct Remap * remap, DWORD time, struct InputBuffer *
 }
 
 /* @return block_input */
-int event_other_input(int virt_code, enum Direction direction, DWORD time, int remap_id, struct InputBuffer * input_buffer) {
+int event_other_input(int virt_code, enum Direction direction, uint64_t time, int remap_id, struct InputBuffer * input_buffer) {
     int block_input = 0;
-    if (direction == DOWN && !KEY_ARRAY[virt_code & 0xFF].modifier) {
+    if (direction == DOWN && !virt_code_modifier(virt_code)) {
         struct Remap * remap = g_remap_list;
         while (remap) {
             if (remap->id != remap_id) {
+                stats_other(remap, time);
                 if (remap->state == HELD_DOWN_ALONE) {
                     if ((g_hold_delay > 0) && (time - remap->time < g_hold_delay) && remap->to_when_alone) {
+                        stats_count(remap, STAT_FORCED_TAP);
                         remap->state = TAP;
                         block_input |= send_key_def_input_down("when_alone", remap->to_when_alone, remap->id, 0, input_buffer);
                         remap->active_modifiers = remap->to_when_alone_modifiers;
                     } else {
-                        if (!has_to_block_modifiers(g_remap_by_id[remap_id], remap->to_when_press_layer)) {
+                        if (!has_to_block_modifiers(g_profile->remap_by_id[remap_id], remap->to_when_press_layer)) {
+                            stats_count(remap, STAT_WITH_OTHER);
                             remap->state = HELD_DOWN_WITH_OTHER;
                             if (remap->to_with_other) {
                                 block_input |= send_key_def_input_down("with_other", remap->to_with_other, remap->id, 0, input_buffer);
@@ -848,26 +1023,26 @@ int event_other_input(int virt_code, enum Direction direction, DWORD time, int r
                     }
                 } else if (remap->state == HELD_DOWN_WITH_OTHER) {
                     if (remap->to_with_other) {
-                        if (!has_to_block_modifiers(g_remap_by_id[remap_id], remap->to_when_press_layer)) {
+                        if (!has_to_block_modifiers(g_profile->remap_by_id[remap_id], remap->to_when_press_layer)) {
                             block_input |= send_key_def_input_down("with_other", remap->to_with_other, remap->id, 0, input_buffer);
                         } else {
-                            block_input |= send_key_def_input_up("with_other", remap->to_with_other, remap->id, g_remap_by_id[remap_id]->active_modifiers, input_buffer);
+                            block_input |= send_key_def_input_up("with_other", remap->to_with_other, remap->id, g_profile->remap_by_id[remap_id]->active_modifiers, input_buffer);
                         }
                     }
                 } else if (remap->state == TAP) {
                     if (remap->to_when_alone && remap->to_when_alone_is_modifier_only) {
-                        if (!has_to_block_modifiers(g_remap_by_id[remap_id], remap->to_when_press_layer)) {
+                        if (!has_to_block_modifiers(g_profile->remap_by_id[remap_id], remap->to_when_press_layer)) {
                             block_input |= send_key_def_input_down("when_alone", remap->to_when_alone, remap->id, 0, input_buffer);
                         } else {
-                            block_input |= send_key_def_input_up("when_alone", remap->to_when_alone, remap->id, g_remap_by_id[remap_id]->active_modifiers, input_buffer);
+                            block_input |= send_key_def_input_up("when_alone", remap->to_when_alone, remap->id, g_profile->remap_by_id[remap_id]->active_modifiers, input_buffer);
                         }
                     }
                 } else if (remap->state == DOUBLE_TAP) {
                     if (remap->to_when_doublepress && remap->to_when_doublepress_is_modifier_only) {
-                        if (!has_to_block_modifiers(g_remap_by_id[remap_id], remap->to_when_doublepress_layer)) {
+                        if (!has_to_block_modifiers(g_profile->remap_by_id[remap_id], remap->to_when_doublepress_layer)) {
                             block_input |= send_key_def_input_down("when_doublepress", remap->to_when_doublepress, remap->id, 0, input_buffer);
                         } else {
-                            block_input |= send_key_def_input_up("when_doublepress", remap->to_when_doublepress, remap->id, g_remap_by_id[remap_id]->active_modifiers, input_buffer);
+                            block_input |= send_key_def_input_up("when_doublepress", remap->to_when_doublepress, remap->id, g_profile->remap_by_id[remap_id]->active_modifiers, input_buffer);
                         }
                     }
                 } else {
@@ -887,14 +1062,140 @@ int event_other_input(int virt_code, enum Direction direction, DWORD time, int r
 }
 
 
+int has_held_remap() {
+    struct Remap * remap_iter = g_remap_list;
+    while (remap_iter) {
+        if (remap_iter->state != IDLE && remap_iter->state != TAPPED) {
+            return 1;
+        }
+        remap_iter = remap_iter->next;
+    }
+    return 0;
+}
+
+/* Hands a reloaded config over to the hook thread, which activates it
+ * between events, with the profile of the foreground window resolved. Runs
+ * on the thread of foreground_changed. */
+void publish_config(struct Config * config) {
+    config->window_profile = find_window_profile(config, g_foreground_window);
+    g_config_latest = config;
+    struct Config * unused = InterlockedExchangePointer((PVOID volatile *)&g_config_pending, config);
+    free_config(unused);
+}
+
+/*
+ * Activates the config published by publish_config, once no remap is held,
+ * so that held remaps complete under the config they were pressed with.
+ * Synthesized keys held by tap locks are released, layer locks are kept for
+ * the layers with the same name in the new config.
+ */
+void swap_pending_config(struct InputBuffer * input_buffer) {
+    if (!g_config_pending || has_held_remap()) return;
+    struct Config * config = InterlockedExchangePointer((PVOID volatile *)&g_config_pending, NULL);
+    if (!config) return;
+
+    struct Config * profile = config->window_profile;
+    int * locks = calloc(profile->layer_count, sizeof(int));
+    if (!locks) {
+        // Retry at the next event, unless a newer config was published since.
+        if (InterlockedCompareExchangePointer((PVOID volatile *)&g_config_pending, config, NULL)) {
+            free_config(config);
+        }
+        return;
+    }
+    for (int id = 1; id < g_profile->layer_count; id++) {
+        if (g_profile->layers[id].lock) {
+            locks[find_layer(profile, g_profile->layers[id].name)] = 1;
+        }
+    }
+    unlock_all(input_buffer);
+    struct Config * old_config = g_config;
+    use_config(config);
+    free_config(old_config);
+    for (int id = 1; id < g_profile->layer_count; id++) {
+        if (locks[id]) {
+            set_layer_lock(get_layer(id));
+            set_layer_state(id, 1);
+        }
+    }
+    free(locks);
+    DEBUG(1, debug_print(GREEN, "\nConfig reloaded"));
+}
+
+/*
+ * Switches to the profile of the foreground window, once no remap is held.
+ * Synthesized keys held by tap locks and layer locks of the previous
+ * profile are released.
+ */
+void switch_profile(struct InputBuffer * input_buffer) {
+    struct Config * profile = g_config->window_profile;
+    if (profile == g_profile || has_held_remap()) return;
+    unlock_all(input_buffer);
+    g_profile = profile;
+    g_profile_changes++;
+    DEBUG(1, debug_print(GREEN, "\nProfile %s", g_profile->profile_name ? g_profile->profile_name : "default"));
+}
+
+/*
+ * Resolves the profile of the new foreground window for the config activated
+ * or published last, which switch_profile then selects. Runs on the thread
+ * watching config.txt, like publish_config, so that the process name of a
+ * window is never looked up on the hook thread.
+ */
+void foreground_changed(void * window) {
+    g_foreground_window = window;
+    if (g_config_latest) {
+        g_config_latest->window_profile = find_window_profile(g_config_latest, window);
+    }
+}
+
+/* @return the first remap of the list whose layer is active */
+struct Remap * find_active_remap(struct RemapNode * remap_node_iter) {
+    while (remap_node_iter) {
+        if (remap_node_iter->remap->layer == 0) {
+            break;
+        } else if (get_layer(remap_node_iter->remap->layer)->state) {
+            break;
+        }
+        remap_node_iter = remap_node_iter->next;
+    }
+    return remap_node_iter ? remap_node_iter->remap : NULL;
+}
+
+/*
+ * @return the remap of the key, with the precedence of find_active_remap
+ * across the lists by scan code and by virtual code: a remap of an active
+ * layer before a base layer one, then keys told apart by their scan code
+ * first, e.g. NUMPAD_ENTER before ENTER.
+ */
+static struct Remap * find_key_remap(int scan_index, int virt_code) {
+    struct Remap * by_scan = scan_index >= 0 ? find_active_remap(g_profile->remap_by_scan[scan_index]) : NULL;
+    if (by_scan && by_scan->layer) return by_scan;
+    struct Remap * by_virt = find_active_remap(g_profile->remap_array[virt_code & 0xFF]);
+    if (by_scan && !(by_virt && by_virt->layer)) return by_scan;
+    return by_virt;
+}
+
 /* @return block_input */
-int handle_input(int scan_code, int virt_code, enum Direction direction, DWORD time, int is_injected, DWORD flags, ULONG_PTR dwExtraInfo, struct InputBuffer * input_buffer) {
-    struct Remap * remap_for_input;
+int handle_input(int scan_code, int virt_code, enum Direction direction, int is_injected, DWORD flags, ULONG_PTR dwExtraInfo, struct InputBuffer * input_buffer) {
+    uint64_t time = clock_now_us();
+    struct Remap * remap_for_input = NULL;
     int block_input;
     int remap_id = 0; // if 0 then no remapped injected key
 
+    swap_pending_config(input_buffer);
+    ipc_run_commands(input_buffer);
+    switch_profile(input_buffer);
     log_handle_input_start(scan_code, virt_code, direction, is_injected, flags, dwExtraInfo);
+    recorder_input(scan_code, virt_code, direction, time, is_injected, flags, dwExtraInfo);
+    if (!g_hook_degraded) {
+        // Left for later when short of time, see budget.c.
+        if (g_remap_stats_requested) write_remap_stats();
+        slow_path();
+    }
     if ((g_unlock_timeout > 0) && (time - g_last_input > g_unlock_timeout)) {
+        // Remaps still active after the timeout are likely stuck, keep their story.
+        if (g_remap_list && g_recorder_auto_dump) recorder_request_dump("unlock timeout");
         unlock_all(input_buffer);
     }
     if (is_injected && ((dwExtraInfo & 0xFFFFFF00) != INJECTED_KEY_ID || dwExtraInfo == INJECTED_KEY_ID)) {
@@ -915,6 +1216,8 @@ int handle_input(int scan_code, int virt_code, enum Direction direction, DWORD t
             remap_for_input = NULL;
             remap_id = dwExtraInfo & 0x000000FF;
         } else {
+            int scan_index = virt_code == MOUSE_DUMMY_VK ? -1 :
+                ((scan_code & 0xFF) | ((flags & LLKHF_EXTENDED) ? 0x100 : 0));
             struct Remap ** list = &g_remap_list;
             while (*list) {
                 if ((*list)->state == TAPPED && (time - (*list)->time >= g_doublepress_timeout)) {
@@ -926,40 +1229,39 @@ int handle_input(int scan_code, int virt_code, enum Direction direction, DWORD t
                         DEBUG(1, debug_print(RED, "\nRemap list depth = %d", remap_list_depth()));
                         continue;
                     }
-                } else if ((*list)->from->virt_code == virt_code) {
+                } else if ((*list)->from->by_scan ? scan_code_index((*list)->from->scan_code) == scan_index
+                                                  : (*list)->from->virt_code == virt_code) {
                     break;
                 }
                 list = &(*list)->next;
             }
             remap_for_input = *list;
             if (remap_for_input == NULL) {
-                struct RemapNode * remap_node_iter = g_remap_array[virt_code & 0xFF];
-                while (remap_node_iter) {
-                    if (remap_node_iter->remap->layer == NULL) {
-                        break;
-                    } else if (remap_node_iter->remap->layer->state) {
-                        break;
-                    }
-                    remap_node_iter = remap_node_iter->next;
-                }
-                if (remap_node_iter) {
-                    remap_for_input = remap_node_iter->remap;
-                } else {
-                    // auto_unlock if not modifier
-                }
+                remap_for_input = find_key_remap(scan_index, virt_code);
+                // auto_unlock if not modifier
             }
         }
         if (remap_for_input) {
+            int state = remap_for_input->state;
             if (direction == UP) {
                 block_input = event_remapped_key_up(remap_for_input, time, input_buffer);
             } else {
                 block_input = event_remapped_key_down(remap_for_input, time, input_buffer);
             }
+            if (remap_for_input->state != state) {
+                trace_state(remap_for_input->id, remap_for_input->from->virt_code, state, remap_for_input->state);
+            }
         } else {
             block_input = event_other_input(virt_code, direction, time, remap_id, input_buffer);
         }
     }
     log_handle_input_end(scan_code, virt_code, direction, block_input);
+    invariants_input(virt_code == MOUSE_DUMMY_VK ? -1 : ((scan_code & 0xFF) | ((flags & LLKHF_EXTENDED) ? 0x100 : 0)),
+                     virt_code, direction, is_injected, block_input);
+    recorder_result(block_input, remap_for_input ? remap_for_input->id : 0,
+                    remap_for_input ? remap_for_input->state : 0,
+                    remap_for_input ? (remap_for_input->tap_lock | remap_for_input->double_tap_lock << 1) : 0);
+    ipc_publish();
     return block_input;
 }
 
@@ -975,320 +1277,314 @@ void trim_newline(char * str) {
     }
 }
 
-int parsee_is_valid() {
-    return g_remap_parsee &&
-        g_remap_parsee->from &&
-        (g_remap_parsee->to_when_alone || g_remap_parsee->to_with_other ||
-         g_remap_parsee->to_when_doublepress ||
-         g_remap_parsee->to_when_tap_lock || g_remap_parsee->to_when_double_tap_lock ||
-         g_remap_parsee->to_when_press_layer || g_remap_parsee->to_when_doublepress_layer ||
-         g_remap_parsee->to_when_tap_lock_layer || g_remap_parsee->to_when_double_tap_lock_layer);
+int parsee_is_valid(struct Config * config) {
+    return config->remap_parsee &&
+        config->remap_parsee->from &&
+        (config->remap_parsee->to_when_alone || config->remap_parsee->to_with_other ||
+         config->remap_parsee->to_when_doublepress ||
+         config->remap_parsee->to_when_tap_lock || config->remap_parsee->to_when_double_tap_lock ||
+         config->remap_parsee->to_when_press_layer || config->remap_parsee->to_when_doublepress_layer ||
+         config->remap_parsee->to_when_tap_lock_layer || config->remap_parsee->to_when_double_tap_lock_layer);
 }
 
 /* @return error */
-int load_config_line(char * line, int linenum) {
-    if (line == NULL) {
-        if (parsee_is_valid()) {
-            if (register_remap(g_remap_parsee)) {
-                g_remap_parsee = NULL;
-                printf("Config error (line %d): Exceeded the maximum limit of 255 remappings.\n", linenum);
-                return 1;
-            }
-            g_remap_parsee = NULL;
-        }
-        while (g_remap_list) {
-            struct RemapNode * remap_node = new_remap_node(g_remap_list);
-            int index = g_remap_list->from->virt_code & 0xFF;
+int config_error(int linenum, int column, const char * format, ...) {
+    va_list args;
+    va_start(args, format);
+    printf("Config error (line %d, column %d): ", linenum, column);
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+    return 1;
+}
 
-            if (g_remap_list->layer || (g_remap_array[index] && !g_remap_array[index]->remap->layer)) {
-                remap_node->next = g_remap_array[index];
-                g_remap_array[index] = remap_node;
-            } else {
-                if (g_remap_array[index]) {
-                    struct RemapNode * tail = g_remap_array[index];
-                    while (tail->next && tail->next->remap->layer) tail = tail->next;
-                    remap_node->next = tail->next;
-                    tail->next = remap_node;
-                } else {
-                    g_remap_array[index] = remap_node;
-                }
-            }
-            g_remap_list = g_remap_list->next;
-        }
-        return 0;
+// Each config line is `keyword=value`. The keyword is looked up once in
+// g_config_keywords and its handler parses the value.
+struct ConfigKeyword;
+typedef int (* ConfigHandler)(struct Config * config, const struct ConfigKeyword * keyword,
+                              char * value, int linenum, int column);
+
+struct ConfigKeyword {
+    const char * name;
+    ConfigHandler handler;
+    size_t field; // offset in struct Config, struct Remap or struct Layer
+    size_t layer_field; // offset in struct Remap, for values that may be a layer
+    int is_flag; // setting only accepts 0 and 1
+    int is_global; // applies to the whole config, not to the profile being parsed
+};
+
+// Field of the keyword in object, as a pointer to type
+#define FIELD(object, type) ((type *)((char *)(object) + keyword->field))
+
+int parse_setting(struct Config * config, const struct ConfigKeyword * keyword, char * value, int linenum, int column) {
+    char * end;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || errno == ERANGE || number < INT_MIN || number > INT_MAX) {
+        return config_error(linenum, column + (int)(end - value), "Invalid number '%s'.", value);
     }
+    if (keyword->is_flag && number != 0 && number != 1) {
+        return config_error(linenum, column, "'%s' must be 0 or 1.", keyword->name);
+    }
+    *FIELD(config, int) = (int)number;
+    return 0;
+}
 
-    trim_newline(line);
+// Timeouts are written in ms and kept in us, see parse_time_ms.
+int parse_time_setting(struct Config * config, const struct ConfigKeyword * keyword, char * value, int linenum, int column) {
+    uint64_t us;
+    if (parse_time_ms(value, &us) || us > INT_MAX) {
+        return config_error(linenum, column, "Invalid time '%s', expected milliseconds like 200 or 0.5.", value);
+    }
+    *FIELD(config, int) = (int)us;
+    return 0;
+}
 
-    // Ignore comments and empty lines
-    if (line[0] == '#' || line[0] == '\0') {
-        return 0;
+/* @return error */
+int parse_layer_name(struct Config * config, char * value, int linenum, int column, int * layer) {
+    if (strncmp(value, "layer", strlen("layer")) != 0) {
+        return config_error(linenum, column, "Invalid layer name '%s', layer names start with 'layer'.", value);
     }
+    *layer = register_layer(config, value);
+    return 0;
+}
 
-    // Handle config declaration
-    if (sscanf(line, "debug=%d", &g_debug)) {
-        if (g_debug == 1 || g_debug == 0)
-            return 0;
+/* @return error */
+int parse_key_name(char * value, int linenum, int column, KEY_DEF ** key_def) {
+    *key_def = find_key_def_by_name(value);
+    if (!*key_def) {
+        return config_error(linenum, column, "Invalid key name '%s'.", value);
     }
+    return 0;
+}
 
-    if (sscanf(line, "hold_delay=%d", &g_hold_delay)) {
-        return 0;
+void append_key(struct KeyDefNode ** list, KEY_DEF * key_def) {
+    if (*list == NULL) {
+        *list = new_key_node(key_def);
+    } else {
+        append_key_node(*list, key_def);
     }
+}
 
-    if (sscanf(line, "tap_timeout=%d", &g_tap_timeout)) {
-        return 0;
+struct Remap * get_remap_parsee(struct Config * config) {
+    if (config->remap_parsee == NULL) {
+        config->remap_parsee = new_remap(NULL, 0, NULL, NULL, NULL, NULL, NULL);
     }
+    return config->remap_parsee;
+}
 
-    if (sscanf(line, "doublepress_timeout=%d", &g_doublepress_timeout)) {
-        return 0;
+int parse_remap_key(struct Config * config, const struct ConfigKeyword * keyword, char * value, int linenum, int column) {
+    KEY_DEF * key_def;
+    if (parse_key_name(value, linenum, column, &key_def)) return 1;
+    if (config->remap_parsee && config->remap_parsee->from) {
+        if (!parsee_is_valid(config)) {
+            return config_error(linenum, 1, "Incomplete remapping.\n"
+                                "Each remapping must have a 'remap_key', 'when_alone', and 'with_other'.");
+        }
+        if (register_remap(config, config->remap_parsee)) {
+            config->remap_parsee = NULL;
+            return config_error(linenum, 1, "Exceeded the maximum limit of 255 remappings.");
+        }
+        config->remap_parsee = NULL;
     }
+    struct Remap * remap = get_remap_parsee(config);
+    remap->from = key_def;
+    remap->line = linenum;
+    return 0;
+}
 
-    if (sscanf(line, "rehook_timeout=%d", &g_rehook_timeout)) {
+int parse_remap_layer(struct Config * config, const struct ConfigKeyword * keyword, char * value, int linenum, int column) {
+    return parse_layer_name(config, value, linenum, column, FIELD(get_remap_parsee(config), int));
+}
+
+int parse_remap_keys(struct Config * config, const struct ConfigKeyword * keyword, char * value, int linenum, int column) {
+    struct Remap * remap = get_remap_parsee(config);
+    if (keyword->layer_field && strncmp(value, "layer", strlen("layer")) == 0) {
+        *(int *)((char *)remap + keyword->layer_field) = register_layer(config, value);
         return 0;
     }
-
-    if (sscanf(line, "unlock_timeout=%d", &g_unlock_timeout)) {
+    if (keyword->field == offsetof(struct Remap, to_with_other) && value[0] == '\0') {
+        remap->to_with_other_dummy = 1;
         return 0;
     }
+    KEY_DEF * key_def;
+    if (parse_key_name(value, linenum, column, &key_def)) return 1;
+    append_key(FIELD(remap, struct KeyDefNode *), key_def);
+    return 0;
+}
 
-    if (sscanf(line, "scancode=%d", &g_scancode)) {
-        if (g_scancode == 1 || g_scancode == 0)
+int parse_remap_lock(struct Config * config, const struct ConfigKeyword * keyword, char * value, int linenum, int column) {
+    static const struct {
+        const char * prefix;
+        void (*conf)(struct Layer * layer);
+    } layer_confs[] = {
+        {"toggle_", toggle_layer_lock},
+        {"set_", set_layer_lock},
+        {"reset_", reset_layer_lock},
+    };
+    struct Remap * remap = get_remap_parsee(config);
+    for (int i = 0; i < sizeof(layer_confs) / sizeof(layer_confs[0]); i++) {
+        int length = strlen(layer_confs[i].prefix);
+        if (strncmp(value, layer_confs[i].prefix, length) == 0 && strncmp(value + length, "layer", strlen("layer")) == 0) {
+            int layer = register_layer(config, value + length);
+            append_layer_conf((struct LayerConf **)((char *)remap + keyword->layer_field), new_layer_conf(layer, layer_confs[i].conf));
             return 0;
+        }
     }
+    KEY_DEF * key_def;
+    if (parse_key_name(value, linenum, column, &key_def)) return 1;
+    append_key(FIELD(remap, struct KeyDefNode *), key_def);
+    return 0;
+}
 
-    if (sscanf(line, "priority=%d", &g_priority)) {
-        if (g_priority == 1 || g_priority == 0)
-            return 0;
+int parse_profile(struct Config * config, const struct ConfigKeyword * keyword, char * value, int linenum, int column) {
+    if (value[0] == '\0') {
+        return config_error(linenum, column, "Missing profile name.");
+    }
+    struct Config ** tail = &config->next_profile;
+    while (*tail) {
+        if (strcmp((*tail)->profile_name, value) == 0) {
+            return config_error(linenum, column, "Profile '%s' is already defined.", value);
+        }
+        tail = &(*tail)->next_profile;
     }
+    *tail = new_config();
+    (*tail)->profile_name = strdup(value);
+    config->profile_parsee = *tail;
+    return 0;
+}
 
-    // Handle key remappings
-    char * after_eq = (char *)strchr(line, '=');
-    if (!after_eq) {
-        printf("Config error (line %d): Couldn't understand '%s'.\n", linenum, line);
-        return 1;
+int parse_match(struct Config * config, const struct ConfigKeyword * keyword, char * value, int linenum, int column) {
+    if (config->profile_parsee == NULL) {
+        return config_error(linenum, 1, "Incomplete profile definition.\n"
+                            "Each profile definition must start with a 'profile'.");
     }
-    char * key_name = after_eq + 1;
-    KEY_DEF * key_def = find_key_def_by_name(key_name);
-    if (!key_def && strlen(key_name) != 0 &&
-        strncmp(key_name, "layer", strlen("layer")) &&
-        strncmp(key_name, "toggle_layer", strlen("toggle_layer")) &&
-        strncmp(key_name, "set_layer", strlen("set_layer")) &&
-        strncmp(key_name, "reset_layer", strlen("reset_layer"))) {
-        printf("Config error (line %d): Invalid key name '%s'.\n", linenum, key_name);
-        return 1;
+    if (value[0] == '\0') {
+        return config_error(linenum, column, "Missing executable name.");
     }
+    struct ProfileMatch * match = malloc(sizeof(struct ProfileMatch));
+    match->name = strdup(value);
+    match->next = config->profile_parsee->matches;
+    config->profile_parsee->matches = match;
+    return 0;
+}
+
+int parse_define_layer(struct Config * config, const struct ConfigKeyword * keyword, char * value, int linenum, int column) {
+    return parse_layer_name(config, value, linenum, column, &config->layer_parsee);
+}
 
-    if (g_remap_parsee == NULL) {
-        g_remap_parsee = new_remap(NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+int parse_master_layer(struct Config * config, const struct ConfigKeyword * keyword, char * value, int linenum, int column) {
+    if (config->layer_parsee == 0) {
+        return config_error(linenum, 1, "Incomplete layer definition.\n"
+                            "Each layer definition must start with a 'define_layer'.");
     }
+    int master_layer;
+    if (parse_layer_name(config, value, linenum, column, &master_layer)) return 1;
+    append_layer_node(FIELD(&config->layers[config->layer_parsee], struct LayerNode *), new_layer_node(master_layer));
+    append_layer_node(&config->layers[master_layer].slave_layers, new_layer_node(config->layer_parsee));
+    return 0;
+}
 
-    if (strncmp(line, "remap_key=", strlen("remap_key=")) == 0) {
-        if (g_remap_parsee->from && !parsee_is_valid()) {
-            printf("Config error (line %d): Incomplete remapping.\n"
-                   "Each remapping must have a 'remap_key', 'when_alone', and 'with_other'.\n",
-                   linenum);
-            return 1;
-        }
-        if (g_remap_parsee->from && parsee_is_valid()) {
-            if (register_remap(g_remap_parsee)) {
-                g_remap_parsee = NULL;
-                printf("Config error (line %d): Exceeded the maximum limit of 255 remappings.\n", linenum);
-                return 1;
-            }
-            g_remap_parsee = new_remap(NULL, NULL, NULL, NULL, NULL, NULL, NULL);
-        }
-        g_remap_parsee->from = key_def;
-    } else if (strncmp(line, "layer=", strlen("layer=")) == 0) {
-        if (strncmp(key_name, "layer", strlen("layer")) == 0) {
-            g_remap_parsee->layer = find_layer(g_layer_list, key_name);
-            if (g_remap_parsee->layer == NULL) {
-                g_remap_parsee->layer = append_layer(&g_layer_list, new_layer(key_name));
-            }
-        } else {
-            printf("Config error (line %d): Invalid key name '%s'.\n", linenum, key_name);
-            return 1;
-        }
-    } else if (strncmp(line, "when_alone=", strlen("when_alone=")) == 0) {
-        if (!key_def) {
-            printf("Config error (line %d): Invalid key name '%s'.\n", linenum, key_name);
-            return 1;
-        }
-        if (g_remap_parsee->to_when_alone == NULL) {
-            g_remap_parsee->to_when_alone = new_key_node(key_def);
-        } else {
-            append_key_node(g_remap_parsee->to_when_alone, key_def);
-        }
-    } else if (strncmp(line, "with_other=", strlen("with_other=")) == 0) {
-        if (!key_def && strlen(key_name) != 0) {
-            printf("Config error (line %d): Invalid key name '%s'.\n", linenum, key_name);
-            return 1;
-        }
-        if (strlen(key_name) == 0) {
-            g_remap_parsee->to_with_other_dummy = 1;
-        } else if (g_remap_parsee->to_with_other == NULL) {
-            g_remap_parsee->to_with_other = new_key_node(key_def);
-        } else {
-            append_key_node(g_remap_parsee->to_with_other, key_def);
-        }
-    } else if (strncmp(line, "when_press=", strlen("when_press=")) == 0) {
-        if (strncmp(key_name, "layer", strlen("layer")) == 0) {
-            g_remap_parsee->to_when_press_layer = find_layer(g_layer_list, key_name);
-            if (g_remap_parsee->to_when_press_layer == NULL) {
-                g_remap_parsee->to_when_press_layer = append_layer(&g_layer_list, new_layer(key_name));
-            }
-        } else {
-            printf("Config error (line %d): Invalid key name '%s'.\n", linenum, key_name);
-            return 1;
-        }
-    } else if (strncmp(line, "when_doublepress=", strlen("when_doublepress=")) == 0) {
-        if (strncmp(key_name, "layer", strlen("layer")) == 0) {
-            g_remap_parsee->to_when_doublepress_layer = find_layer(g_layer_list, key_name);
-            if (g_remap_parsee->to_when_doublepress_layer == NULL) {
-                g_remap_parsee->to_when_doublepress_layer = append_layer(&g_layer_list, new_layer(key_name));
-            }
-        } else {
-            if (!key_def) {
-                printf("Config error (line %d): Invalid key name '%s'.\n", linenum, key_name);
-                return 1;
-            }
-            if (g_remap_parsee->to_when_doublepress == NULL) {
-                g_remap_parsee->to_when_doublepress = new_key_node(key_def);
-            } else {
-                append_key_node(g_remap_parsee->to_when_doublepress, key_def);
-            }
-        }
-    } else if (strncmp(line, "when_tap_lock=", strlen("when_tap_lock=")) == 0) {
-        if (strncmp(key_name, "toggle_layer", strlen("toggle_layer")) == 0) {
-            struct Layer * layer = find_layer(g_layer_list, key_name + strlen("toggle_"));
-            if (layer == NULL) {
-                layer = append_layer(&g_layer_list, new_layer(key_name + strlen("toggle_")));
-            }
-            append_layer_conf(&g_remap_parsee->to_when_tap_lock_layer, new_layer_conf(layer, toggle_layer_lock));
-        } else if (strncmp(key_name, "set_layer", strlen("set_layer")) == 0) {
-            struct Layer * layer = find_layer(g_layer_list, key_name + strlen("set_"));
-            if (layer == NULL) {
-                layer = append_layer(&g_layer_list, new_layer(key_name + strlen("set_")));
-            }
-            append_layer_conf(&g_remap_parsee->to_when_tap_lock_layer, new_layer_conf(layer, set_layer_lock));
-        } else if (strncmp(key_name, "reset_layer", strlen("reset_layer")) == 0) {
-            struct Layer * layer = find_layer(g_layer_list, key_name + strlen("reset_"));
-            if (layer == NULL) {
-                layer = append_layer(&g_layer_list, new_layer(key_name + strlen("reset_")));
-            }
-            append_layer_conf(&g_remap_parsee->to_when_tap_lock_layer, new_layer_conf(layer, reset_layer_lock));
-        } else {
-            if (!key_def) {
-                printf("Config error (line %d): Invalid key name '%s'.\n", linenum, key_name);
-                return 1;
-            }
-            if (g_remap_parsee->to_when_tap_lock == NULL) {
-                g_remap_parsee->to_when_tap_lock = new_key_node(key_def);
-            } else {
-                append_key_node(g_remap_parsee->to_when_tap_lock, key_def);
-            }
-        }
-    } else if (strncmp(line, "when_double_tap_lock=", strlen("when_double_tap_lock=")) == 0) {
-        if (strncmp(key_name, "toggle_layer", strlen("toggle_layer")) == 0) {
-            struct Layer * layer = find_layer(g_layer_list, key_name + strlen("toggle_"));
-            if (layer == NULL) {
-                layer = append_layer(&g_layer_list, new_layer(key_name + strlen("toggle_")));
-            }
-            append_layer_conf(&g_remap_parsee->to_when_double_tap_lock_layer, new_layer_conf(layer, toggle_layer_lock));
-        } else if (strncmp(key_name, "set_layer", strlen("set_layer")) == 0) {
-            struct Layer * layer = find_layer(g_layer_list, key_name + strlen("set_"));
-            if (layer == NULL) {
-                layer = append_layer(&g_layer_list, new_layer(key_name + strlen("set_")));
-            }
-            append_layer_conf(&g_remap_parsee->to_when_double_tap_lock_layer, new_layer_conf(layer, set_layer_lock));
-        } else if (strncmp(key_name, "reset_layer", strlen("reset_layer")) == 0) {
-            struct Layer * layer = find_layer(g_layer_list, key_name + strlen("reset_"));
-            if (layer == NULL) {
-                layer = append_layer(&g_layer_list, new_layer(key_name + strlen("reset_")));
-            }
-            append_layer_conf(&g_remap_parsee->to_when_double_tap_lock_layer, new_layer_conf(layer, reset_layer_lock));
-        } else {
-            if (!key_def) {
-                printf("Config error (line %d): Invalid key name '%s'.\n", linenum, key_name);
-                return 1;
-            }
-            if (g_remap_parsee->to_when_double_tap_lock == NULL) {
-                g_remap_parsee->to_when_double_tap_lock = new_key_node(key_def);
-            } else {
-                append_key_node(g_remap_parsee->to_when_double_tap_lock, key_def);
-            }
-        }
-    } else if (strncmp(line, "define_layer=", strlen("define_layer=")) == 0) {
-        if (strncmp(key_name, "layer", strlen("layer")) == 0) {
-            g_layer_parsee = find_layer(g_layer_list, key_name);
-            if (g_layer_parsee == NULL) {
-                g_layer_parsee = append_layer(&g_layer_list, new_layer(key_name));
-            }
-        } else {
-            printf("Config error (line %d): Invalid key name '%s'.\n", linenum, key_name);
+#define SETTING(name) {#name, parse_setting, offsetof(struct Config, name), 0, 0, 1}
+#define FLAG_SETTING(name) {#name, parse_setting, offsetof(struct Config, name), 0, 1, 1}
+#define TIME_SETTING(name) {#name, parse_time_setting, offsetof(struct Config, name), 0, 0, 1}
+
+const struct ConfigKeyword g_config_keywords[] = {
+    {"remap_key", parse_remap_key, 0, 0, 0},
+    {"layer", parse_remap_layer, offsetof(struct Remap, layer), 0, 0},
+    {"when_alone", parse_remap_keys, offsetof(struct Remap, to_when_alone), 0, 0},
+    {"with_other", parse_remap_keys, offsetof(struct Remap, to_with_other), 0, 0},
+    {"when_press", parse_remap_layer, offsetof(struct Remap, to_when_press_layer), 0, 0},
+    {"when_doublepress", parse_remap_keys, offsetof(struct Remap, to_when_doublepress),
+     offsetof(struct Remap, to_when_doublepress_layer), 0},
+    {"when_tap_lock", parse_remap_lock, offsetof(struct Remap, to_when_tap_lock),
+     offsetof(struct Remap, to_when_tap_lock_layer), 0},
+    {"when_double_tap_lock", parse_remap_lock, offsetof(struct Remap, to_when_double_tap_lock),
+     offsetof(struct Remap, to_when_double_tap_lock_layer), 0},
+    {"define_layer", parse_define_layer, 0, 0, 0},
+    {"or_layer", parse_master_layer, offsetof(struct Layer, or_master_layers), 0, 0},
+    {"and_layer", parse_master_layer, offsetof(struct Layer, and_master_layers), 0, 0},
+    {"and_not_layer", parse_master_layer, offsetof(struct Layer, and_not_master_layers), 0, 0},
+    {"profile", parse_profile, 0, 0, 0, 1},
+    {"match", parse_match, 0, 0, 0, 1},
+    FLAG_SETTING(debug),
+    TIME_SETTING(hold_delay),
+    TIME_SETTING(tap_timeout),
+    TIME_SETTING(doublepress_timeout),
+    TIME_SETTING(rehook_timeout),
+    TIME_SETTING(unlock_timeout),
+    FLAG_SETTING(scancode),
+    FLAG_SETTING(priority),
+    SETTING(wheel_momentum),
+    FLAG_SETTING(full_capture),
+};
+
+#undef SETTING
+#undef FLAG_SETTING
+#undef TIME_SETTING
+#undef FIELD
+
+/* @return error */
+int finish_config(struct Config * config, int linenum) {
+    if (parsee_is_valid(config)) {
+        if (register_remap(config, config->remap_parsee)) {
+            config->remap_parsee = NULL;
+            printf("Config error (line %d): Exceeded the maximum limit of 255 remappings.\n", linenum);
             return 1;
         }
-    } else if (strncmp(line, "or_layer=", strlen("or_layer=")) == 0) {
-        if (strncmp(key_name, "layer", strlen("layer")) == 0) {
-            if (g_layer_parsee == NULL) {
-                printf("Config error (line %d): Incomplete layer definition.\n"
-                       "Each layer definition must start with a 'define_layer'.\n",
-                       linenum);
-                return 1;
-            } else {
-                struct Layer * master_layer = find_layer(g_layer_list, key_name);
-                if (master_layer == NULL) {
-                    master_layer = append_layer(&g_layer_list, new_layer(key_name));
-                }
-                append_layer_node(&g_layer_parsee->or_master_layers, new_layer_node(master_layer));
-                append_layer_node(&master_layer->slave_layers, new_layer_node(g_layer_parsee));
-            }
+        config->remap_parsee = NULL;
+    }
+    while (config->remap_list) {
+        struct RemapNode * remap_node = new_remap_node(config->remap_list);
+        KEY_DEF * from = config->remap_list->from;
+        struct RemapNode ** list = from->by_scan ? &config->remap_by_scan[scan_code_index(from->scan_code)]
+                                                 : &config->remap_array[from->virt_code & 0xFF];
+
+        if (config->remap_list->layer || (*list && !(*list)->remap->layer)) {
+            remap_node->next = *list;
+            *list = remap_node;
         } else {
-            printf("Config error (line %d): Invalid key name '%s'.\n", linenum, key_name);
-            return 1;
-        }
-    } else if (strncmp(line, "and_layer=", strlen("and_layer=")) == 0) {
-        if (strncmp(key_name, "layer", strlen("layer")) == 0) {
-            if (g_layer_parsee == NULL) {
-                printf("Config error (line %d): Incomplete layer definition.\n"
-                       "Each layer definition must start with a 'define_layer'.\n",
-                       linenum);
-                return 1;
+            if (*list) {
+                struct RemapNode * tail = *list;
+                while (tail->next && tail->next->remap->layer) tail = tail->next;
+                remap_node->next = tail->next;
+                tail->next = remap_node;
             } else {
-                struct Layer * master_layer = find_layer(g_layer_list, key_name);
-                if (master_layer == NULL) {
-                    master_layer = append_layer(&g_layer_list, new_layer(key_name));
-                }
-                append_layer_node(&g_layer_parsee->and_master_layers, new_layer_node(master_layer));
-                append_layer_node(&master_layer->slave_layers, new_layer_node(g_layer_parsee));
+                *list = remap_node;
             }
-        } else {
-            printf("Config error (line %d): Invalid key name '%s'.\n", linenum, key_name);
-            return 1;
         }
-    } else if (strncmp(line, "and_not_layer=", strlen("and_not_layer=")) == 0) {
-        if (strncmp(key_name, "layer", strlen("layer")) == 0) {
-            if (g_layer_parsee == NULL) {
-                printf("Config error (line %d): Incomplete layer definition.\n"
-                       "Each layer definition must start with a 'define_layer'.\n",
-                       linenum);
-                return 1;
-            } else {
-                struct Layer * master_layer = find_layer(g_layer_list, key_name);
-                if (master_layer == NULL) {
-                    master_layer = append_layer(&g_layer_list, new_layer(key_name));
-                }
-                append_layer_node(&g_layer_parsee->and_not_master_layers, new_layer_node(master_layer));
-                append_layer_node(&master_layer->slave_layers, new_layer_node(g_layer_parsee));
-            }
-        } else {
-            printf("Config error (line %d): Invalid key name '%s'.\n", linenum, key_name);
-            return 1;
+        config->remap_list = config->remap_list->next;
+    }
+    return 0;
+}
+
+/* @return error */
+int load_config_line(struct Config * config, char * line, int linenum) {
+    if (line == NULL) {
+        for (struct Config * profile = config; profile; profile = profile->next_profile) {
+            if (finish_config(profile, linenum)) return 1;
         }
-    } else {
-        after_eq[0] = 0;
-        printf("Config error (line %d): Invalid setting '%s'.\n", linenum, line);
-        return 1;
+        return 0;
     }
 
-    return 0;
+    trim_newline(line);
+
+    // Ignore comments and empty lines
+    if (line[0] == '#' || line[0] == '\0') {
+        return 0;
+    }
+
+    char * value = strchr(line, '=');
+    if (!value) {
+        return config_error(linenum, 1, "Couldn't understand '%s'.", line);
+    }
+    *value++ = '\0';
+    for (int i = 0; i < sizeof(g_config_keywords) / sizeof(g_config_keywords[0]); i++) {
+        const struct ConfigKeyword * keyword = &g_config_keywords[i];
+        if (strcmp(line, keyword->name) == 0) {
+            struct Config * target = (keyword->is_global || !config->profile_parsee) ? config : config->profile_parsee;
+            return keyword->handler(target, keyword, value, linenum, (int)(value - line) + 1);
+        }
+    }
+    return config_error(linenum, 1, "Invalid setting '%s'.", line);
 }
@@ -0,0 +1,541 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "platform.h"
+#include "input.h"
+
+// Trace replay
+// --------------------------------------
+//
+// Feeds a trace of input events to handle_input like keyboard_callback does,
+// with the engine clock set to the times of the trace, and records the result
+// of each event with the inputs it queued. The record can be compared with an expected one, e.g. the
+// record of a known good build, see `keyboard_remapper_headless --replay`.
+//
+// Trace lines: time_ms scan_code virt_code DOWN|UP [injected [extra]]
+// Times may have up to 3 decimals. Codes are decimal or 0x hex, scan codes
+// above 0xFF are extended (0xE0xx).
+// A line time_ms window process_name changes the foreground window to one of
+// that executable, through a stub window source (see profile.c): the profile
+// is resolved and switched like the backends do.
+// Grid warps are recorded as absolute moves over a stub screen of two
+// 1920x1080 monitors, from x = -1920.
+// A line time_ms reload config_path loads that config, relative to the trace,
+// and publishes it like the thread watching config.txt: it is swapped in at
+// the next event that finds no remap held.
+// Empty lines and lines starting with '#' are skipped.
+//
+// After the record, the trace is replayed again and again to time the engine:
+// ns/event and, where perf counters are available, cache and branch misses
+// per event, as JSON lines with --json.
+//
+// With --stats, the remap statistics of the record (see stats.c) are printed
+// to stderr before the timing, as CSV or JSON.
+//
+// Invariant violations (see invariants.c) are recorded as "! message" lines and
+// fail the replay. Mouse motion runs on a timer thread and is not part of the
+// record.
+
+#define REPLAY_TIMING_MS 200
+#define REPLAY_NAMES 16 // executables of the window lines and configs of the reload lines of a trace
+
+int g_replay_json = 0; // timings as JSON lines
+int g_replay_stats = 0; // print the remap statistics
+
+struct TraceEvent {
+    uint64_t time; // us
+    int scan_code;
+    int virt_code;
+    enum Direction direction;
+    int is_injected;
+    ULONG_PTR extra;
+    int window; // > 0: a window line, of the process g_replay_names[window - 1]
+    int reload; // > 0: a reload line, of the config g_replay_names[reload - 1]
+};
+
+static char * g_replay_names[REPLAY_NAMES];
+static int g_replay_name_count = 0;
+
+// The windows of the stub are their process id shifted, like handles.
+static unsigned long replay_window_process(void * window) {
+    return (unsigned long)((uintptr_t)window >> 4);
+}
+
+static int replay_process_name(unsigned long process_id, char * name, int size) {
+    if (process_id == 0 || process_id > g_replay_name_count) return 1;
+    snprintf(name, size, "%s", g_replay_names[process_id - 1]);
+    return 0;
+}
+
+static const struct WindowSource replay_window_source = {replay_window_process, replay_process_name};
+
+// Grid warps see two 1920x1080 screens, the primary one on the right.
+static void replay_screen_rect(int * left, int * top, int * width, int * height) {
+    *left = -1920;
+    *top = 0;
+    *width = 3840;
+    *height = 1080;
+}
+
+static const struct ScreenSource replay_screen_source = {replay_screen_rect};
+
+/* @return the index + 1 of the name, also the process id of an executable,
+ * 0 if there are too many */
+static int replay_name(const char * name) {
+    for (int i = 0; i < g_replay_name_count; i++) {
+        if (strcmp(g_replay_names[i], name) == 0) return i + 1;
+    }
+    if (g_replay_name_count == REPLAY_NAMES) return 0;
+    g_replay_names[g_replay_name_count++] = strdup(name);
+    return g_replay_name_count;
+}
+
+static void free_replay_names() {
+    for (int i = 0; i < g_replay_name_count; i++) free(g_replay_names[i]);
+    g_replay_name_count = 0;
+}
+
+/* @return the index + 1 of the path relative to the directory of the trace,
+ * 0 if there are too many */
+static int replay_config_path(const char * trace_path, const char * path) {
+    const char * slash = strrchr(trace_path, '/');
+    int length = path[0] == '/' || !slash ? 0 : (int)(slash - trace_path + 1);
+    char full_path[MAX_PATH];
+    snprintf(full_path, sizeof(full_path), "%.*s%s", length, trace_path, path);
+    return replay_name(full_path);
+}
+
+/* @return error */
+static int parse_trace_line(const char * trace_path, char * line, struct TraceEvent * event) {
+    char * end;
+    char * token = strtok(line, " \t\r\n");
+    if (parse_time_ms(token, &event->time)) return 1;
+    token = strtok(NULL, " \t\r\n");
+    if (!token) return 1;
+    event->window = 0;
+    event->reload = 0;
+    if (strcmp(token, "window") == 0) {
+        token = strtok(NULL, " \t\r\n");
+        if (!token) return 1;
+        event->window = replay_name(token);
+        return event->window == 0 || strtok(NULL, " \t\r\n") != NULL;
+    }
+    if (strcmp(token, "reload") == 0) {
+        token = strtok(NULL, " \t\r\n");
+        if (!token) return 1;
+        event->reload = replay_config_path(trace_path, token);
+        return event->reload == 0 || strtok(NULL, " \t\r\n") != NULL;
+    }
+    event->scan_code = strtol(token, &end, 0);
+    if (*end) return 1;
+    token = strtok(NULL, " \t\r\n");
+    if (!token) return 1;
+    event->virt_code = strtol(token, &end, 0);
+    if (*end) return 1;
+    token = strtok(NULL, " \t\r\n");
+    if (!token) return 1;
+    if (strcmp(token, "DOWN") == 0) {
+        event->direction = DOWN;
+    } else if (strcmp(token, "UP") == 0) {
+        event->direction = UP;
+    } else {
+        return 1;
+    }
+    event->is_injected = 0;
+    event->extra = 0;
+    if ((token = strtok(NULL, " \t\r\n"))) {
+        event->is_injected = strtol(token, &end, 0);
+        if (*end) return 1;
+    }
+    if ((token = strtok(NULL, " \t\r\n"))) {
+        event->extra = strtoull(token, &end, 0);
+        if (*end) return 1;
+    }
+    return strtok(NULL, " \t\r\n") != NULL;
+}
+
+/* @return number of events read to *events, -1 on error */
+int read_trace(const char * path, struct TraceEvent ** events) {
+    FILE * file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Cannot open trace file '%s'.\n", path);
+        return -1;
+    }
+    char * line = NULL;
+    size_t capacity = 0;
+    int count = 0;
+    int size = 0;
+    int linenum = 0;
+    *events = NULL;
+    while (read_line(file, &line, &capacity) >= 0) {
+        linenum++;
+        char * start = line + strspn(line, " \t\r\n");
+        if (*start == '\0' || *start == '#') continue;
+        if (count == size) {
+            size = size ? size * 2 : 256;
+            *events = realloc(*events, size * sizeof(struct TraceEvent));
+        }
+        if (parse_trace_line(path, start, &(*events)[count])) {
+            printf("Trace error (line %d): expected 'time_ms scan_code virt_code DOWN|UP [injected [extra]]',"
+                   " 'time_ms window process_name' or 'time_ms reload config_path'\n", linenum);
+            free(*events);
+            *events = NULL;
+            count = -1;
+            break;
+        }
+        count++;
+    }
+    free(line);
+    fclose(file);
+    return count;
+}
+
+// Moves the queued inputs out of input_buffer, printed to out if not NULL.
+void record_inputs(FILE * out, struct InputBuffer * input_buffer) {
+    uint32_t n, tail;
+    while (!input_buffer_empty(input_buffer)) {
+        n = input_buffer_move_cons_head(input_buffer, -2, &tail);
+        for (uint32_t i = 0; out && i < n; i++) {
+            INPUT * input = &input_buffer->inputs[(tail + i) & INPUT_BUFFER_MASK];
+            if (input->type == INPUT_KEYBOARD) {
+                fprintf(out, "key scan=0x%04X vk=0x%02X flags=0x%X extra=0x%lX\n",
+                        input->ki.wScan, input->ki.wVk, (unsigned)input->ki.dwFlags,
+                        (unsigned long)input->ki.dwExtraInfo);
+            } else {
+                fprintf(out, "mouse dx=%d dy=%d data=%d flags=0x%X extra=0x%lX\n",
+                        (int)input->mi.dx, (int)input->mi.dy, (int)input->mi.mouseData,
+                        (unsigned)input->mi.dwFlags, (unsigned long)input->mi.dwExtraInfo);
+            }
+        }
+        if (n > 0) input_buffer_update_tail(&input_buffer->cons, tail, n);
+    }
+}
+
+static char g_replay_invariants[1024]; // violations of the event being replayed
+static uint64_t g_replay_time = 0; // us, of the event being replayed
+
+static uint64_t replay_now_us() {
+    return g_replay_time;
+}
+
+static const struct ClockSource replay_clock_source = {replay_now_us};
+
+static void report_invariant(const char * message) {
+    size_t length = strlen(g_replay_invariants);
+    snprintf(g_replay_invariants + length, sizeof(g_replay_invariants) - length, "! %s\n", message);
+}
+
+static void replay_window(struct TraceEvent * event, uint64_t time, FILE * out) {
+    g_replay_time = time;
+    // Like the thread watching config.txt, then the engine it wakes.
+    foreground_changed((void *)((uintptr_t)event->window << 4));
+    switch_profile(&g_input_buffer);
+    if (out) {
+        print_time_ms(out, time);
+        fprintf(out, " window %s -> profile %s\n", g_replay_names[event->window - 1],
+                g_profile->profile_name ? g_profile->profile_name : "default");
+    }
+    record_inputs(out, &g_input_buffer);
+}
+
+static void replay_reload(struct TraceEvent * event, uint64_t time, FILE * out) {
+    const char * path = g_replay_names[event->reload - 1];
+    wchar_t config_path[MAX_PATH];
+    g_replay_time = time;
+    mbstowcs(config_path, path, MAX_PATH);
+    // Like the thread watching config.txt, a config with errors is not published.
+    struct Config * config = new_config();
+    if (load_config_file(config, config_path)) {
+        free_config(config);
+        config = NULL;
+    } else {
+        publish_config(config);
+    }
+    if (out) {
+        print_time_ms(out, time);
+        fprintf(out, " reload %s%s\n", path, config ? "" : " failed");
+    }
+}
+
+static void replay_event(struct TraceEvent * event, uint64_t time, FILE * out) {
+    if (event->window) {
+        replay_window(event, time, out);
+        return;
+    }
+    if (event->reload) {
+        replay_reload(event, time, out);
+        return;
+    }
+    DWORD flags = (event->scan_code > 0xFF ? LLKHF_EXTENDED : 0) |
+        (event->is_injected ? LLKHF_INJECTED : 0) |
+        (event->direction == UP ? LLKHF_UP : 0);
+    g_replay_time = time;
+    int block_input = handle_input(
+        event->scan_code & 0xFF,
+        event->virt_code,
+        event->direction,
+        event->is_injected,
+        flags,
+        event->extra,
+        &g_input_buffer
+    );
+    if (block_input == -1 && event->virt_code != MOUSE_DUMMY_VK) {
+        send_input(event->scan_code & 0xFF, event->virt_code, event->direction, 0, &g_input_buffer);
+    }
+    if (out) {
+        print_time_ms(out, time);
+        fprintf(out, " 0x%04X 0x%02X %s -> %d\n", event->scan_code, event->virt_code,
+                event->direction == UP ? "UP" : "DOWN", block_input);
+    }
+    record_inputs(out, &g_input_buffer);
+    if (out) fputs(g_replay_invariants, out);
+    g_replay_invariants[0] = '\0';
+}
+
+/* @return first line of a differing from b, 0 if they are the same */
+static int first_diff_line(const char * a, const char * b) {
+    int linenum = 1;
+    for (; *a == *b; a++, b++) {
+        if (*a == '\0') return 0;
+        if (*a == '\n') linenum++;
+    }
+    return linenum;
+}
+
+static void print_line(const char * prefix, const char * text, int linenum) {
+    for (int i = 1; i < linenum && text; i++) {
+        text = strchr(text, '\n');
+        if (text) text++;
+    }
+    if (!text || !*text) {
+        printf("%s<end>\n", prefix);
+        return;
+    }
+    printf("%s%.*s\n", prefix, (int)strcspn(text, "\n"), text);
+}
+
+/* @return text of the file, NULL on error */
+static char * read_file(const char * path) {
+    FILE * file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    size_t size = 0;
+    char * text = NULL;
+    size_t capacity = 0;
+    while (1) {
+        if (size + 4096 + 1 > capacity) {
+            capacity = capacity ? capacity * 2 : 8192;
+            text = realloc(text, capacity);
+        }
+        size_t n = fread(text + size, 1, 4096, file);
+        size += n;
+        if (n < 4096) break;
+    }
+    fclose(file);
+    text[size] = '\0';
+    return text;
+}
+
+// Timing
+// ----------------
+
+enum ReplayCounter {
+    COUNTER_CACHE_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_COUNT,
+};
+
+struct ReplayTiming {
+    long events; // replayed
+    double seconds;
+    int64_t counters[COUNTER_COUNT]; // -1 if not available
+};
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+/* @return fd of a hardware counter of this thread, -1 if not available */
+static int open_counter(uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static void start_counters(int * fds) {
+    for (int i = 0; i < COUNTER_COUNT; i++) fds[i] = -1;
+#ifdef __linux__
+    fds[COUNTER_CACHE_MISSES] = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+    fds[COUNTER_BRANCH_MISSES] = open_counter(PERF_COUNT_HW_BRANCH_MISSES);
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (fds[i] >= 0) ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static void stop_counters(int * fds, int64_t * counters) {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        counters[i] = -1;
+#ifdef __linux__
+        if (fds[i] < 0) continue;
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t value;
+        if (read(fds[i], &value, sizeof(value)) == sizeof(value)) counters[i] = (int64_t)value;
+        close(fds[i]);
+#endif
+    }
+}
+
+// Replays the trace again and again for REPLAY_TIMING_MS, nothing recorded.
+static void time_trace(struct TraceEvent * events, int count, struct ReplayTiming * timing) {
+    uint64_t span = events[count - 1].time - events[0].time + 1000;
+    uint64_t offset = events[count - 1].time + 1000;
+    int fds[COUNTER_COUNT];
+    struct timespec start, now;
+    timing->events = 0;
+    start_counters(fds);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        for (int i = 0; i < count; i++) {
+            replay_event(&events[i], events[i].time - events[0].time + offset, NULL);
+        }
+        offset += span;
+        timing->events += count;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timing->seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    } while (timing->seconds * 1000 < REPLAY_TIMING_MS);
+    stop_counters(fds, timing->counters);
+}
+
+static void print_counter(FILE * out, const char * name, int64_t counter, long events) {
+    if (counter < 0) {
+        fprintf(out, ", \"%s\": null", name);
+    } else {
+        fprintf(out, ", \"%s\": %.3f", name, (double)counter / events);
+    }
+}
+
+// On stderr, the record of the replay is on stdout.
+static void print_timing(const char * trace_path, int count, struct ReplayTiming * timing) {
+    double ns_per_event = timing->seconds * 1e9 / timing->events;
+    int remaps = 0;
+    for (int id = 1; id < 256; id++) {
+        if (g_config->remap_by_id[id]) remaps++;
+    }
+    if (!g_replay_json) {
+        fprintf(stderr, "%s: %d events, %.0f events/s, %.1f ns/event", trace_path, count,
+                timing->events / timing->seconds, ns_per_event);
+        if (timing->counters[COUNTER_CACHE_MISSES] >= 0) {
+            fprintf(stderr, ", %.3f cache misses/event",
+                    (double)timing->counters[COUNTER_CACHE_MISSES] / timing->events);
+        }
+        if (timing->counters[COUNTER_BRANCH_MISSES] >= 0) {
+            fprintf(stderr, ", %.3f branch misses/event",
+                    (double)timing->counters[COUNTER_BRANCH_MISSES] / timing->events);
+        }
+        fprintf(stderr, "\n");
+        return;
+    }
+    fprintf(stderr, "{\"trace\": ");
+    print_json_string(stderr, trace_path);
+    fprintf(stderr, ", \"events\": %d, \"remaps\": %d, \"layers\": %d, \"replayed\": %ld"
+                    ", \"ns_per_event\": %.2f, \"events_per_s\": %.0f",
+            count, remaps, g_config->layer_count - 1, timing->events, ns_per_event,
+            timing->events / timing->seconds);
+    print_counter(stderr, "cache_misses_per_event", timing->counters[COUNTER_CACHE_MISSES], timing->events);
+    print_counter(stderr, "branch_misses_per_event", timing->counters[COUNTER_BRANCH_MISSES], timing->events);
+    fprintf(stderr, "}\n");
+}
+
+/* @return exit code, 1 on errors or if the record differs from expected_path */
+int replay_trace(wchar_t * config_path, const char * trace_path, const char * expected_path) {
+    struct TraceEvent * events;
+    int count = read_trace(trace_path, &events);
+    if (count < 0) {
+        free_replay_names();
+        return 1;
+    }
+    struct Config * config = new_config();
+    if (load_config_file(config, config_path)) {
+        free_config(config);
+        free(events);
+        free_replay_names();
+        return 1;
+    }
+    set_window_source(&replay_window_source);
+    set_orbital_mouse_screen_source(&replay_screen_source);
+    activate_config(config);
+    input_buffer_init(&g_input_buffer);
+    set_clock_source(&replay_clock_source);
+    g_last_input = 0;
+    // Replays are not the timeouts of a user, nothing to keep.
+    g_recorder_auto_dump = 0;
+    reset_invariants();
+    g_invariant_report = report_invariant;
+
+    char * record = NULL;
+    size_t record_size = 0;
+    FILE * out = expected_path ? open_memstream(&record, &record_size) : stdout;
+    for (int i = 0; i < count; i++) {
+        replay_event(&events[i], events[i].time, out);
+    }
+    int exit_code = 0;
+    if (g_invariant_violations) {
+        printf("Replay of '%s' breaks %d invariant(s).\n", trace_path, g_invariant_violations);
+        exit_code = 1;
+    }
+    if (expected_path) {
+        fclose(out);
+        char * expected = read_file(expected_path);
+        if (expected == NULL) {
+            printf("Cannot open expected record '%s'.\n", expected_path);
+            exit_code = 1;
+        } else {
+            int linenum = first_diff_line(expected, record);
+            if (linenum) {
+                printf("Replay of '%s' differs from '%s' at line %d:\n", trace_path, expected_path, linenum);
+                print_line("- ", expected, linenum);
+                print_line("+ ", record, linenum);
+                exit_code = 1;
+            } else {
+                printf("Replay of '%s' matches '%s'.\n", trace_path, expected_path);
+            }
+            free(expected);
+        }
+        free(record);
+    }
+
+    if (g_replay_stats) {
+        if (!g_replay_json) fprintf(stderr, "# %s\n", trace_path);
+        print_remap_stats(stderr, g_replay_json);
+    }
+
+    // Throughput of the engine alone: the trace again and again, nothing recorded.
+    g_invariant_report = NULL;
+    if (count > 0) {
+        struct ReplayTiming timing;
+        time_trace(events, count, &timing);
+        print_timing(trace_path, count, &timing);
+    }
+
+    unlock_all(&g_input_buffer);
+    record_inputs(NULL, &g_input_buffer);
+    foreground_changed(NULL);
+    set_window_source(NULL);
+    set_orbital_mouse_screen_source(NULL);
+    free_replay_names();
+    free_config(InterlockedExchangePointer((PVOID volatile *)&g_config_pending, NULL));
+    free_config(g_config);
+    g_config = NULL;
+    set_clock_source(NULL);
+    free(events);
+    return exit_code;
+}
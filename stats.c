@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "input.h"
+
+// Remap statistics
+// --------------------------------------
+//
+// Counters kept in each remap, to pick hold_delay and tap_timeout from how
+// the keys are actually typed:
+// - what each press resolved to (tap, hold past tap_timeout, with_other,
+//   tap forced by hold_delay, double tap) and the lock toggles,
+// - how long the key was held,
+// - how long it overlapped the next key pressed while it was held, from
+//   that press to the release of the remap key.
+// Durations are counted in power of 2 buckets of ms, see stats_bucket. The
+// counters live in the remaps of the active config, a reload starts them
+// over.
+//
+// They are written as REMAP_STATS_FILE .csv and .json on demand, next to the
+// flight recorder dump, and printed by `--replay --stats`. The thread
+// handling the inputs copies them, the log thread writes the files.
+
+#define REMAP_STATS_FILE "remap_stats"
+
+static const char * stat_names[STAT_COUNT] = {
+    "presses", "taps", "holds", "with_other", "forced_taps", "double_taps",
+    "tap_lock_toggles", "double_tap_lock_toggles",
+};
+
+// Copy of the statistics of the remaps, to be printed on another thread.
+struct StatsRow {
+    const char * profile; // stored after the rows
+    int id;
+    int line;
+    const char * key;
+    struct RemapStats stats;
+};
+
+struct StatsSnapshot {
+    int count;
+    struct StatsRow rows[];
+};
+
+volatile int g_remap_stats_requested = 0; // set by other threads, see write_remap_stats
+static void * volatile g_stats_pending = NULL; // StatsSnapshot for the log thread
+
+// Bucket i counts durations below 2^i ms, the last one the longer ones.
+static int stats_bucket(uint64_t us) {
+    int bucket = 0;
+    for (uint64_t bound = 1000; us >= bound && bucket < STATS_BUCKETS - 1; bound *= 2) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void stats_count(struct Remap * remap, enum RemapStat stat) {
+    remap->stats.counts[stat]++;
+}
+
+void stats_press(struct Remap * remap, uint64_t time) {
+    remap->stats.counts[STAT_PRESS]++;
+    remap->stats.press_time = time;
+    remap->stats.held = 1;
+    remap->stats.overlapped = 0;
+}
+
+// Another key pressed while remap is held, only the first one counts.
+void stats_other(struct Remap * remap, uint64_t time) {
+    if (remap->stats.held && !remap->stats.overlapped) {
+        remap->stats.other_time = time;
+        remap->stats.overlapped = 1;
+    }
+}
+
+void stats_release(struct Remap * remap, uint64_t time) {
+    struct RemapStats * stats = &remap->stats;
+    if (!stats->held) return;
+    stats->press_ms[stats_bucket(time - stats->press_time)]++;
+    if (stats->overlapped) {
+        stats->overlap_ms[stats_bucket(time - stats->other_time)]++;
+    }
+    stats->held = 0;
+    stats->overlapped = 0;
+}
+
+void reset_remap_stats(struct Config * config) {
+    for (; config; config = config->next_profile) {
+        for (int id = 1; id < 256 && config->remap_by_id[id]; id++) {
+            memset(&config->remap_by_id[id]->stats, 0, sizeof(struct RemapStats));
+        }
+    }
+}
+
+/* Copies the statistics of every remap of the active config.
+ * @return snapshot to free, NULL if out of memory */
+static struct StatsSnapshot * take_stats_snapshot() {
+    int count = 0;
+    size_t names = 0;
+    for (struct Config * config = g_config; config; config = config->next_profile) {
+        for (int id = 1; id < 256 && config->remap_by_id[id]; id++) {
+            count++;
+        }
+        names += (config->profile_name ? strlen(config->profile_name) : 0) + 1;
+    }
+    size_t rows_size = sizeof(struct StatsSnapshot) + count * sizeof(struct StatsRow);
+    struct StatsSnapshot * snapshot = malloc(rows_size + names);
+    if (snapshot == NULL) return NULL;
+    snapshot->count = 0;
+    char * name = (char *)snapshot + rows_size;
+    for (struct Config * config = g_config; config; config = config->next_profile) {
+        const char * profile = config->profile_name ? config->profile_name : "";
+        size_t length = strlen(profile) + 1;
+        memcpy(name, profile, length);
+        for (int id = 1; id < 256 && config->remap_by_id[id]; id++) {
+            struct Remap * remap = config->remap_by_id[id];
+            struct StatsRow * row = &snapshot->rows[snapshot->count++];
+            row->profile = name;
+            row->id = id;
+            row->line = remap->line;
+            row->key = remap->from->name;
+            row->stats = remap->stats;
+        }
+        name += length;
+    }
+    return snapshot;
+}
+
+static void print_buckets_csv(FILE * out, const char * name) {
+    for (int i = 0; i < STATS_BUCKETS - 1; i++) {
+        fprintf(out, ",%s_lt%d", name, 1 << i);
+    }
+    fprintf(out, ",%s_ge%d", name, 1 << (STATS_BUCKETS - 2));
+}
+
+static void print_counts(FILE * out, const uint32_t * counts, int count, const char * separator) {
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%s%u", i ? separator : "", counts[i]);
+    }
+}
+
+static void print_stats_snapshot(FILE * out, struct StatsSnapshot * snapshot, int json) {
+    if (json) {
+        fprintf(out, "{\"bucket_ms\": [");
+        for (int i = 0; i < STATS_BUCKETS - 1; i++) {
+            fprintf(out, "%s%d", i ? ", " : "", 1 << i);
+        }
+        fprintf(out, "], \"remaps\": [");
+    } else {
+        fprintf(out, "profile,id,line,key");
+        for (int i = 0; i < STAT_COUNT; i++) {
+            fprintf(out, ",%s", stat_names[i]);
+        }
+        print_buckets_csv(out, "press_ms");
+        print_buckets_csv(out, "overlap_ms");
+        fprintf(out, "\n");
+    }
+    for (int r = 0; r < snapshot->count; r++) {
+        struct StatsRow * row = &snapshot->rows[r];
+        struct RemapStats * stats = &row->stats;
+        if (!json) {
+            fprintf(out, "%s,%d,%d,%s,", row->profile, row->id, row->line, row->key);
+            print_counts(out, stats->counts, STAT_COUNT, ",");
+            fprintf(out, ",");
+            print_counts(out, stats->press_ms, STATS_BUCKETS, ",");
+            fprintf(out, ",");
+            print_counts(out, stats->overlap_ms, STATS_BUCKETS, ",");
+            fprintf(out, "\n");
+            continue;
+        }
+        fprintf(out, "%s{\"profile\": ", r ? ", " : "");
+        print_json_string(out, row->profile);
+        fprintf(out, ", \"id\": %d, \"line\": %d, \"key\": ", row->id, row->line);
+        print_json_string(out, row->key);
+        for (int i = 0; i < STAT_COUNT; i++) {
+            fprintf(out, ", \"%s\": %u", stat_names[i], stats->counts[i]);
+        }
+        fprintf(out, ", \"press_ms\": [");
+        print_counts(out, stats->press_ms, STATS_BUCKETS, ", ");
+        fprintf(out, "], \"overlap_ms\": [");
+        print_counts(out, stats->overlap_ms, STATS_BUCKETS, ", ");
+        fprintf(out, "]}");
+    }
+    if (json) fprintf(out, "]}\n");
+}
+
+/* Prints the statistics of every remap of the active config, as CSV or as
+ * one JSON object. */
+void print_remap_stats(FILE * out, int json) {
+    struct StatsSnapshot * snapshot = take_stats_snapshot();
+    if (snapshot == NULL) return;
+    print_stats_snapshot(out, snapshot, json);
+    free(snapshot);
+}
+
+// Writes the pending snapshot, on the log thread.
+static void write_stats_files() {
+    struct StatsSnapshot * snapshot = InterlockedExchangePointer(&g_stats_pending, NULL);
+    if (snapshot == NULL) return;
+    int err = 0;
+    for (int json = 0; json <= 1; json++) {
+        const char * path = json ? REMAP_STATS_FILE ".json" : REMAP_STATS_FILE ".csv";
+        FILE * file = fopen(path, "w");
+        if (file == NULL) {
+            err = 1;
+            continue;
+        }
+        print_stats_snapshot(file, snapshot, json);
+        err |= fclose(file) != 0;
+    }
+    free(snapshot);
+    debug_file(err ? "Failed to write the remap statistics to " REMAP_STATS_FILE ".csv and .json"
+                   : "Remap statistics written to " REMAP_STATS_FILE ".csv and .json");
+}
+
+/* Copies the statistics on the thread handling the inputs, a config reload
+ * could free the remaps under another one, and leaves REMAP_STATS_FILE.csv
+ * and .json to the log thread.
+ * @return error */
+int write_remap_stats() {
+    g_remap_stats_requested = 0;
+    struct StatsSnapshot * snapshot = take_stats_snapshot();
+    if (snapshot == NULL) return 1;
+    free(InterlockedExchangePointer(&g_stats_pending, snapshot));
+    return log_defer(write_stats_files);
+}
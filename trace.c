@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <string.h>
+#include "platform.h"
+#include "input.h"
+
+// Trace export
+// --------------------------------------
+//
+// A timeline of the input pipeline for chrome://tracing or Perfetto, opt-in
+// with --trace trace.json: the hook callbacks with their duration, the state
+// changes of the remaps, the layer changes, the inputs queued to the output,
+// the output batches and the mouse timer ticks. Times are microseconds of
+// platform_time_us since trace_start, threads are the system thread ids.
+//
+// Like the debug log (log.c) the producers only fill fixed-size records in a
+// ring, dropped and counted when full, and a timer thread writes them out as
+// trace events, one JSON object per line. The file is a JSON array, closed
+// by trace_stop; the viewers also read it unclosed, e.g. after a crash.
+
+#define TRACE_BUFFER_SIZE 4096 // power of 2
+#define TRACE_BUFFER_MASK (TRACE_BUFFER_SIZE-1)
+#define TRACE_NAME_SIZE 24
+#define TRACE_INTERVAL_MS 100
+
+enum TraceType {
+    TRACE_HOOK,    // input callback
+    TRACE_STATE,   // remap state change
+    TRACE_LAYER,   // layer state change
+    TRACE_ENQUEUE, // key queued to the output
+    TRACE_SEND,    // output batch
+    TRACE_MOVE,    // mouse timer tick
+};
+
+struct TraceRecord {
+    uint8_t type;
+    uint8_t direction;
+    uint8_t from;
+    uint8_t to;
+    uint32_t thread;
+    uint32_t value; // remap id, layer state, inputs sent or move intervals
+    uint16_t virt_code;
+    uint64_t time;
+    uint64_t duration;
+    char name[TRACE_NAME_SIZE]; // layer names go with their config
+};
+
+struct TraceBuffer {
+    struct TraceRecord records[TRACE_BUFFER_SIZE];
+    volatile union rte_ring_hts_headtail prod;
+    volatile uint32_t cons_tail;
+    volatile LONG64 dropped;
+    volatile LONG64 lock; // of the writer
+};
+
+static struct TraceBuffer g_trace_buffer;
+static FILE * g_trace_file = NULL;
+static void * g_trace_timer = NULL;
+static uint64_t g_trace_start = 0;
+static LONG64 g_trace_dropped_reported = 0;
+static int g_trace_events = 0; // written
+
+/* Reserves the next record, to be filled and committed with trace_commit.
+ * @return record, NULL if tracing is off or the ring is full */
+static struct TraceRecord * trace_reserve(enum TraceType type, uint32_t * old_head) {
+    if (!g_trace_file) return NULL;
+    union rte_ring_hts_headtail new, old;
+    do {
+        do {
+            old = g_trace_buffer.prod;
+        } while (old.pos.head != old.pos.tail);
+        if (old.pos.head - g_trace_buffer.cons_tail >= TRACE_BUFFER_SIZE) {
+            InterlockedIncrement64(&g_trace_buffer.dropped);
+            return NULL;
+        }
+        new.pos.tail = old.pos.tail;
+        new.pos.head = old.pos.head + 1;
+    } while (InterlockedCompareExchange64(&g_trace_buffer.prod.raw, new.raw, old.raw) != old.raw);
+    *old_head = old.pos.head;
+    struct TraceRecord * record = &g_trace_buffer.records[old.pos.head & TRACE_BUFFER_MASK];
+    record->type = (uint8_t)type;
+    record->thread = (uint32_t)platform_thread_id();
+    record->time = platform_time_us();
+    return record;
+}
+
+static void trace_commit(uint32_t old_tail) {
+    g_trace_buffer.prod.pos.tail = old_tail + 1;
+}
+
+void trace_hook(uint64_t start, uint64_t end) {
+    uint32_t tail;
+    struct TraceRecord * record = trace_reserve(TRACE_HOOK, &tail);
+    if (!record) return;
+    record->time = start;
+    record->duration = end - start;
+    trace_commit(tail);
+}
+
+void trace_state(int remap_id, int virt_code, int from, int to) {
+    uint32_t tail;
+    struct TraceRecord * record = trace_reserve(TRACE_STATE, &tail);
+    if (!record) return;
+    record->value = remap_id;
+    record->virt_code = virt_code;
+    record->from = from;
+    record->to = to;
+    trace_commit(tail);
+}
+
+void trace_layer(const char * name, int state) {
+    uint32_t tail;
+    struct TraceRecord * record = trace_reserve(TRACE_LAYER, &tail);
+    if (!record) return;
+    snprintf(record->name, sizeof(record->name), "%s", name ? name : "");
+    record->value = state;
+    trace_commit(tail);
+}
+
+void trace_enqueue(int virt_code, enum Direction direction) {
+    uint32_t tail;
+    struct TraceRecord * record = trace_reserve(TRACE_ENQUEUE, &tail);
+    if (!record) return;
+    record->virt_code = virt_code;
+    record->direction = direction;
+    trace_commit(tail);
+}
+
+void trace_send(uint64_t start, int count) {
+    uint32_t tail;
+    struct TraceRecord * record = trace_reserve(TRACE_SEND, &tail);
+    if (!record) return;
+    record->duration = record->time - start;
+    record->time = start;
+    record->value = count;
+    trace_commit(tail);
+}
+
+void trace_move(int intervals) {
+    uint32_t tail;
+    struct TraceRecord * record = trace_reserve(TRACE_MOVE, &tail);
+    if (!record) return;
+    record->value = intervals;
+    trace_commit(tail);
+}
+
+// Names come from the config, quotes and backslashes are escaped, control characters dropped.
+void print_json_escaped(FILE * out, const char * text) {
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') fputc('\\', out);
+        if ((unsigned char)*text >= 0x20) fputc(*text, out);
+    }
+}
+
+void print_json_string(FILE * out, const char * text) {
+    fputc('"', out);
+    print_json_escaped(out, text);
+    fputc('"', out);
+}
+
+static void write_trace_record(FILE * out, struct TraceRecord * record) {
+    // Records of other threads may be committed out of order, the viewers sort them.
+    fprintf(out, "%s{\"pid\": 1, \"tid\": %u, \"ts\": %llu", g_trace_events++ ? ",\n" : "",
+            record->thread, (unsigned long long)(record->time - g_trace_start));
+    switch (record->type) {
+    case TRACE_HOOK:
+        fprintf(out, ", \"ph\": \"X\", \"dur\": %llu, \"name\": \"hook\"}", (unsigned long long)record->duration);
+        break;
+    case TRACE_STATE:
+        fprintf(out, ", \"ph\": \"i\", \"s\": \"t\", \"name\": \"");
+        print_json_escaped(out, friendly_virt_code_name(record->virt_code));
+        fprintf(out, " %s\", \"args\": {\"remap\": %u, \"from\": \"%s\"}}",
+                remap_state_name(record->to), record->value, remap_state_name(record->from));
+        break;
+    case TRACE_LAYER:
+        // A counter, one track per layer.
+        fprintf(out, ", \"ph\": \"C\", \"name\": \"layer ");
+        print_json_escaped(out, record->name);
+        fprintf(out, "\", \"args\": {\"state\": %u}}", record->value);
+        break;
+    case TRACE_ENQUEUE:
+        fprintf(out, ", \"ph\": \"i\", \"s\": \"t\", \"name\": \"enqueue ");
+        print_json_escaped(out, friendly_virt_code_name(record->virt_code));
+        fprintf(out, " %s\"}", record->direction == DOWN ? "DOWN" : "UP");
+        break;
+    case TRACE_SEND:
+        fprintf(out, ", \"ph\": \"X\", \"dur\": %llu, \"name\": \"send\", \"args\": {\"inputs\": %u}}",
+                (unsigned long long)record->duration, record->value);
+        break;
+    case TRACE_MOVE:
+        fprintf(out, ", \"ph\": \"i\", \"s\": \"t\", \"name\": \"mouse move\", \"args\": {\"intervals\": %u}}",
+                record->value);
+        break;
+    }
+}
+
+// Writes the committed records, from the timer thread or trace_stop.
+static void trace_flush() {
+    while (InterlockedCompareExchange64(&g_trace_buffer.lock, 1, 0) != 0);
+    uint32_t tail = g_trace_buffer.cons_tail;
+    uint32_t end = g_trace_buffer.prod.pos.tail;
+    for (; tail != end; tail++) {
+        write_trace_record(g_trace_file, &g_trace_buffer.records[tail & TRACE_BUFFER_MASK]);
+    }
+    g_trace_buffer.cons_tail = tail;
+    LONG64 dropped = g_trace_buffer.dropped;
+    if (dropped != g_trace_dropped_reported) {
+        fprintf(g_trace_file, "%s{\"pid\": 1, \"tid\": 0, \"ts\": %llu, \"ph\": \"i\", \"s\": \"g\""
+                ", \"name\": \"dropped\", \"args\": {\"records\": %lld}}", g_trace_events++ ? ",\n" : "",
+                (unsigned long long)(platform_time_us() - g_trace_start), (long long)(dropped - g_trace_dropped_reported));
+        g_trace_dropped_reported = dropped;
+    }
+    fflush(g_trace_file);
+    InterlockedCompareExchange64(&g_trace_buffer.lock, 0, 1);
+}
+
+static VOID CALLBACK trace_callback(PVOID arg, BOOLEAN timer_fired) {
+    if (g_trace_buffer.cons_tail != g_trace_buffer.prod.pos.tail) trace_flush();
+}
+
+/* Starts tracing to path, written by a timer thread.
+ * @return error */
+int trace_start(const char * path) {
+    FILE * file = fopen(path, "w");
+    if (file == NULL) {
+        printf("Cannot open the trace file '%s'.\n", path);
+        return 1;
+    }
+    fprintf(file, "[\n");
+    g_trace_start = platform_time_us();
+    g_trace_events = 0;
+    g_trace_file = file;
+    g_trace_timer = platform_timer_start(trace_callback, NULL, TRACE_INTERVAL_MS);
+    if (g_trace_timer == NULL) {
+        printf("Cannot start the trace timer.\n");
+        g_trace_file = NULL;
+        fclose(file);
+        return 1;
+    }
+    return 0;
+}
+
+// Writes what is left and closes the trace file.
+void trace_stop() {
+    if (!g_trace_file) return;
+    platform_timer_stop(g_trace_timer);
+    g_trace_timer = NULL;
+    trace_flush();
+    FILE * file = g_trace_file;
+    g_trace_file = NULL;
+    fprintf(file, "\n]\n");
+    fclose(file);
+}